@@ -0,0 +1,329 @@
+/**
+ * @file bandwidth.c
+ * @brief Measures memory bandwidth with STREAM-style kernels.
+ * @author Amod Malviya
+ *
+ * @details
+ * memory-access.c follows a chain of pointers, where each load has to wait for
+ * the previous one: that measures latency. Bandwidth is what we get when loads
+ * & stores don't depend on each other, and the CPU can keep many of them in
+ * flight. We measure it the way STREAM does, with four kernels over arrays much
+ * larger than the caches:
+ * - read: sum += a[i]
+ * - write: a[i] = s
+ * - copy: a[i] = b[i]
+ * - triad: a[i] = b[i] + s * c[i]
+ *
+ * Each kernel is written with scalar, SSE2, AVX2 & AVX-512 instructions (the ones
+ * the CPU doesn't support are skipped), and the ones that store, also with
+ * non-temporal stores (the "-nt" variants). A normal store first reads the cache
+ * line it writes to (write-allocate), so a kernel that stores moves more bytes
+ * than we count (twice as many, for write). A non-temporal store skips the cache,
+ * and with it that read.
+ *
+ * Everything runs on 1 thread, for the bandwidth a single core can pull, and on
+ * `THREADS` threads pinned to separate cores, for the whole socket.
+ *
+ * @section usage Usage
+ * ./build/bandwidth
+ *
+ * @section env Environment Variables
+ * - ARR_LEN: Length of each of the 3 arrays of doubles. Default is 1 << 24 (i.e.
+ *     128 MiB each). Should be several times the size of the last level cache.
+ * - THREADS: Number of threads for the multi-threaded runs. Default is the number
+ *     of cores we may run on; with SMT, threads beyond that share cores.
+ * - TRIALS: Number of times to run each kernel, of which the best is reported.
+ *     Default is 5.
+ */
+
+#include "common.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+enum { OP_READ, OP_WRITE, OP_COPY, OP_TRIAD, OPS };
+const char *OP_NAMES[OPS] = {"read", "write", "copy", "triad"};
+
+/**
+ * Number of arrays each kernel moves, i.e. 8 bytes per element each.
+ */
+const int OP_ARRAYS[OPS] = {1, 1, 2, 3};
+
+/**
+ * Arrays are split between threads in multiples of this many doubles (256
+ * bytes), so every slice is aligned for, and a whole number of, the widest
+ * (unrolled) vectors.
+ */
+#define SLICE_ALIGN 32
+
+typedef double (*kernel_fn)(double *a, const double *b, const double *c, size_t n);
+
+/*
+ * The scalar kernels. The empty asm keeps the compiler from vectorising the
+ * loops, or turning them into memset()/memcpy().
+ */
+double scalar_read(double *a, const double *UNUSED(b), const double *UNUSED(c), size_t n) {
+    // 4 sums, so that we aren't waiting on the latency of each add
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        __asm__ volatile("");
+        s0 += a[i];
+        s1 += a[i + 1];
+        s2 += a[i + 2];
+        s3 += a[i + 3];
+    }
+    return s0 + s1 + s2 + s3;
+}
+
+double scalar_write(double *a, const double *UNUSED(b), const double *UNUSED(c), size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __asm__ volatile("");
+        a[i] = 1.0;
+    }
+    return 0;
+}
+
+double scalar_copy(double *a, const double *b, const double *UNUSED(c), size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __asm__ volatile("");
+        a[i] = b[i];
+    }
+    return 0;
+}
+
+double scalar_triad(double *a, const double *b, const double *c, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __asm__ volatile("");
+        a[i] = b[i] + 3.0 * c[i];
+    }
+    return 0;
+}
+
+#ifdef __x86_64__
+/*
+ * The SIMD kernels, the same for every instruction set but for the width of
+ * its vectors (`W` doubles) & the names of its intrinsics. Each is compiled for
+ * its instruction set alone, so the program still runs on CPUs without it.
+ */
+#define READ_KERNEL(name, isa, vec_t, W, load, add, zero) \
+__attribute__((target(isa))) \
+double name##_read(double *a, const double *UNUSED(b), const double *UNUSED(c), size_t n) { \
+    vec_t s0 = zero(), s1 = zero(), s2 = zero(), s3 = zero(); \
+    for (size_t i = 0; i < n; i += 4 * W) { \
+        s0 = add(s0, load(a + i)); \
+        s1 = add(s1, load(a + i + W)); \
+        s2 = add(s2, load(a + i + 2 * W)); \
+        s3 = add(s3, load(a + i + 3 * W)); \
+    } \
+    double lanes[W], sum = 0; \
+    const vec_t s = add(add(s0, s1), add(s2, s3)); \
+    memcpy(lanes, &s, sizeof(s)); \
+    for (int i = 0; i < W; i++) { \
+        sum += lanes[i]; \
+    } \
+    return sum; \
+}
+
+#define STORE_KERNELS(name, isa, vec_t, W, load, store, set1, add, mul, fence) \
+__attribute__((target(isa))) \
+double name##_write(double *a, const double *UNUSED(b), const double *UNUSED(c), size_t n) { \
+    const vec_t v = set1(1.0); \
+    for (size_t i = 0; i < n; i += W) { \
+        store(a + i, v); \
+    } \
+    fence(); \
+    return 0; \
+} \
+__attribute__((target(isa))) \
+double name##_copy(double *a, const double *b, const double *UNUSED(c), size_t n) { \
+    for (size_t i = 0; i < n; i += W) { \
+        store(a + i, load(b + i)); \
+    } \
+    fence(); \
+    return 0; \
+} \
+__attribute__((target(isa))) \
+double name##_triad(double *a, const double *b, const double *c, size_t n) { \
+    const vec_t s = set1(3.0); \
+    for (size_t i = 0; i < n; i += W) { \
+        store(a + i, add(load(b + i), mul(s, load(c + i)))); \
+    } \
+    fence(); \
+    return 0; \
+}
+
+// normal stores need no fence; non-temporal ones need an sfence to be ordered
+#define NO_FENCE()
+
+READ_KERNEL(sse2, "sse2", __m128d, 2, _mm_load_pd, _mm_add_pd, _mm_setzero_pd)
+STORE_KERNELS(sse2, "sse2", __m128d, 2, _mm_load_pd, _mm_store_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd, NO_FENCE)
+STORE_KERNELS(sse2_nt, "sse2", __m128d, 2, _mm_load_pd, _mm_stream_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd, _mm_sfence)
+
+READ_KERNEL(avx2, "avx2", __m256d, 4, _mm256_load_pd, _mm256_add_pd, _mm256_setzero_pd)
+STORE_KERNELS(avx2, "avx2", __m256d, 4, _mm256_load_pd, _mm256_store_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_mul_pd, NO_FENCE)
+STORE_KERNELS(avx2_nt, "avx2", __m256d, 4, _mm256_load_pd, _mm256_stream_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_mul_pd, _mm_sfence)
+
+READ_KERNEL(avx512, "avx512f", __m512d, 8, _mm512_load_pd, _mm512_add_pd, _mm512_setzero_pd)
+STORE_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_load_pd, _mm512_store_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_mul_pd, NO_FENCE)
+STORE_KERNELS(avx512_nt, "avx512f", __m512d, 8, _mm512_load_pd, _mm512_stream_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_mul_pd, _mm_sfence)
+#endif
+
+int always(void) {
+    return 1;
+}
+
+#ifdef __x86_64__
+int has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+int has_avx512(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+/**
+ * A set of kernels written with one instruction set.
+ */
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    kernel_fn kernels[OPS];  // NULL where there's no such kernel
+} Variant;
+
+const Variant VARIANTS[] = {
+    {"scalar", always, {scalar_read, scalar_write, scalar_copy, scalar_triad}},
+#ifdef __x86_64__
+    {"sse2", always, {sse2_read, sse2_write, sse2_copy, sse2_triad}},
+    {"sse2-nt", always, {NULL, sse2_nt_write, sse2_nt_copy, sse2_nt_triad}},
+    {"avx2", has_avx2, {avx2_read, avx2_write, avx2_copy, avx2_triad}},
+    {"avx2-nt", has_avx2, {NULL, avx2_nt_write, avx2_nt_copy, avx2_nt_triad}},
+    {"avx512", has_avx512, {avx512_read, avx512_write, avx512_copy, avx512_triad}},
+    {"avx512-nt", has_avx512, {NULL, avx512_nt_write, avx512_nt_copy, avx512_nt_triad}},
+#endif
+};
+
+/**
+ * One thread's share of a run of a kernel.
+ */
+typedef struct {
+    kernel_fn kernel;
+    double *a, *b, *c;
+    size_t n;
+    int cpu;
+    Barrier *start_line;
+    uint64_t start;
+    uint64_t end;
+    double result;
+} Worker;
+
+void *run_worker(void *arg) {
+    Worker *w = arg;
+    pin_to_cpu(w->cpu);
+
+    // wait for all threads to be pinned & ready, so that they run together
+    barrier_wait(w->start_line);
+
+    w->start = now_ns();
+    w->result = w->kernel(w->a, w->b, w->c, w->n);
+    w->end = now_ns();
+    return NULL;
+}
+
+/**
+ * Runs `kernel` on `threads` threads, each on its own slice of the arrays, and
+ * returns how long it took from the first thread starting to the last finishing.
+ */
+uint64_t run_threads(kernel_fn kernel, double *a, double *b, double *c, size_t slice, int threads) {
+    pthread_t ids[threads];
+    Worker workers[threads];
+    Barrier start_line;
+    barrier_init(&start_line, threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){kernel, a + i * slice, b + i * slice, c + i * slice, slice, bench_cpu(i), &start_line, 0, 0, 0};
+        if (pthread_create(&ids[i], NULL, run_worker, &workers[i]) != 0) {
+            die_perror("pthread_create");
+        }
+    }
+    uint64_t start = UINT64_MAX, end = 0;
+    double result = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        start = MIN(start, workers[i].start);
+        end = MAX(end, workers[i].end);
+        result += workers[i].result;
+    }
+    BENCH_SINK += result == 42;
+    return end - start;
+}
+
+/**
+ * Prints a row of the best bandwidth (GB/s) of each kernel of `variant` on
+ * `threads` threads, over `trials` runs.
+ */
+void print_bandwidths(const Variant *variant, double *a, double *b, double *c, size_t len, int threads, int trials) {
+    const size_t slice = len / threads / SLICE_ALIGN * SLICE_ALIGN;
+    printf("%-10s %7d", variant->name, threads);
+    for (int op = 0; op < OPS; op++) {
+        if (variant->kernels[op] == NULL) {
+            printf(" %8s", "-");
+            continue;
+        }
+        uint64_t best = UINT64_MAX;
+        for (int t = 0; t < trials; t++) {
+            best = MIN(best, run_threads(variant->kernels[op], a, b, c, slice, threads));
+        }
+        const double bytes = (double)OP_ARRAYS[op] * sizeof(double) * slice * threads;
+        printf(" %8.1f", bytes / best);
+        fflush(stdout);
+    }
+    printf("\n");
+}
+
+/**
+ * Main entry point of the program.
+ */
+int main(int UNUSED(argc), char const* UNUSED(argv[])) {
+    const size_t len = MAX(1l << 12, get_env_long("ARR_LEN", 1l << 24));
+    // every thread needs a slice of at least SLICE_ALIGN elements
+    int threads = bench_threads();
+    if ((size_t)threads > len / SLICE_ALIGN) {
+        fprintf(stderr, "warning: %zu elements are only enough for %zu threads, not %d\n", len, len / SLICE_ALIGN, threads);
+        threads = len / SLICE_ALIGN;
+    }
+    const int trials = MAX(1, get_env_int("TRIALS", 5));
+
+    // allocate the arrays via mmap, so that they're page aligned
+    double *arrays[3];
+    for (int i = 0; i < 3; i++) {
+        arrays[i] = mmap(NULL, len * sizeof(double), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arrays[i] == MAP_FAILED) {
+            die_perror("mmap");
+        }
+        // fault the pages in from the threads that will use them, so that on
+        // NUMA machines each slice lives next to its thread's core
+        const size_t slice = len / threads / SLICE_ALIGN * SLICE_ALIGN;
+        run_threads(scalar_write, arrays[i], arrays[i], arrays[i], slice, threads);
+    }
+
+    const Bytes size = bytes(len * sizeof(double));
+    printf("bandwidth in GB/s, best of %d, over 3 arrays of %ld %sB\n", trials, size.sz_abbr, size.suffix);
+    printf("%-10s %7s %8s %8s %8s %8s\n", "kernel", "threads", OP_NAMES[0], OP_NAMES[1], OP_NAMES[2], OP_NAMES[3]);
+    const int thread_counts[] = {1, threads};
+    for (int t = 0; t < (threads > 1 ? 2 : 1); t++) {
+        for (size_t v = 0; v < sizeof(VARIANTS) / sizeof(VARIANTS[0]); v++) {
+            if (VARIANTS[v].supported()) {
+                print_bandwidths(&VARIANTS[v], arrays[0], arrays[1], arrays[2], len, thread_counts[t], trials);
+            }
+        }
+    }
+
+    // clean up & exit
+    for (int i = 0; i < 3; i++) {
+        munmap(arrays[i], len * sizeof(double));
+    }
+    return 0;
+}
@@ -17,7 +17,9 @@
  * - ARR_LEN: Length of the array to be used. Default is to have enough integers to
  *     fill a page.
  * - THRESHOLD: Threshold value to use for the comparison (branch). Default is 0.
- * - TIMES: Number of times to run the comparison. Default is 100000.
+ * - TIMES: Minimum number of times to run each side of the comparison. Default is 100000.
+ * - SAMPLES: Number of timed samples of each side. Default is 31.
+ * - COUNTERS: Set to 1 to also report IPC & cache/branch/TLB misses from hardware counters.
  */
 
 #include "common.h"
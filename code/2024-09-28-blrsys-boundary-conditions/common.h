@@ -8,9 +8,15 @@
 #define COMMON_H
 
 #ifdef __linux__
-#define _DEFAULT_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <sys/mman.h>
 #include <stdint.h>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
 #undef MIN
 #define MIN(a,b)             \
@@ -29,6 +35,9 @@
 })
 #endif
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -133,6 +142,719 @@ Bytes bytes(size_t size) {
     return (Bytes){size, sz_abbr, BYTE_SUFFIXES[i]};
 }
 
+/**
+ * Returns a monotonic timestamp in nanoseconds. On Linux, this is the raw
+ * hardware clock, unaffected by NTP slewing.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Results of a body are added here, so that the compiler can't drop the work.
+ */
+volatile int BENCH_SINK = 0;
+
+/**
+ * A sample (batch of executions of a body) should take at least this long,
+ * for the clock's resolution & overhead not to matter.
+ */
+#define BENCH_MIN_BATCH_NS 50000ull
+
+/**
+ * Summary of the samples of a body: all times are in ns per execution.
+ */
+typedef struct {
+    double median;
+    double mad;     // median absolute deviation from the median
+    double p5;
+    double p95;
+    long batch;     // executions per sample
+    int samples;
+} Timing;
+
+/**
+ * Returns the number of samples to take of each body, from the `SAMPLES`
+ * environment variable.
+ */
+int bench_samples(void) {
+    const int samples = get_env_int("SAMPLES", 31);
+    return samples < 5 ? 5 : samples;
+}
+
+int cmp_double(const void *a, const void *b) {
+    const double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * Returns the `p`th quantile (0 <= p <= 1) of the sorted array, interpolating
+ * between the two closest values.
+ */
+double quantile(const double *sorted, int n, double p) {
+    const double pos = p * (n - 1);
+    const int i = (int)pos;
+    return i + 1 < n ? sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]) : sorted[n - 1];
+}
+
+/**
+ * Summarises `n` samples (sorting them in place), each of `batch` executions.
+ */
+Timing timing_of(double *ns, int n, long batch) {
+    qsort(ns, n, sizeof(double), cmp_double);
+    Timing t = {quantile(ns, n, 0.5), 0, quantile(ns, n, 0.05), quantile(ns, n, 0.95), batch, n};
+    double *dev = malloc(n * sizeof(double));
+    for (int i = 0; i < n; i++) {
+        dev[i] = ns[i] > t.median ? ns[i] - t.median : t.median - ns[i];
+    }
+    qsort(dev, n, sizeof(double), cmp_double);
+    t.mad = quantile(dev, n, 0.5);
+    free(dev);
+    return t;
+}
+
+/**
+ * Returns the median of `n` values drawn (with replacement) from `ns`, using
+ * `rng` as the state of a xorshift generator.
+ */
+double resampled_median(const double *ns, int n, double *scratch, uint64_t *rng) {
+    for (int i = 0; i < n; i++) {
+        *rng ^= *rng << 13;
+        *rng ^= *rng >> 7;
+        *rng ^= *rng << 17;
+        scratch[i] = ns[*rng % n];
+    }
+    qsort(scratch, n, sizeof(double), cmp_double);
+    return quantile(scratch, n, 0.5);
+}
+
+/**
+ * Estimates a 95% confidence interval on how many times slower body 2 is than
+ * body 1 (the ratio of their medians), by bootstrapping their samples.
+ */
+void speedup_ci(const double *ns1, const double *ns2, int n, double *lo, double *hi) {
+    const int ROUNDS = 2000;
+    double *ratios = malloc(ROUNDS * sizeof(double));
+    double *scratch = malloc(n * sizeof(double));
+    uint64_t rng = 0x9e3779b97f4a7c15ull; // fixed, so that reruns agree
+    for (int r = 0; r < ROUNDS; r++) {
+        const double m1 = resampled_median(ns1, n, scratch, &rng);
+        ratios[r] = resampled_median(ns2, n, scratch, &rng) / m1;
+    }
+    qsort(ratios, ROUNDS, sizeof(double), cmp_double);
+    *lo = quantile(ratios, ROUNDS, 0.025);
+    *hi = quantile(ratios, ROUNDS, 0.975);
+    free(scratch);
+    free(ratios);
+}
+
+/**
+ * Hardware counters that can be collected (with `COUNTERS=1`) alongside timings.
+ */
+#define PERF_COUNTERS 6
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_DTLB_MISSES };
+const char *PERF_COUNTER_NAMES[PERF_COUNTERS] = {
+    "cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses"
+};
+
+/**
+ * Values of all counters, at a point in time or summed over samples, with how
+ * long each was enabled and actually running on the PMU. When more counters are
+ * asked for than the PMU has, the kernel multiplexes them, and a count only
+ * covers the time it was running: summed counts are scaled up to the time it
+ * was enabled.
+ */
+typedef struct {
+    uint64_t v[PERF_COUNTERS];
+    uint64_t enabled[PERF_COUNTERS];
+    uint64_t running[PERF_COUNTERS];
+} CounterValues;
+
+/**
+ * The counters of this thread, opened as two groups: cycles, instructions and
+ * branch misses, which any PMU can count at once, and the cache & TLB misses.
+ * The counters of a group count over the same instructions. Where the PMU has
+ * too few counters for all of them, the kernel takes turns with the groups, so
+ * that each counts for a share of the time (a single group that didn't fit
+ * would never be scheduled, and count nothing).
+ * A counter that couldn't be opened has fd -1.
+ */
+typedef struct {
+    int initialized;
+    int available;  // number of counters that could be opened
+    int fds[PERF_COUNTERS];
+#ifdef __linux__
+    struct perf_event_mmap_page *pages[PERF_COUNTERS];
+#endif
+} PerfCounters;
+
+PerfCounters PERF = {.fds = {-1, -1, -1, -1, -1, -1}};
+
+#ifdef __linux__
+/**
+ * Opens the counters (once), if asked for by the `COUNTERS` environment
+ * variable, and returns how many could be. Where there are none (e.g. in most
+ * VMs), says so once and returns 0, and benchmarks report timings only.
+ */
+int counters_open(void) {
+    if (PERF.initialized) {
+        return PERF.available;
+    }
+    PERF.initialized = 1;
+    if (get_env_int("COUNTERS", 0) == 0) {
+        return 0;
+    }
+    const uint64_t cache_read_miss = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    const struct {
+        uint32_t type;
+        uint64_t config;
+        int group;
+    } EVENTS[PERF_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cache_read_miss, 1},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | cache_read_miss, 1},
+    };
+    int leaders[2] = {-1, -1}, error = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        int *leader = &leaders[EVENTS[i].group];
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = EVENTS[i].type;
+        attr.config = EVENTS[i].config;
+        attr.disabled = *leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        PERF.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, *leader, 0);
+        PERF.pages[i] = NULL;
+        if (PERF.fds[i] < 0) {
+            error = errno;
+            continue;
+        }
+        if (*leader < 0) {
+            *leader = PERF.fds[i];
+        }
+        // the page through which the counter can be read with rdpmc
+        void *page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, PERF.fds[i], 0);
+        PERF.pages[i] = page != MAP_FAILED ? page : NULL;
+        PERF.available++;
+    }
+    if (PERF.available == 0) {
+        fprintf(stderr, "counters: unavailable (perf_event_open: %s), reporting timings only\n", strerror(error));
+        return 0;
+    }
+    for (int g = 0; g < 2; g++) {
+        if (leaders[g] >= 0) {
+            ioctl(leaders[g], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+    return PERF.available;
+}
+
+/**
+ * Returns the value of counter `i`, and how long (in ns) it has been enabled
+ * and running. If the kernel lets us, it's read from user space with rdpmc &
+ * rdtsc, which takes a few ns; else with a read() syscall.
+ */
+uint64_t counter_value(int i, uint64_t *enabled, uint64_t *running) {
+#if defined(__x86_64__) || defined(__i386__)
+    volatile struct perf_event_mmap_page *pc = PERF.pages[i];
+    if (pc != NULL && pc->cap_user_rdpmc) {
+        uint32_t seq, index;
+        uint64_t count;
+        int timed;
+        // the kernel bumps `lock` while it updates the page (e.g. when we're
+        // rescheduled), so retry until we've seen a consistent snapshot
+        do {
+            seq = pc->lock;
+            __asm__ volatile("" ::: "memory");
+            index = pc->index;
+            *enabled = pc->time_enabled;
+            *running = pc->time_running;
+            // the times are as of the last update of the page: add the time since
+            // then (which the counter has been running for, if it's on the PMU)
+            timed = *enabled == *running || pc->cap_user_time;
+            if (timed && pc->cap_user_time) {
+                uint32_t lo, hi;
+                __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+                const uint64_t cycles = (uint64_t)hi << 32 | lo;
+                const uint16_t shift = pc->time_shift;
+                const uint32_t mult = pc->time_mult;
+                const uint64_t quot = cycles >> shift;
+                const uint64_t rem = cycles & (((uint64_t)1 << shift) - 1);
+                const uint64_t delta = pc->time_offset + quot * mult + ((rem * mult) >> shift);
+                *enabled += delta;
+                *running += index != 0 ? delta : 0;
+            }
+            count = pc->offset;
+            if (index != 0) {
+                uint32_t lo, hi;
+                __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+                const int shift = 64 - pc->pmc_width;
+                count += (uint64_t)((int64_t)(((uint64_t)hi << 32 | lo) << shift) >> shift);
+            }
+            __asm__ volatile("" ::: "memory");
+        } while (pc->lock != seq);
+        if (index != 0 && timed) {
+            return count;
+        }
+    }
+#endif
+    // with PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING
+    uint64_t value[3] = {0, 0, 0};
+    if (read(PERF.fds[i], value, sizeof(value)) != sizeof(value)) {
+        value[0] = value[1] = value[2] = 0;
+    }
+    *enabled = value[1];
+    *running = value[2];
+    return value[0];
+}
+
+/**
+ * Reads all counters that could be opened.
+ */
+void counters_read(CounterValues *values) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        values->enabled[i] = values->running[i] = 0;
+        values->v[i] = PERF.fds[i] >= 0 ? counter_value(i, &values->enabled[i], &values->running[i]) : 0;
+    }
+}
+#else
+int counters_open(void) {
+    if (!PERF.initialized && get_env_int("COUNTERS", 0) != 0) {
+        fprintf(stderr, "counters: unavailable (needs Linux), reporting timings only\n");
+    }
+    PERF.initialized = 1;
+    return 0;
+}
+
+void counters_read(CounterValues *values) {
+    memset(values, 0, sizeof(*values));
+}
+#endif
+
+/**
+ * Adds the counts between `before` and `after` to `total`, scaled up by how
+ * much of the time in between each counter was enabled but not running.
+ */
+void counters_add(CounterValues *total, const CounterValues *before, const CounterValues *after) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        const uint64_t enabled = after->enabled[i] - before->enabled[i];
+        const uint64_t running = after->running[i] - before->running[i];
+        total->enabled[i] += enabled;
+        total->running[i] += running;
+        if (running > 0) {
+            total->v[i] += (uint64_t)((double)(after->v[i] - before->v[i]) * enabled / running + 0.5);
+        }
+    }
+}
+
+/**
+ * Prints IPC, and each counter per execution of a body, from counts summed
+ * over `executions`. A counter that never got on the PMU (e.g. more were asked
+ * for than it has) is "n/a"; one that only sometimes did is marked with the
+ * share of the time it counted for, as its value is an estimate.
+ */
+void print_counters(const CounterValues *c, long executions) {
+    printf("  %-16s", "");
+    if (PERF.fds[PERF_CYCLES] >= 0 && PERF.fds[PERF_INSTRUCTIONS] >= 0 && c->running[PERF_CYCLES] > 0
+            && c->running[PERF_INSTRUCTIONS] > 0 && c->v[PERF_CYCLES] > 0) {
+        printf(" IPC %.2f,", (double)c->v[PERF_INSTRUCTIONS] / c->v[PERF_CYCLES]);
+    }
+    printf(" per execution:");
+    const char *sep = " ";
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (PERF.fds[i] < 0) {
+            continue;
+        }
+        if (c->running[i] == 0) {
+            printf("%sn/a %s", sep, PERF_COUNTER_NAMES[i]);
+        } else if (c->running[i] < c->enabled[i]) {
+            printf("%s%.1f %s (%.0f%% counted)", sep, (double)c->v[i] / executions, PERF_COUNTER_NAMES[i],
+                c->running[i] * 100.0 / c->enabled[i]);
+        } else {
+            printf("%s%.1f %s", sep, (double)c->v[i] / executions, PERF_COUNTER_NAMES[i]);
+        }
+        sep = ", ";
+    }
+    printf("\n");
+}
+
+void print_timing(const char *id, const Timing *t) {
+    printf("  %-16s median %10.1f ns, MAD %8.1f ns, p5 %10.1f ns, p95 %10.1f ns [%d samples x %ld]\n",
+        id, t->median, t->mad, t->p5, t->p95, t->samples, t->batch);
+}
+
+/**
+ * Prints which of two bodies is faster from their samples, and by how much,
+ * with a 95% confidence interval. If the interval includes no difference,
+ * there's no winner to call. Counters (if any were collected) are printed
+ * per execution under each body's timing.
+ */
+void print_comparison(const char *msg, const char *id1, double *ns1, long batch1, const CounterValues *c1,
+        const char *id2, double *ns2, long batch2, const CounterValues *c2, int n) {
+    double lo, hi;
+    speedup_ci(ns1, ns2, n, &lo, &hi);
+    Timing t1 = timing_of(ns1, n, batch1);
+    Timing t2 = timing_of(ns2, n, batch2);
+    if (t2.median < t1.median) {
+        const char *id = id1;
+        id1 = id2;
+        id2 = id;
+        const Timing t = t1;
+        t1 = t2;
+        t2 = t;
+        const CounterValues *c = c1;
+        c1 = c2;
+        c2 = c;
+        const double l = lo;
+        lo = 1 / hi;
+        hi = 1 / l;
+    }
+    const double faster_by = (t2.median / t1.median - 1) * 100;
+    if (lo > 1) {
+        printf("%s: %s is faster than %s by %.1f%% [95%% CI %.1f%%..%.1f%%] (%.1f vs %.1f ns)\n", msg, id1, id2,
+            faster_by, (lo - 1) * 100, (hi - 1) * 100, t1.median, t2.median);
+    } else {
+        printf("%s: no significant difference between %s and %s (%.1f%%, 95%% CI %.1f%%..%.1f%%) (%.1f vs %.1f ns)\n",
+            msg, id1, id2, faster_by, (lo - 1) * 100, (hi - 1) * 100, t1.median, t2.median);
+    }
+    print_timing(id1, &t1);
+    if (PERF.available > 0) {
+        print_counters(c1, t1.batch * n);
+    }
+    print_timing(id2, &t2);
+    if (PERF.available > 0) {
+        print_counters(c2, t2.batch * n);
+    }
+}
+
+/*
+ * Finds how many executions of `body` a sample needs to last BENCH_MIN_BATCH_NS,
+ * doubling from 1. This also warms up the caches & predictors.
+ */
+#define CALIBRATE_BATCH(body) ({ \
+    long _batch = 1; \
+    int _csum = 0; \
+    for (;;) { \
+        const uint64_t _start = now_ns(); \
+        for (long _i = 0; _i < _batch; _i++) { \
+            _csum += body; \
+        } \
+        if (now_ns() - _start >= BENCH_MIN_BATCH_NS || _batch >= (1l << 30)) { \
+            break; \
+        } \
+        _batch <<= 1; \
+    } \
+    BENCH_SINK += _csum; \
+    _batch; \
+})
+
+/*
+ * Executes `body` batch times, and returns the time taken per execution in ns.
+ */
+#define TIME_BATCH(batch, body) ({ \
+    long _count = (batch); \
+    int _tsum = 0; \
+    const uint64_t _start = now_ns(); \
+    while (_count--) { \
+        _tsum += body; \
+    } \
+    const double _ns = (double)(now_ns() - _start) / (batch); \
+    BENCH_SINK += _tsum; \
+    _ns; \
+})
+
+/**
+ * The CPUs we may run on: those of our affinity mask when first asked (e.g.
+ * under `taskset`, or in a container limited to some CPUs), which aren't always
+ * 0..n-1. Elsewhere, and if the mask can't be read, all online CPUs.
+ *
+ * With SMT, a core shows up as 2 (or more) CPUs, which share its caches & load
+ * ports: two threads on them would measure half a core each. So the first
+ * `cores` CPUs are one per core (the lowest of its siblings we may run on, from
+ * `/sys/devices/system/cpu/cpuN/topology/thread_siblings_list`), and the other
+ * siblings come after, for when more threads than cores are asked for. If the
+ * topology can't be read (e.g. not Linux), every CPU counts as a core.
+ */
+#ifndef CPU_SETSIZE
+#define CPU_SETSIZE 1024
+#endif
+
+typedef struct {
+    int count;
+    int cores;
+    int cpus[CPU_SETSIZE];
+} BenchCpus;
+
+/**
+ * Returns the lowest CPU in `allowed` which shares a core with `cpu` (maybe
+ * `cpu` itself), or `cpu` if its siblings can't be read.
+ */
+int first_sibling(int cpu, const char *allowed) {
+    char path[96];
+    char list[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return cpu;
+    }
+    const int read = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if (!read) {
+        return cpu;
+    }
+    // A list of CPUs and ranges, e.g. "0,64" or "0-1".
+    char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        const long from = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long to = from;
+        p = end;
+        if (*p == '-') {
+            to = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long sibling = from; sibling <= to && sibling < cpu; sibling++) {
+            if (sibling >= 0 && allowed[sibling]) {
+                return (int)sibling;
+            }
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return cpu;
+}
+
+const BenchCpus *bench_cpus(void) {
+    static BenchCpus cpus = {0};
+    if (cpus.count > 0) {
+        return &cpus;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.cpus[cpus.count++] = cpu;
+            }
+        }
+    }
+#endif
+    if (cpus.count == 0) {
+        const long online = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int cpu = 0; cpu < (online > 0 ? MIN(online, CPU_SETSIZE) : 1); cpu++) {
+            cpus.cpus[cpus.count++] = cpu;
+        }
+    }
+    // Move the first CPU of each core to the front, keeping the order otherwise.
+    static char allowed[CPU_SETSIZE];
+    int siblings[CPU_SETSIZE];
+    int sibling_count = 0;
+    for (int i = 0; i < cpus.count; i++) {
+        allowed[cpus.cpus[i]] = 1;
+    }
+    for (int i = 0; i < cpus.count; i++) {
+        const int cpu = cpus.cpus[i];
+        if (first_sibling(cpu, allowed) == cpu) {
+            cpus.cpus[cpus.cores++] = cpu;
+        } else {
+            siblings[sibling_count++] = cpu;
+        }
+    }
+    memcpy(cpus.cpus + cpus.cores, siblings, sibling_count * sizeof(int));
+    return &cpus;
+}
+
+/**
+ * Returns the CPU for thread `i`: the i-th CPU we may run on, so one per core
+ * up to as many threads as cores, then their siblings, round robin if there
+ * are more threads than CPUs.
+ */
+int bench_cpu(int i) {
+    const BenchCpus *cpus = bench_cpus();
+    return cpus->cpus[i % cpus->count];
+}
+
+/**
+ * Returns the number of threads to scale up to, from the `THREADS` environment
+ * variable. Default is the number of cores we may run on, one thread per core.
+ */
+int bench_threads(void) {
+    const int threads = get_env_int("THREADS", bench_cpus()->cores);
+    return threads < 1 ? 1 : threads;
+}
+
+/**
+ * Pins the calling thread to `cpu`, and returns 0, or warns (once) and returns
+ * -1 if it can't be: the thread then runs wherever the scheduler puts it, which
+ * may be on the same CPU as another. Only on Linux: macOS has no such thing.
+ */
+int pin_to_cpu(int cpu) {
+#ifdef __linux__
+    static atomic_int warned;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+        if (atomic_exchange(&warned, 1) == 0) {
+            fprintf(stderr, "warning: can't pin a thread to cpu %d (%s), threads may share CPUs\n", cpu, strerror(error));
+        }
+        return -1;
+    }
+#else
+    (void)cpu;
+#endif
+    return 0;
+}
+
+/**
+ * A barrier for `count` threads, which spins rather than sleeping, so that
+ * threads leave it as close together as possible. It can be reused.
+ */
+typedef struct {
+    atomic_int waiting;
+    atomic_int phase;
+    int count;
+} Barrier;
+
+void barrier_init(Barrier *b, int count) {
+    atomic_init(&b->waiting, 0);
+    atomic_init(&b->phase, 0);
+    b->count = count;
+}
+
+/**
+ * Waits until all `count` threads have called this.
+ */
+void barrier_wait(Barrier *b) {
+    const int phase = atomic_load(&b->phase);
+    if (atomic_fetch_add(&b->waiting, 1) == b->count - 1) {
+        atomic_store(&b->waiting, 0);
+        atomic_fetch_add(&b->phase, 1);
+        return;
+    }
+    // yield now & then, in case there are more threads than CPUs
+    for (long spins = 1; atomic_load(&b->phase) == phase; spins++) {
+        if (spins % 1024 == 0) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * What a thread of `scale_threads()` gets, and reports back.
+ */
+typedef struct ThreadCtx {
+    int thread;         // 0..threads-1
+    int threads;
+    long times;         // executions of the body
+    void *arg;          // as passed to scale_threads()
+    int (*worker)(struct ThreadCtx *ctx);
+    Barrier *start_line;
+    uint64_t start;     // set by CLOCK_THREAD
+    uint64_t end;
+    int result;
+} ThreadCtx;
+
+/*
+ * Waits for all threads to be ready, then executes `body` ctx->times times,
+ * timing it for scale_threads(). A worker calls this once, after setting up
+ * what its body needs (so that the set up isn't timed, and memory it allocates
+ * is local to its CPU), and returns what this returns.
+ */
+#define CLOCK_THREAD(ctx, body) ({ \
+    long _count = (ctx)->times; \
+    int _sum = 0; \
+    barrier_wait((ctx)->start_line); \
+    (ctx)->start = now_ns(); \
+    while (_count--) { \
+        _sum += body; \
+    } \
+    (ctx)->end = now_ns(); \
+    _sum; \
+})
+
+void *run_pinned(void *arg) {
+    ThreadCtx *ctx = arg;
+    pin_to_cpu(bench_cpu(ctx->thread));
+    ctx->result = ctx->worker(ctx);
+    return NULL;
+}
+
+/**
+ * Runs `worker` on 1, 2, 4, ... up to `THREADS` threads at once, each pinned to
+ * its own CPU, and prints the throughput for each number of threads: for all of
+ * them together, and for each, in `work` units (e.g. loads, or ints summed) per
+ * execution of the body. The efficiency is how close the total comes to 1 thread's
+ * throughput times the number of threads; below 100%, the threads are
+ * contending for something (caches, memory bandwidth, or the core itself with
+ * SMT).
+ */
+void scale_threads(const char *msg, int (*worker)(ThreadCtx *ctx), void *arg, long times, double work, const char *unit) {
+    const int max_threads = bench_threads();
+    printf("%s: %ld x %.0f %s per thread, in M %s/s\n", msg, times, work, unit, unit);
+    printf("%7s %14s %28s %10s\n", "threads", "total", "per thread (min..max)", "efficiency");
+    double single = 0;
+    for (int threads = 1; ; threads = MIN(threads * 2, max_threads)) {
+        pthread_t ids[threads];
+        ThreadCtx ctxs[threads];
+        Barrier start_line;
+        barrier_init(&start_line, threads);
+        for (int i = 0; i < threads; i++) {
+            ctxs[i] = (ThreadCtx){i, threads, times, arg, worker, &start_line, 0, 0, 0};
+            if (pthread_create(&ids[i], NULL, run_pinned, &ctxs[i]) != 0) {
+                die_perror("pthread_create");
+            }
+        }
+        // rates are in millions of units per second
+        uint64_t start = UINT64_MAX, end = 0;
+        double min_rate = 0, max_rate = 0, rates = 0, sum = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(ids[i], NULL);
+            start = MIN(start, ctxs[i].start);
+            end = MAX(end, ctxs[i].end);
+            const double rate = times * work * 1000 / (ctxs[i].end - ctxs[i].start);
+            min_rate = i == 0 ? rate : MIN(min_rate, rate);
+            max_rate = MAX(max_rate, rate);
+            rates += rate;
+            sum += ctxs[i].result;
+        }
+        BENCH_SINK += sum == 42;
+
+        const double total = threads * times * work * 1000 / (end - start);
+        single = threads == 1 ? total : single;
+        const double efficiency = total / (single * threads);
+        char bar[21];
+        int len = 0;
+        for (; len < 20 && len < efficiency * 20 + 0.5; len++) {
+            bar[len] = '#';
+        }
+        bar[len] = '\0';
+        printf("%7d %14.1f %10.1f (%7.1f..%7.1f) %9.0f%% %s\n", threads, total, rates / threads,
+            min_rate, max_rate, efficiency * 100, bar);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
 /*
  * Executes `body` n times and prints the time taken to execute it.
  */
@@ -173,21 +895,43 @@ Bytes bytes(size_t size) {
 })
 
 /**
- * Compares the time taken by two bodies n times and prints the result.
+ * Compares the time taken by two bodies and prints the result. Each body is
+ * executed at least n times in all, spread over `SAMPLES` samples that are
+ * alternated between the two bodies, so that any drift in the machine's speed
+ * affects both alike. Each sample is a batch of executions lasting at least
+ * BENCH_MIN_BATCH_NS. With `COUNTERS=1`, hardware counters are read around
+ * each sample too.
  */
 #define COMPARE_TWO_N_TIMES(msg, id1, body1, id2, body2, n_times) { \
-    long times = (n_times); \
-    long us1 = (WARMUP_AND_CLOCK_N_TIMES(times, NULL, body1)); \
-    long us2 = (WARMUP_AND_CLOCK_N_TIMES(times, NULL, body2)); \
-    if (msg != NULL) { \
-        if (us1 < us2) { \
-            int faster_by = (us2 - us1) * 100 / us1; \
-            printf("%s: %s is faster than %s by %3d%% (%ld vs %ld us)\n", msg, id1, id2, faster_by, us1, us2); \
-        } else { \
-            int faster_by = (us1 - us2) * 100 / us2; \
-            printf("%s: %s is faster than %s by %3d%% (%ld vs %ld us)\n", msg, id2, id1, faster_by, us2, us1); \
+    const int _samples = bench_samples(); \
+    const long _min_batch = ((n_times) + _samples - 1) / _samples; \
+    long _batch1 = CALIBRATE_BATCH(body1); \
+    long _batch2 = CALIBRATE_BATCH(body2); \
+    _batch1 = _batch1 > _min_batch ? _batch1 : _min_batch; \
+    _batch2 = _batch2 > _min_batch ? _batch2 : _min_batch; \
+    double *_ns1 = malloc(_samples * sizeof(double)); \
+    double *_ns2 = malloc(_samples * sizeof(double)); \
+    const int _counting = counters_open() > 0; \
+    CounterValues _c1 = {{0}, {0}, {0}}, _c2 = {{0}, {0}, {0}}, _before, _after; \
+    for (int _s = 0; _s < _samples; _s++) { \
+        if (_counting) counters_read(&_before); \
+        _ns1[_s] = TIME_BATCH(_batch1, body1); \
+        if (_counting) { \
+            counters_read(&_after); \
+            counters_add(&_c1, &_before, &_after); \
+            counters_read(&_before); \
         } \
+        _ns2[_s] = TIME_BATCH(_batch2, body2); \
+        if (_counting) { \
+            counters_read(&_after); \
+            counters_add(&_c2, &_before, &_after); \
+        } \
+    } \
+    if (msg != NULL) { \
+        print_comparison(msg, id1, _ns1, _batch1, &_c1, id2, _ns2, _batch2, &_c2, _samples); \
     } \
+    free(_ns1); \
+    free(_ns2); \
 }
 
 /**
@@ -12,29 +12,78 @@
  *
  * @section usage Usage
  * ./build/memory-access [stride]
+ * ./build/memory-access sweep
+ * ./build/memory-access scale [stride]
+ *
+ * The second form measures the latency of a random pointer chase over working
+ * sets from 4 KiB to several GiB, which shows a step up in latency at each cache
+ * level: where the working set no longer fits in L1, L2, L3, and finally when it
+ * goes to DRAM. There's also a step (sometimes two) where the pages of the working
+ * set no longer fit in the TLBs, at (entries x page size), e.g. 64 x 4 KiB =
+ * 256 KiB for a typical L1 dTLB, or 2K x 4 KiB = 8 MiB for the L2 TLB. Steps that
+ * don't line up with a cache size are usually these, and move to much larger
+ * working sets with `HUGE_PAGES=1`.
+ *
+ * The third form walks the array on 1 to `THREADS` threads at once (each starting
+ * at a different element), to show how memory access scales with the number of
+ * cores sharing the caches & memory bandwidth.
  *
  * @section env Environment Variables
  * - ARR_LEN: Length of the array to be used. Default is 1 << 28 (i.e. 256 MiB).
  * - TIMES: Number of times to run the comparison. Default is 1000.
+ * - SWEEP_MAX: Largest working set (in bytes) to sweep to. Default is 4 GiB,
+ *     capped to half of the physical memory.
+ * - SWEEP_STEPS: Working sets per doubling of size. Default is 4.
+ * - LOADS: Number of loads to time per working set. Default is 1 << 20.
+ * - HUGE_PAGES: Set to 1 to back the sweep with transparent huge pages.
+ * - THREADS: Number of threads to scale up to. Default is the number of cores
+ *     we may run on (one thread per core, not per SMT sibling).
  */
 
 #include "common.h"
 
 /**
- * Shuffles the array randomly in place.
+ * Returns a random number in [0, n).
+ */
+size_t random_below(size_t n) {
+    return (((uint64_t)rand() << 31) ^ (uint64_t)rand()) % n;
+}
+
+/**
+ * Turns `arr`, which must hold indices to itself (arr[i] = i), into a random
+ * permutation that is one cycle through all `count` elements, using Sattolo's
+ * algorithm. Unlike a plain shuffle, which can leave short cycles, a walk that
+ * follows the indices is then guaranteed to visit every element.
  *
  * @param arr The array to fill & walk
  * @param count Number of elements in the array
  */
-void shuffle(int *arr, size_t count) {
-    for (int i = count - 1; i > 0; i--) {
-        int j = rand() % (i + 1);
+void sattolo_cycle(int *arr, size_t count) {
+    for (size_t i = count - 1; i > 0; i--) {
+        size_t j = random_below(i); // j < i, never i itself
         int temp = arr[i];
         arr[i] = arr[j];
         arr[j] = temp;
     }
 }
 
+/**
+ * Fills `arr` with indices to itself: the next element, `stride` bytes on, or
+ * a random one if `stride` is 0.
+ */
+void fill_indices(int *arr, const int count, int stride) {
+    if (stride % 8 != 0) {
+        die("error: stride must be a multiple of 8");
+    }
+    const int s = stride == 0 ? 0 : (stride >> 3);
+    for (int i = 0; i < count; i++) {
+        arr[i] = (i + s) % count;
+    }
+    if (stride == 0) {
+        sattolo_cycle(arr, count);
+    }
+}
+
 /**
  * Tests memory access (ns/iter and bandwidth).
  *
@@ -51,18 +100,7 @@ void shuffle(int *arr, size_t count) {
 void test_mem_access(int *arr, const int count, int stride) {
     struct timespec start, end;
 
-    if (stride % 8 != 0) {
-        die("error: stride must be a multiple of 8");
-    }
-
-    // fill the array with indices
-    const int s = stride == 0 ? 1 : (stride >> 3);
-    for (int i = 0; i < count; i++) {
-        arr[i] = (i + s) % count;
-    }
-    if (stride == 0) {
-        shuffle(arr, count);
-    }
+    fill_indices(arr, count, stride);
 
     // do profiled run
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
@@ -80,10 +118,181 @@ void test_mem_access(int *arr, const int count, int stride) {
     printf("%.1f ns/iter (%ld%sB/s), when accessing %ld%sB with stride=%d %s\n", ns_per_iter, bw_b.sz_abbr, bw_b.suffix, count_b.sz_abbr, count_b.suffix, stride, idx ? "" : " ");
 }
 
+/**
+ * An array filled by fill_indices(), shared by the threads of scale_threads().
+ */
+typedef struct {
+    int *arr;
+    int count;
+} Walk;
+
+/**
+ * Walks the whole array, starting from a different element in each thread,
+ * for scale_threads().
+ */
+int walk_indices(ThreadCtx *ctx) {
+    const Walk *walk = ctx->arg;
+    int idx = (int)((long)walk->count * ctx->thread / ctx->threads);
+    return CLOCK_THREAD(ctx, ({
+        for (int i = 0; i < walk->count; i++) {
+            idx = walk->arr[idx];
+        }
+        idx;
+    }));
+}
+
+#define CACHE_LINE 64
+
+/**
+ * Links the first `lines` cache lines of `buf` into one random cycle, with
+ * each line holding a pointer to the next. This is Sattolo's algorithm again,
+ * but on pointers: every line starts out pointing to itself.
+ */
+void link_random_cycle(char *buf, size_t lines) {
+    for (size_t i = 0; i < lines; i++) {
+        *(char**)(buf + i * CACHE_LINE) = buf + i * CACHE_LINE;
+    }
+    for (size_t i = lines - 1; i > 0; i--) {
+        char **a = (char**)(buf + i * CACHE_LINE);
+        char **b = (char**)(buf + random_below(i) * CACHE_LINE);
+        char *temp = *a;
+        *a = *b;
+        *b = temp;
+    }
+}
+
+/**
+ * Follows `loads` pointers from `*cursor`, leaving `*cursor` where it stopped
+ * (so that the next run picks up from there, rather than going over the same
+ * lines again), and returns the time per load in ns. Each load depends on the
+ * previous one, so this is the latency of a load.
+ */
+double chase_ns(char **cursor, long loads) {
+    char *p = *cursor;
+    const uint64_t begin = now_ns();
+    for (long i = 0; i < loads; i++) {
+        p = *(char**)p;
+    }
+    const double ns = (double)(now_ns() - begin) / loads;
+    *cursor = p;
+    return ns;
+}
+
+/**
+ * Formats `size` in the largest binary unit that it's a whole multiple of.
+ */
+const char* size_str(char *buf, size_t len, size_t size) {
+    int i = 0;
+    while (size >= 1024 && size % 1024 == 0 && i < 6) {
+        size >>= 10;
+        i++;
+    }
+    snprintf(buf, len, "%zu %sB", size, BYTE_SUFFIXES[i]);
+    return buf;
+}
+
+/**
+ * Returns the size of the data cache at `level` (1-3), or 0 if unknown.
+ */
+size_t cache_size(int level) {
+#if defined(__linux__) && defined(_SC_LEVEL1_DCACHE_SIZE)
+    const int names[] = {_SC_LEVEL1_DCACHE_SIZE, _SC_LEVEL2_CACHE_SIZE, _SC_LEVEL3_CACHE_SIZE};
+    const long size = sysconf(names[level - 1]);
+    return size > 0 ? size : 0;
+#elif defined(__APPLE__)
+    const char *names[] = {"hw.l1dcachesize", "hw.l2cachesize", "hw.l3cachesize"};
+    int64_t size = 0;
+    size_t len = sizeof(size);
+    return sysctlbyname(names[level - 1], &size, &len, NULL, 0) == 0 && size > 0 ? size : 0;
+#else
+    (void)level;
+    return 0;
+#endif
+}
+
+/**
+ * Prints a table of load latency vs. working set size, from 4 KiB up to
+ * `SWEEP_MAX`, in `SWEEP_STEPS` steps per doubling. Each row notes the caches
+ * the working set has outgrown, and steps up in latency are marked.
+ */
+void sweep_latency(void) {
+    const long page = getpagesize();
+    size_t max = get_env_long("SWEEP_MAX", 4l << 30);
+    const size_t half_mem = (size_t)sysconf(_SC_PHYS_PAGES) * page / 2;
+    if (max > half_mem) {
+        max = half_mem;
+    }
+    const int steps = MAX(1, get_env_int("SWEEP_STEPS", 4));
+    const long loads = MAX(1024l, get_env_long("LOADS", 1l << 20));
+    const int huge_pages = get_env_int("HUGE_PAGES", 0);
+
+    char *buf = mmap(NULL, max, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        die_perror("mmap");
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(buf, max, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+    srand(time(NULL));
+
+    char size_buf[32], cache_buf[32];
+    printf("%12s %9s %7s  %s\n", "working set", "ns/load", "x prev", huge_pages ? "(huge pages)" : "");
+    double prev_ns = 0;
+    int next_cache = 1;
+    for (size_t octave = 4096; octave <= max; octave <<= 1) {
+        for (int step = 0; step < steps; step++) {
+            const size_t size = (octave + octave * step / steps) / CACHE_LINE * CACHE_LINE;
+            if (size > max) {
+                break;
+            }
+            const size_t lines = size / CACHE_LINE;
+            link_random_cycle(buf, lines);
+
+            // warm up with one trip round the cycle (or as much of it as we'll
+            // time), then take the best of 3 runs, each carrying on from where the
+            // last one stopped
+            char *cursor = buf;
+            chase_ns(&cursor, MIN((long)lines, loads));
+            double ns = chase_ns(&cursor, loads);
+            for (int run = 1; run < 3; run++) {
+                ns = MIN(ns, chase_ns(&cursor, loads));
+            }
+            BENCH_SINK += cursor == NULL;
+
+            // a bar, a character per 2^(1/4) ns: 1ns = 0 chars, 100ns = 26 chars
+            char bar[48];
+            int len = 0;
+            for (double x = ns; x >= 1.19 && len < (int)sizeof(bar) - 1; x /= 1.189207) {
+                bar[len++] = '#';
+            }
+            bar[len] = '\0';
+
+            printf("%12s %9.2f %7.2f  %-30s", size_str(size_buf, sizeof(size_buf), size), ns,
+                prev_ns > 0 ? ns / prev_ns : 1.0, bar);
+            if (prev_ns > 0 && ns / prev_ns >= 1.2) {
+                printf(" <- step");
+            }
+            for (; next_cache <= 3 && cache_size(next_cache) > 0 && size > cache_size(next_cache); next_cache++) {
+                printf(" (past L%d%s: %s)", next_cache, next_cache == 1 ? "d" : "",
+                    size_str(cache_buf, sizeof(cache_buf), cache_size(next_cache)));
+            }
+            printf("\n");
+            fflush(stdout);
+            prev_ns = ns;
+        }
+    }
+    munmap(buf, max);
+}
+
 /**
  * The main entry point.
  */
 int main(int argc, const char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "sweep") == 0) {
+        sweep_latency();
+        return 0;
+    }
+
     // ensure that array len remains bounded to reasonable limits
     // 128Mi <= arr_len <= 1Gi
     size_t count = get_env_long("ARR_LEN", 1 << 28);
@@ -100,8 +309,17 @@ int main(int argc, const char* argv[]) {
     }
 
     // run test
-    const long stride = argc > 1 ? atol(argv[1]) : 8;
-    test_mem_access(arr, count, stride > 0 ? stride : 0);
+    if (argc > 1 && strcmp(argv[1], "scale") == 0) {
+        const long stride = argc > 2 ? atol(argv[2]) : 8;
+        fill_indices(arr, count, stride > 0 ? stride : 0);
+        Walk walk = {arr, count};
+        char msg[64];
+        sprintf(msg, "memory-access (stride=%ld)", stride > 0 ? stride : 0);
+        scale_threads(msg, walk_indices, &walk, 1, count, "loads");
+    } else {
+        const long stride = argc > 1 ? atol(argv[1]) : 8;
+        test_mem_access(arr, count, stride > 0 ? stride : 0);
+    }
 
     // clean up & exit
     munmap(arr, count * sizeof(int));
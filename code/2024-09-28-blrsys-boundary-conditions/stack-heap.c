@@ -4,23 +4,61 @@
  * @author Amod Malviya
  *
  * @section usage Usage
- * ./build/stack-heap
+ * ./build/stack-heap [scale]
+ *
+ * With `scale`, sums stack & heap arrays on 1 to `THREADS` threads at once, each
+ * with arrays of its own, to show how that scales with the number of cores.
  *
  * @section env Environment Variables
  * - ARR_LEN: Length of the array to be used. Default is 1 << 12 (i.e. 4 KiB).
- * - TIMES: Number of times to run the comparison. Default is 1000.
+ * - TIMES: Minimum number of times to run each side of the comparison. Default is 1000.
+ * - SAMPLES: Number of timed samples of each side. Default is 31.
+ * - COUNTERS: Set to 1 to also report IPC & cache/branch/TLB misses from hardware counters.
+ * - THREADS: Number of threads to scale up to. Default is the number of cores
+ *     we may run on (one thread per core, not per SMT sibling).
  */
 
 #include "common.h"
 
+/**
+ * Sums an array on this thread's stack, for scale_threads().
+ */
+int sum_stack(ThreadCtx *ctx) {
+    const int len = *(int*)ctx->arg;
+    int *arr = alloca(len * sizeof(int));
+    fill_random(arr, len);
+    return CLOCK_THREAD(ctx, sum_array(arr, len));
+}
+
+/**
+ * Sums an array on the heap, for scale_threads().
+ */
+int sum_heap(ThreadCtx *ctx) {
+    const int len = *(int*)ctx->arg;
+    int *arr = mmap(NULL, len * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    fill_random(arr, len);
+    const int sum = CLOCK_THREAD(ctx, sum_array(arr, len));
+    munmap(arr, len * sizeof(int));
+    return sum;
+}
+
 /**
  * Main entry point of the program.
  */
-int main(int UNUSED(argc), char const* UNUSED(_argv[])) {
+int main(int argc, char const* argv[]) {
     // get the length of the array
-    const int len = get_env_int("ARR_LEN", getpagesize() / sizeof(int));
+    int len = get_env_int("ARR_LEN", getpagesize() / sizeof(int));
     char msg[128];
 
+    if (argc > 1 && strcmp(argv[1], "scale") == 0) {
+        const long times = get_env_long("TIMES", 1000l);
+        sprintf(msg, "stack (size=%d)", len);
+        scale_threads(msg, sum_stack, &len, times, len, "ints");
+        sprintf(msg, "heap (size=%d)", len);
+        scale_threads(msg, sum_heap, &len, times, len, "ints");
+        return 0;
+    }
+
     // allocate on stack
     int *stack_arr = alloca(len * sizeof(int));
 
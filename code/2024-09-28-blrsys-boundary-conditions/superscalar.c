@@ -9,31 +9,114 @@
  * of superscalar execution on performance.
  *
  * @section usage Usage
- * ./build/superscalar
+ * ./build/superscalar [scale]
+ *
+ * With `scale`, runs both approaches on 1 to `THREADS` threads at once, each with
+ * an array of its own. Both scale with the number of cores, but with SMT, two
+ * threads that share a core also share its execution units.
  *
  * @section env Environment Variables
- * - TIMES: Number of times to run the comparison. Default is 1000.
+ * - TIMES: Minimum number of times to run each side of the comparison. Default is 1000.
+ * - SAMPLES: Number of timed samples of each side. Default is 31.
+ * - COUNTERS: Set to 1 to also report IPC & cache/branch/TLB misses from hardware counters.
+ * - THREADS: Number of threads to scale up to. Default is the number of cores
+ *     we may run on (one thread per core, not per SMT sibling).
  */
 
 #include "common.h"
 
+/**
+ * Each instruction depends on the result of the previous one.
+ */
+int not_optimised(int *arr, int len) {
+    int last = 0;
+    for (int i = 0; i < len; i+=8) {
+        last = arr[i];
+        arr[i] += last & 0xc9fc291d;
+        arr[i+1] += arr[i] & 0x26ee3af5;
+        arr[i+2] -= arr[i+1] & 0x6f209a8d;
+        arr[i+3] += arr[i+2] & 0xa81eb73f;
+        arr[i+4] -= arr[i+3] & 0x7e5a1e1c;
+        arr[i+5] += arr[i+4] & 0xe110b8bb;
+        arr[i+6] -= arr[i+5] & 0x2bc0dcbf;
+        arr[i+7] += arr[i+6] & 0xfb3bc4fc;
+    }
+    return last;
+}
+
+/**
+ * The same logic as not_optimised(), but using the random ints in `x` in
+ * place of the previous results, so that there are no data hazards.
+ */
+int optimised(int *arr, int len, const int *x) {
+    // copied to locals, as `arr` could alias `x`, which would make the compiler
+    // load them afresh after every store
+    const int x1 = x[0], x2 = x[1], x3 = x[2], x4 = x[3], x5 = x[4], x6 = x[5], x7 = x[6];
+    int last = 0;
+    for (int i = 0; i < len; i+=8) {
+        last = arr[i];
+        arr[i] += last & 0xc9fc291d;
+        arr[i+1] += x1 & 0x26ee3af5;
+        arr[i+2] -= x2 & 0x6f209a8d;
+        arr[i+3] += x3 & 0xa81eb73f;
+        arr[i+4] -= x4 & 0x7e5a1e1c;
+        arr[i+5] += x5 & 0xe110b8bb;
+        arr[i+6] -= x6 & 0x2bc0dcbf;
+        arr[i+7] += x7 & 0xfb3bc4fc;
+    }
+    return last;
+}
+
+/**
+ * Runs not_optimised() on an array of this thread's own, for scale_threads().
+ */
+int scale_not_optimised(ThreadCtx *ctx) {
+    const int len = getpagesize() / sizeof(int);
+    int *arr = mmap(NULL, len * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    fill_random(arr, len);
+    const int last = CLOCK_THREAD(ctx, not_optimised(arr, len));
+    munmap(arr, len * sizeof(int));
+    return last;
+}
+
+/**
+ * Runs optimised() on an array of this thread's own, for scale_threads().
+ */
+int scale_optimised(ThreadCtx *ctx) {
+    const int len = getpagesize() / sizeof(int);
+    int *arr = mmap(NULL, len * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    fill_random(arr, len);
+    int x[7];
+    for (int i = 0; i < 7; i++) {
+        x[i] = rand();
+    }
+    const int last = CLOCK_THREAD(ctx, optimised(arr, len, x));
+    munmap(arr, len * sizeof(int));
+    return last;
+}
+
 /**
  * Main entry point of the program.
  */
-int main(int UNUSED(argc), char const* UNUSED(argv[])) {
+int main(int argc, char const* argv[]) {
     // we initialise array len to fit a memory page
     const int ARR_LEN = getpagesize() / sizeof(int);
+
+    if (argc > 1 && strcmp(argv[1], "scale") == 0) {
+        const long times = get_env_long("TIMES", 1000l);
+        scale_threads("superscalar (not optimised)", scale_not_optimised, NULL, times, ARR_LEN, "ints");
+        scale_threads("superscalar (optimised)", scale_optimised, NULL, times, ARR_LEN, "ints");
+        return 0;
+    }
+
     int *arr = mmap(NULL, ARR_LEN * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     fill_random(arr, ARR_LEN);
 
     // initialise random ints
-    int x1 = rand();
-    int x2 = rand();
-    int x3 = rand();
-    int x4 = rand();
-    int x5 = rand();
-    int x6 = rand();
-    int x7 = rand();
+    int x[7];
+    for (int i = 0; i < 7; i++) {
+        x[i] = rand();
+    }
 
     // we demonstrate superscalar execution by comparing the following two
     // approaches:
@@ -45,38 +128,8 @@ int main(int UNUSED(argc), char const* UNUSED(argv[])) {
     //    superscalar CPU.
     COMPARE_TWO(
         "superscalar",
-        "not optimised",
-        ({
-            int last = 0;
-            for (int i = 0; i < ARR_LEN; i+=8) {
-                last = arr[i];
-                arr[i] += last & 0xc9fc291d;
-                arr[i+1] += arr[i] & 0x26ee3af5;
-                arr[i+2] -= arr[i+1] & 0x6f209a8d;
-                arr[i+3] += arr[i+2] & 0xa81eb73f;
-                arr[i+4] -= arr[i+3] & 0x7e5a1e1c;
-                arr[i+5] += arr[i+4] & 0xe110b8bb;
-                arr[i+6] -= arr[i+5] & 0x2bc0dcbf;
-                arr[i+7] += arr[i+6] & 0xfb3bc4fc;
-            }
-            last;
-        }),
-        "optimised",
-        ({
-            int last = 0;
-            for (int i = 0; i < ARR_LEN; i+=8) {
-                last = arr[i];
-                arr[i] += last & 0xc9fc291d;
-                arr[i+1] += x1 & 0x26ee3af5;
-                arr[i+2] -= x2 & 0x6f209a8d;
-                arr[i+3] += x3 & 0xa81eb73f;
-                arr[i+4] -= x4 & 0x7e5a1e1c;
-                arr[i+5] += x5 & 0xe110b8bb;
-                arr[i+6] -= x6 & 0x2bc0dcbf;
-                arr[i+7] += x7 & 0xfb3bc4fc;
-            }
-            last;
-        })
+        "not optimised", not_optimised(arr, ARR_LEN),
+        "optimised", optimised(arr, ARR_LEN, x)
     );
 
     // clean up & exit
@@ -0,0 +1,516 @@
+/// @file
+/// @brief An allocation tracer, to find out who put what on the heap.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// When built with `-DMEMLENS_TRACE_MALLOC`, the global `operator new`/`delete`
+/// are replaced (and, against glibc, `malloc()` & friends too); otherwise nothing is
+/// replaced, and `memlens allocs` refuses to run. The replacements normally just
+/// forward to the allocator; once tracing is started (`memlens allocs
+/// <command>`), each allocation & free is also appended, with a timestamp and the
+/// first few return addresses of the call stack, to a ring buffer owned by the
+/// calling thread. Appending needs no locks or atomic read-modify-writes, and frames
+/// are found by following frame pointers (so build with `-fno-omit-frame-pointer`),
+/// so tracing is cheap enough to leave on. A thread whose buffer is full drains all
+/// of them, folding their events into the bytes live per call site; when the command
+/// is done, what's left is drained, and the bytes still live are reported, grouped
+/// by the call site that allocated them.
+
+#ifndef MEMLENS_ALLOCS_HPP
+#define MEMLENS_ALLOCS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include "memlens.hpp"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+#ifdef MEMLENS_TRACE_MALLOC
+/// @brief whether the allocation functions are replaced, so that tracing sees anything
+const bool ALLOC_TRACER_BUILT = true;
+#ifdef __GLIBC__
+// malloc() & friends can only be replaced where the real ones can still be called
+#define MEMLENS_TRACE_LIBC_MALLOC 1
+#endif
+#else
+const bool ALLOC_TRACER_BUILT = false;
+#endif
+
+// the hooks must not be inlined: their frame is where the walk up the stack starts
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMLENS_FRAME_ADDRESS() __builtin_frame_address(0)
+#define MEMLENS_NOINLINE __attribute__((noinline))
+#else
+#define MEMLENS_FRAME_ADDRESS() nullptr
+#define MEMLENS_NOINLINE
+#endif
+
+/// @brief number of return addresses recorded per allocation
+const size_t ALLOC_TRACE_FRAMES = 4;
+
+/// @brief One allocation or free.
+typedef struct {
+    uint64_t time_ns;
+    void *address;
+    uint64_t size;                      // 0 for a free
+    void *frames[ALLOC_TRACE_FRAMES];   // return addresses, innermost first (null if unknown)
+} alloc_event_t;
+
+/// @brief The events recorded by a single thread, a ring buffer. Only that thread
+/// appends to it, publishing each event by a release store of `count`; whoever
+/// drains it (holding `ALLOC_TRACE_DRAIN_LOCK`) frees up slots by a release store
+/// of `drained`.
+struct alloc_trace_buffer_t {
+    alloc_trace_buffer_t *next;     // the next buffer in `ALLOC_TRACE_BUFFERS`
+    uintptr_t stack_low;            // bounds of the thread's stack, to walk frames safely
+    uintptr_t stack_high;
+    alloc_event_t *events;
+    size_t capacity;
+    std::atomic<size_t> count;      // events ever appended (event i is at i % capacity)
+    std::atomic<size_t> drained;    // events ever drained
+};
+
+/// @brief What the events drained so far add up to, per call site.
+struct alloc_site_stats_t {
+    uint64_t live_bytes;
+    uint64_t live_count;
+    uint64_t total_bytes;
+    uint64_t total_count;
+};
+
+/// @brief An allocation that hasn't been seen freed (yet).
+struct alloc_live_t {
+    alloc_site_stats_t *site;
+    uint64_t size;
+    uint64_t time_ns;
+};
+
+/// @brief the return addresses of a call site, innermost first
+typedef std::vector<void*> alloc_site_t;
+
+/// @brief The events drained so far, replayed.
+struct alloc_trace_totals_t {
+    std::map<alloc_site_t, alloc_site_stats_t> sites;
+    std::unordered_map<void*, alloc_live_t> live;
+    std::vector<alloc_event_t> batch;   // reused from one drain to the next
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t total_bytes;
+};
+
+/// @brief whether allocations are being traced
+std::atomic<bool> ALLOC_TRACING(false);
+
+/// @brief buffers of all threads that ever allocated while tracing (never freed)
+std::atomic<alloc_trace_buffer_t*> ALLOC_TRACE_BUFFERS(nullptr);
+
+/// @brief held while draining the buffers into `ALLOC_TRACE_TOTALS`
+std::mutex ALLOC_TRACE_DRAIN_LOCK;
+
+/// @brief the events drained so far
+alloc_trace_totals_t ALLOC_TRACE_TOTALS;
+
+/// @brief this thread's buffer
+thread_local alloc_trace_buffer_t *ALLOC_TRACE_BUFFER = nullptr;
+
+/// @brief set while the tracer itself is running on this thread, so that its own
+/// allocations (and those of anything it calls) aren't traced
+thread_local bool ALLOC_TRACE_BUSY = false;
+
+#ifdef MEMLENS_TRACE_LIBC_MALLOC
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void __libc_free(void *ptr);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void *ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+#define memlens_raw_malloc __libc_malloc
+#define memlens_raw_free __libc_free
+#define memlens_raw_memalign __libc_memalign
+#else
+#define memlens_raw_malloc malloc
+#define memlens_raw_free free
+#endif
+
+/// @brief Find the bounds of the current thread's stack.
+void current_stack_bounds(uintptr_t &low, uintptr_t &high) {
+    low = high = 0;
+#if defined(__linux__)
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            low = reinterpret_cast<uintptr_t>(addr);
+            high = low + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+#elif defined(__APPLE__)
+    high = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(pthread_self()));
+    low = high - pthread_get_stacksize_np(pthread_self());
+#endif
+}
+
+/// @return this thread's buffer, created (and registered) on first use
+alloc_trace_buffer_t* alloc_trace_buffer() {
+    if (ALLOC_TRACE_BUFFER != nullptr) {
+        return ALLOC_TRACE_BUFFER;
+    }
+    const char *env = getenv("MEMLENS_ALLOC_EVENTS");
+    const size_t capacity = env != nullptr && strtoul(env, nullptr, 0) > 0 ? strtoul(env, nullptr, 0) : 1 << 20;
+    alloc_trace_buffer_t *buffer = (alloc_trace_buffer_t*)memlens_raw_malloc(sizeof(alloc_trace_buffer_t));
+    alloc_event_t *events = (alloc_event_t*)memlens_raw_malloc(capacity * sizeof(alloc_event_t));
+    if (buffer == nullptr || events == nullptr) {
+        return nullptr;
+    }
+    new (buffer) alloc_trace_buffer_t();
+    buffer->events = events;
+    buffer->capacity = capacity;
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->drained.store(0, std::memory_order_relaxed);
+    current_stack_bounds(buffer->stack_low, buffer->stack_high);
+    buffer->next = ALLOC_TRACE_BUFFERS.load(std::memory_order_relaxed);
+    while (!ALLOC_TRACE_BUFFERS.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    ALLOC_TRACE_BUFFER = buffer;
+    return buffer;
+}
+
+/// @brief Move the events of all buffers into `ALLOC_TRACE_TOTALS`, replaying them
+/// in time order. Must be called with `ALLOC_TRACE_BUSY` set, so that what it
+/// allocates isn't traced.
+/// @details A batch holds the events published so far, so an event may be drained
+/// in a later batch than events of other threads that happened after it. The only
+/// ones that matter are a free of an address that another thread has already been
+/// given again: a free older than the allocation it finds is dropped, and an
+/// allocation of an address that is still live ends the life of the old one.
+void drain_alloc_traces() {
+    std::lock_guard<std::mutex> lock(ALLOC_TRACE_DRAIN_LOCK);
+    alloc_trace_totals_t &totals = ALLOC_TRACE_TOTALS;
+    std::vector<alloc_event_t> &batch = totals.batch;
+    batch.clear();
+    for (alloc_trace_buffer_t *b = ALLOC_TRACE_BUFFERS.load(std::memory_order_acquire); b != nullptr; b = b->next) {
+        const size_t count = b->count.load(std::memory_order_acquire);
+        const size_t drained = b->drained.load(std::memory_order_relaxed);
+        for (size_t i = drained; i < count; i++) {
+            batch.push_back(b->events[i % b->capacity]);
+        }
+        b->drained.store(count, std::memory_order_release);
+    }
+    std::sort(batch.begin(), batch.end(), [](const alloc_event_t &a, const alloc_event_t &b) {
+        return a.time_ns < b.time_ns;
+    });
+    for (std::vector<alloc_event_t>::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+        std::unordered_map<void*, alloc_live_t>::iterator found = totals.live.find(it->address);
+        if (found != totals.live.end() && (it->size > 0 || found->second.time_ns <= it->time_ns)) {
+            found->second.site->live_bytes -= found->second.size;
+            found->second.site->live_count--;
+            totals.live.erase(found);
+            totals.frees++;
+        }
+        if (it->size == 0) {
+            continue;
+        }
+        alloc_site_stats_t &stats = totals.sites[alloc_site_t(it->frames, it->frames + ALLOC_TRACE_FRAMES)];
+        stats.live_bytes += it->size;
+        stats.live_count++;
+        stats.total_bytes += it->size;
+        stats.total_count++;
+        const alloc_live_t live = {&stats, it->size, it->time_ns};
+        totals.live[it->address] = live;
+        totals.allocs++;
+        totals.total_bytes += it->size;
+    }
+}
+
+/// @brief Record an allocation (`size` > 0) or a free (`size` == 0) of `address`.
+/// @param frame the frame address of the hooked function (`operator new` etc.),
+///   from which the calling frames are found by following frame pointers
+void trace_alloc(void *address, size_t size, void *frame) {
+    if (ALLOC_TRACE_BUSY || address == nullptr) {
+        return;
+    }
+    ALLOC_TRACE_BUSY = true;
+    alloc_trace_buffer_t *buffer = alloc_trace_buffer();
+    if (buffer != nullptr) {
+        const size_t n = buffer->count.load(std::memory_order_relaxed);
+        if (n - buffer->drained.load(std::memory_order_acquire) == buffer->capacity) {
+            drain_alloc_traces();
+        }
+        alloc_event_t &event = buffer->events[n % buffer->capacity];
+        event.time_ns = now_ns();
+        event.address = address;
+        event.size = size;
+        // a frame starts with the caller's frame pointer, followed by the return
+        // address; only trust frames that lie within this thread's stack, and
+        // that move up it
+        uintptr_t fp = reinterpret_cast<uintptr_t>(frame);
+        for (size_t i = 0; i < ALLOC_TRACE_FRAMES; i++) {
+            const bool valid = size > 0 && fp % sizeof(void*) == 0 && fp >= buffer->stack_low && fp + 2 * sizeof(void*) <= buffer->stack_high;
+            event.frames[i] = valid ? ((void**)fp)[1] : nullptr;
+            const uintptr_t next = valid ? ((uintptr_t*)fp)[0] : 0;
+            fp = next > fp ? next : 0;
+        }
+        buffer->count.store(n + 1, std::memory_order_release);
+    }
+    ALLOC_TRACE_BUSY = false;
+}
+
+#ifdef MEMLENS_TRACE_MALLOC
+inline void* traced_new(size_t size, void *frame) {
+    void *ptr = memlens_raw_malloc(size > 0 ? size : 1);
+    if (ALLOC_TRACING.load(std::memory_order_relaxed)) {
+        trace_alloc(ptr, size > 0 ? size : 1, frame);
+    }
+    return ptr;
+}
+
+/// @brief `traced_new()` for over-aligned types (`alignas` beyond what malloc guarantees).
+inline void* traced_new_aligned(size_t size, std::align_val_t alignment, void *frame) {
+    size = size > 0 ? size : 1;
+#ifdef MEMLENS_TRACE_LIBC_MALLOC
+    void *ptr = memlens_raw_memalign((size_t)alignment, size);
+#else
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, (size_t)alignment < sizeof(void*) ? sizeof(void*) : (size_t)alignment, size) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    if (ALLOC_TRACING.load(std::memory_order_relaxed)) {
+        trace_alloc(ptr, size, frame);
+    }
+    return ptr;
+}
+
+inline void traced_delete(void *ptr, void *frame) {
+    if (ptr != nullptr && ALLOC_TRACING.load(std::memory_order_relaxed)) {
+        trace_alloc(ptr, 0, frame);
+    }
+    memlens_raw_free(ptr);
+}
+
+MEMLENS_NOINLINE void* operator new(size_t size) {
+    void *ptr = traced_new(size, MEMLENS_FRAME_ADDRESS());
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+MEMLENS_NOINLINE void* operator new[](size_t size) {
+    void *ptr = traced_new(size, MEMLENS_FRAME_ADDRESS());
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+MEMLENS_NOINLINE void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return traced_new(size, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return traced_new(size, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void* operator new(size_t size, std::align_val_t alignment) {
+    void *ptr = traced_new_aligned(size, alignment, MEMLENS_FRAME_ADDRESS());
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+MEMLENS_NOINLINE void* operator new[](size_t size, std::align_val_t alignment) {
+    void *ptr = traced_new_aligned(size, alignment, MEMLENS_FRAME_ADDRESS());
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+MEMLENS_NOINLINE void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return traced_new_aligned(size, alignment, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return traced_new_aligned(size, alignment, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete(void *ptr) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete[](void *ptr) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete(void *ptr, size_t) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete[](void *ptr, size_t) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+// memory from memalign()/posix_memalign() is given back with free() too
+MEMLENS_NOINLINE void operator delete(void *ptr, std::align_val_t) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete[](void *ptr, std::align_val_t) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete(void *ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+
+MEMLENS_NOINLINE void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    traced_delete(ptr, MEMLENS_FRAME_ADDRESS());
+}
+#endif // MEMLENS_TRACE_MALLOC
+
+#ifdef MEMLENS_TRACE_LIBC_MALLOC
+// replacing malloc, free, calloc & realloc together is what glibc requires for
+// its own allocator to be bypassed consistently; they are declared with glibc's
+// exception specification (__THROW), as <malloc.h> may be included after them
+extern "C" MEMLENS_NOINLINE void* malloc(size_t size) __THROW {
+    void *ptr = __libc_malloc(size);
+    if (ALLOC_TRACING.load(std::memory_order_relaxed)) {
+        trace_alloc(ptr, size > 0 ? size : 1, MEMLENS_FRAME_ADDRESS());
+    }
+    return ptr;
+}
+
+extern "C" MEMLENS_NOINLINE void free(void *ptr) __THROW {
+    if (ptr != nullptr && ALLOC_TRACING.load(std::memory_order_relaxed)) {
+        trace_alloc(ptr, 0, MEMLENS_FRAME_ADDRESS());
+    }
+    __libc_free(ptr);
+}
+
+extern "C" MEMLENS_NOINLINE void* calloc(size_t count, size_t size) __THROW {
+    void *ptr = __libc_calloc(count, size);
+    if (ALLOC_TRACING.load(std::memory_order_relaxed)) {
+        trace_alloc(ptr, count * size > 0 ? count * size : 1, MEMLENS_FRAME_ADDRESS());
+    }
+    return ptr;
+}
+
+extern "C" MEMLENS_NOINLINE void* realloc(void *old_ptr, size_t size) __THROW {
+    void *ptr = __libc_realloc(old_ptr, size);
+    if (ALLOC_TRACING.load(std::memory_order_relaxed) && (ptr != nullptr || size == 0)) {
+        if (old_ptr != nullptr) {
+            trace_alloc(old_ptr, 0, MEMLENS_FRAME_ADDRESS());
+        }
+        trace_alloc(ptr, size, MEMLENS_FRAME_ADDRESS());
+    }
+    return ptr;
+}
+#endif // MEMLENS_TRACE_LIBC_MALLOC
+
+/// @brief Print the bytes still live, grouped by the call site that allocated them.
+void print_alloc_report() {
+    ALLOC_TRACING.store(false);
+    ALLOC_TRACE_BUSY = true;
+
+    drain_alloc_traces();
+    const alloc_trace_totals_t &totals = ALLOC_TRACE_TOTALS;
+    std::vector<std::pair<alloc_site_t, alloc_site_stats_t> > sorted(totals.sites.begin(), totals.sites.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<alloc_site_t, alloc_site_stats_t> &a, const std::pair<alloc_site_t, alloc_site_stats_t> &b) {
+        return a.second.live_bytes != b.second.live_bytes ? a.second.live_bytes > b.second.live_bytes : a.second.total_bytes > b.second.total_bytes;
+    });
+    uint64_t live_bytes = 0;
+    for (std::unordered_map<void*, alloc_live_t>::const_iterator it = totals.live.begin(); it != totals.live.end(); ++it) {
+        live_bytes += it->second.size;
+    }
+
+    update_memory_layout();
+    std::cout << std::dec << std::endl << "allocations: " << totals.allocs << " (" << size_str(totals.total_bytes) << "), frees: " << totals.frees
+        << ", live: " << totals.live.size() << " (" << size_str(live_bytes) << ")" << std::endl;
+    const size_t MAX_SITES = 20;
+    printf("%10s %8s %10s %8s  %s\n", "live", "count", "total", "count", "call site (innermost first)");
+    for (size_t i = 0; i < sorted.size() && i < MAX_SITES; i++) {
+        const alloc_site_stats_t &stats = sorted[i].second;
+        printf("%10s %8llu %10s %8llu ", size_str(stats.live_bytes).c_str(), (unsigned long long)stats.live_count,
+            size_str(stats.total_bytes).c_str(), (unsigned long long)stats.total_count);
+        for (size_t f = 0; f < ALLOC_TRACE_FRAMES && sorted[i].first[f] != nullptr; f++) {
+            // without frame pointers, the walk can pick up junk: stop at the first
+            // "return address" that isn't in code
+            const memory_region_t *region = MEMORY_INDEX.find(sorted[i].first[f]);
+            if (f > 0 && (region == nullptr || !(region->permissions & PERM_EXEC))) {
+                break;
+            }
+            printf("%s %s", f == 0 ? "" : " <-", named_address(sorted[i].first[f], region).c_str());
+        }
+        printf("\n");
+    }
+    if (sorted.size() > MAX_SITES) {
+        printf("(%zu more call sites)\n", sorted.size() - MAX_SITES);
+    }
+    fflush(stdout);
+}
+
+/// @brief Time `new`/`delete` pairs with tracing off and on.
+void bench_allocs(size_t count) {
+    std::vector<void*> ptrs(count);
+    for (int tracing = 0; tracing < 2; tracing++) {
+        ALLOC_TRACING.store(tracing != 0);
+        const uint64_t start = now_ns();
+        for (size_t i = 0; i < count; i++) {
+            ptrs[i] = new char[16 + i % 256];
+        }
+        for (size_t i = 0; i < count; i++) {
+            delete[] (char*)ptrs[i];
+        }
+        ALLOC_TRACING.store(false);
+        printf("%16s: %8.1f ns per new+delete\n", tracing ? "tracing" : "not tracing", (double)(now_ns() - start) / count);
+    }
+}
+
+/// @brief Traces allocations for as long as it lives, then prints a report.
+/// @details A scope rather than an `atexit()` handler, so that the report runs
+/// before function local statics (which it uses) are destroyed.
+class alloc_tracing_scope_t {
+public:
+    explicit alloc_tracing_scope_t(bool enable) :enabled(enable) {
+        if (enabled) {
+            ALLOC_TRACING.store(true);
+        }
+    }
+
+    ~alloc_tracing_scope_t() {
+        if (enabled) {
+            print_alloc_report();
+        }
+    }
+
+private:
+    bool enabled;
+};
+
+#endif // MEMLENS_ALLOCS_HPP
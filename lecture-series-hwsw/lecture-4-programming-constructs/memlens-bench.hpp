@@ -0,0 +1,322 @@
+/// @file
+/// @brief Benchmarks for memlens' own machinery.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// These exist so that we can tell whether changes to memlens itself make it faster
+/// or slower. Build with optimisations for meaningful numbers, e.g.
+/// `CXXFLAGS=-O2 make memlens`.
+
+#ifndef MEMLENS_BENCH_HPP
+#define MEMLENS_BENCH_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "memlens.hpp"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/// @return a monotonic timestamp in nanoseconds
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// @brief Print one row of a refresh benchmark.
+void print_refresh_row(size_t mappings, uint64_t total_ns, size_t iterations) {
+    const double per_refresh_us = (double)total_ns / iterations / 1000;
+    const double per_mapping_ns = (double)total_ns / iterations / mappings;
+    printf("%10zu %12.1f us %10.1f ns\n", mappings, per_refresh_us, per_mapping_ns);
+}
+
+#ifdef __linux__
+/// @brief Build /proc/<pid>/maps text with `count` lines, that looks like a big
+/// process: mostly anonymous mappings, with shared libraries sprinkled in.
+std::string synthetic_maps(size_t count) {
+    std::string maps;
+    char line[256];
+    uintptr_t addr = 0x7f0000000000ull;
+    for (size_t i = 0; i < count; i++) {
+        const uintptr_t end = addr + 0x1000 * (1 + i % 16);
+        int n;
+        if (i == 0) {
+            n = snprintf(line, sizeof(line), "%012lx-%012lx rw-p 00000000 00:00 0                          [heap]\n", (unsigned long)addr, (unsigned long)end);
+        } else if (i + 1 == count) {
+            n = snprintf(line, sizeof(line), "%012lx-%012lx rw-p 00000000 00:00 0                          [stack]\n", (unsigned long)addr, (unsigned long)end);
+        } else if (i % 8 == 0) {
+            static const char *const perms[] = {"r--p", "r-xp", "r--p", "rw-p"};
+            n = snprintf(line, sizeof(line), "%012lx-%012lx %s %08zx fe:00 %-10zu                 /usr/lib/x86_64-linux-gnu/libsynthetic%zu.so.1\n",
+                (unsigned long)addr, (unsigned long)end, perms[(i / 8) % 4], (i / 8) % 4 * 0x1000, 400000 + i / 32, i / 32 % 64);
+        } else {
+            n = snprintf(line, sizeof(line), "%012lx-%012lx rw-p 00000000 00:00 0 \n", (unsigned long)addr, (unsigned long)end);
+        }
+        maps.append(line, n);
+        addr = end + 0x1000;
+    }
+    return maps;
+}
+
+/// @return the value of /proc/sys/vm/max_map_count (or a conservative default)
+size_t max_map_count() {
+    std::vector<char> buf;
+    const ssize_t len = read_proc_file("/proc/sys/vm/max_map_count", buf);
+    const char *p = len > 0 ? &buf[0] : nullptr;
+    const uint64_t count = p != nullptr ? parse_dec(p, p + len) : 0;
+    return count > 0 ? count : 65530;
+}
+#endif // __linux__
+
+/// @brief Time layout refreshes with 100, 10k & 100k mappings.
+/// @details On Linux, the maps parser is first timed on synthetic maps text (so
+/// that 100k mappings are possible even when vm.max_map_count is lower), then full
+/// refreshes are timed against this process (maps, merged with the previous layout,
+/// then smaps for the usage sizes of every mapping), after splitting one large
+/// mapping into the required number of distinct mappings via mprotect().
+void bench_refresh() {
+    const size_t SIZES[] = {100, 10000, 100000};
+
+#ifdef __linux__
+    printf("maps parse (synthetic /proc/self/maps text)\n");
+    printf("%10s %15s %13s\n", "mappings", "per refresh", "per mapping");
+    std::vector<memory_region_t> regions;
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+        const std::string maps = synthetic_maps(SIZES[s]);
+        const size_t iterations = 2 + 2000000 / SIZES[s];
+        regions.clear();
+        parse_memory_maps(maps.data(), maps.size(), regions, ""); // warm up (interns strings)
+        const uint64_t start = now_ns();
+        for (size_t i = 0; i < iterations; i++) {
+            regions.clear();
+            parse_memory_maps(maps.data(), maps.size(), regions, "");
+        }
+        print_refresh_row(SIZES[s], now_ns() - start, iterations);
+    }
+    printf("\n");
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+    printf("full refresh (this process)\n");
+    printf("%10s %15s %13s\n", "mappings", "per refresh", "per mapping");
+    const size_t page_size = getpagesize();
+#ifdef __linux__
+    const size_t limit = max_map_count();
+#else
+    const size_t limit = (size_t)-1;
+#endif
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++) {
+        update_memory_layout();
+        const size_t existing = MEMORY_REGIONS.size();
+        if (SIZES[s] + 64 > limit) {
+            printf("%10zu    skipped (vm.max_map_count is %zu)\n", SIZES[s], limit);
+            continue;
+        }
+        // alternate the protection of every other page, so that the kernel
+        // can't merge neighbouring pages into a single mapping
+        const size_t extra = SIZES[s] > existing ? SIZES[s] - existing : 0;
+        const size_t len = (2 * (extra / 2) + 1) * page_size;
+        uint8_t *area = (uint8_t*)mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (area == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        for (size_t page = 1; page < len / page_size; page += 2) {
+            mprotect(area + page * page_size, page_size, PROT_READ);
+        }
+        update_memory_layout(); // warm up
+        const size_t mappings = MEMORY_REGIONS.size();
+        const size_t iterations = 2 + 200000 / mappings;
+        const uint64_t start = now_ns();
+        for (size_t i = 0; i < iterations; i++) {
+            update_memory_layout();
+        }
+        print_refresh_row(mappings, now_ns() - start, iterations);
+        munmap(area, len);
+    }
+#else
+    (void)SIZES;
+    std::cerr << "bench-refresh is not supported on this platform" << std::endl;
+#endif
+}
+
+/// @brief Time address -> region lookups: a linear scan over all regions (how
+/// `named_address()` used to work), `region_index_t::find()`, and the batched
+/// `region_index_t::find_sorted()` sweep; then address -> symbol lookups over code.
+void bench_lookup(size_t count) {
+    update_memory_layout();
+    std::vector<const void*> addresses(count);
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < count; i++) {
+        // xorshift, so that every run looks up the same addresses
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        const memory_region_t &region = MEMORY_REGIONS[seed % MEMORY_REGIONS.size()];
+        addresses[i] = (uint8_t*)region.start_address + (seed >> 32) % region.size;
+    }
+    std::vector<const memory_region_t*> found(count);
+    printf("%zu lookups over %zu regions\n", count, MEMORY_REGIONS.size());
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        found[i] = nullptr;
+        for (std::vector<memory_region_t>::const_iterator it = MEMORY_REGIONS.begin(); it != MEMORY_REGIONS.end(); ++it) {
+            if (addresses[i] >= it->start_address && addresses[i] < (void*)((uint8_t*)it->start_address + it->size)) {
+                found[i] = &*it;
+                break;
+            }
+        }
+    }
+    printf("%16s: %8.1f ns/address\n", "linear scan", (double)(now_ns() - start) / count);
+
+    start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        found[i] = MEMORY_INDEX.find(addresses[i]);
+    }
+    printf("%16s: %8.1f ns/address\n", "index", (double)(now_ns() - start) / count);
+
+    std::sort(addresses.begin(), addresses.end());
+    start = now_ns();
+    MEMORY_INDEX.find_sorted(&addresses[0], count, &found[0]);
+    printf("%16s: %8.1f ns/address (excluding the sort)\n", "index (batched)", (double)(now_ns() - start) / count);
+
+    // symbolizing: the same, but only over code, e.g. like sampled instruction pointers
+    std::vector<const memory_region_t*> code;
+    for (std::vector<memory_region_t>::const_iterator it = MEMORY_REGIONS.begin(); it != MEMORY_REGIONS.end(); ++it) {
+        if (it->permissions & PERM_EXEC) {
+            code.push_back(&*it);
+        }
+    }
+    if (code.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        const memory_region_t &region = *code[seed % code.size()];
+        addresses[i] = (uint8_t*)region.start_address + (seed >> 32) % region.size;
+    }
+    start = now_ns();
+    const symbol_table_t &symbols = self_symbols();
+    const uint64_t load_ns = now_ns() - start;
+    size_t resolved = 0;
+    start = now_ns();
+    for (size_t i = 0; i < count; i++) {
+        size_t offset;
+        resolved += symbols.find(addresses[i], offset) != nullptr;
+    }
+    printf("%16s: %8.1f ns/address (%zu%% resolved, %.1f ms to load the symbol tables)\n", "symbols",
+        (double)(now_ns() - start) / count, resolved * 100 / count, load_ns / 1e6);
+}
+
+/// @brief The original hexdump formatter, a byte at a time through an `std::ostream`.
+/// @details Kept as the reference that `hexdump_rows()` must match, byte for byte,
+/// and as the baseline to compare its speed against.
+void dump_rows_iostream(std::ostream &os, const uint8_t *bytes, const void *address, size_t size) {
+    const uint8_t *end_address = (uint8_t*)address + size;
+    const uint8_t *address_base = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(address) & ~0xf);
+    const size_t offset = (uint8_t*)address - address_base;
+    const size_t rows = (size + offset + 15) / 16;
+    for (size_t row = 0; row < rows; row++) {
+        const uint8_t *row_address = address_base + row * 16;
+        os << std::hex << std::noshowbase << reinterpret_cast<uintptr_t>(row_address) << "  ";
+        for (size_t i = 0; i < 16; i++) {
+            const uint8_t *u8_addr = row_address + i;
+            if (u8_addr >= address && u8_addr < end_address) {
+                os << std::hex << std::setfill('0') << std::setw(2) << (int)bytes[u8_addr - (uint8_t*)address] << " ";
+            } else {
+                os << "   ";
+            }
+        }
+        os << "  |";
+        for (size_t i = 0; i < 16; i++) {
+            const uint8_t *u8_addr = row_address + i;
+            if (u8_addr >= address && u8_addr < end_address) {
+                const uint8_t c = bytes[u8_addr - (uint8_t*)address];
+                os << (c >= 32 && c < 127 ? (char)c : '.');
+            } else {
+                os << " ";
+            }
+        }
+        os << "|" << std::endl;
+    }
+}
+
+/// @brief Check every hexdump kernel against `dump_rows_iostream()`, then time
+/// each of them formatting `size` bytes, in GB/s of input.
+void bench_hexdump(size_t size) {
+    std::vector<uint8_t> data(size + 64);
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < data.size(); i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        data[i] = (uint8_t)seed;
+    }
+
+    // all alignments & small sizes, plus a row address that changes width
+    output_buffer_t out(-1);
+    bool all_match = true;
+    for (int k = HEXDUMP_SCALAR; k < HEXDUMP_BEST; k++) {
+        const hexdump_kernel_t kernel = (hexdump_kernel_t)k;
+        if (!hexdump_kernel_supported(kernel)) {
+            continue;
+        }
+        for (size_t start = 0; start < 32; start++) {
+            for (size_t len = 0; len < 200; len += 1 + len / 16) {
+                const uint8_t *address = (const uint8_t*)0xffb0 + start;
+                std::ostringstream expected;
+                dump_rows_iostream(expected, &data[0], address, len);
+                out.clear();
+                hexdump_rows(&data[0], address, len, out, kernel);
+                if (expected.str() != std::string(out.data(), out.size())) {
+                    printf("%s: mismatch at offset %zu, size %zu\n", HEXDUMP_KERNEL_NAMES[k], start, len);
+                    all_match = false;
+                    break;
+                }
+            }
+        }
+    }
+    if (!all_match) {
+        return;
+    }
+    printf("all kernels match the iostream formatter\n");
+
+#if defined(__linux__) || defined(__APPLE__)
+    const int null_fd = open("/dev/null", O_WRONLY);
+#else
+    const int null_fd = -1;
+#endif
+    printf("%10s %12s %10s\n", "kernel", "bytes", "GB/s");
+    {
+        // so slow that a slice of the input is enough
+        const size_t len = size < (4 << 20) ? size : (4 << 20);
+        std::ofstream null_stream("/dev/null");
+        const uint64_t start = now_ns();
+        dump_rows_iostream(null_stream, &data[0], &data[0], len);
+        printf("%10s %12zu %10.3f\n", "iostream", len, (double)len / (now_ns() - start));
+    }
+    for (int k = HEXDUMP_SCALAR; k < HEXDUMP_BEST; k++) {
+        if (!hexdump_kernel_supported((hexdump_kernel_t)k)) {
+            printf("%10s %12s\n", HEXDUMP_KERNEL_NAMES[k], "unsupported");
+            continue;
+        }
+        output_buffer_t null_out(null_fd, 4 << 20);
+        hexdump_rows(&data[0], &data[0], size, null_out, (hexdump_kernel_t)k); // warm up
+        null_out.clear();
+        const uint64_t start = now_ns();
+        hexdump_rows(&data[0], &data[0], size, null_out, (hexdump_kernel_t)k);
+        null_out.flush();
+        printf("%10s %12zu %10.3f\n", HEXDUMP_KERNEL_NAMES[k], size, (double)size / (now_ns() - start));
+    }
+#if defined(__linux__) || defined(__APPLE__)
+    close(null_fd);
+#endif
+}
+
+#endif // MEMLENS_BENCH_HPP
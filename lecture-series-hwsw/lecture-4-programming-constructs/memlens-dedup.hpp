@@ -0,0 +1,289 @@
+/// @file
+/// @brief Zero & duplicate pages: how much memory holds nothing, or the same thing twice.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// Every resident page of every writable region is read (in parallel, with the scan
+/// engine of memlens-scan.hpp) and hashed; pages that are all zeros and pages whose
+/// hash was seen before are counted, per region. That's roughly what the kernel's
+/// KSM (kernel samepage merging) would save if the process opted in: zero pages can
+/// be mapped to the shared zero page, and N copies of a page can share one.
+///
+/// Pages that aren't resident aren't read: reading them would fault them in (or at
+/// least map them to the zero page), which changes what we're measuring. The hash is
+/// 64 bits wide, so among even billions of pages a collision is very unlikely; pages
+/// with equal hashes are not compared byte by byte.
+
+#ifndef MEMLENS_DEDUP_HPP
+#define MEMLENS_DEDUP_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "memlens.hpp"
+#include "memlens-residency.hpp"
+#include "memlens-scan.hpp"
+
+/// @return the high & low halves of the 128 bit product of `a` and `b`, xor-ed
+/// (spelled out in 32 bit halves, as not every compiler has a 128 bit type)
+inline uint64_t multiply_fold(uint64_t a, uint64_t b) {
+    const uint64_t lo_lo = (a & 0xffffffffu) * (b & 0xffffffffu);
+    const uint64_t hi_lo = (a >> 32) * (b & 0xffffffffu);
+    const uint64_t lo_hi = (a & 0xffffffffu) * (b >> 32);
+    const uint64_t hi_hi = (a >> 32) * (b >> 32);
+    const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffu) + lo_hi;
+    const uint64_t high = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    const uint64_t low = (cross << 32) | (lo_lo & 0xffffffffu);
+    return high ^ low;
+}
+
+/// @brief Hash `size` bytes (a multiple of 64) of a page.
+/// @details Built like xxh3 (but not compatible with it): 8 independent 64 bit
+/// lanes, each 64 bit word is mixed in with a 32x32->64 bit multiply of the word and
+/// a key, which compilers vectorize (pmuludq); the lanes are scrambled every 1 KiB
+/// and folded into one with 64x64->128 bit multiplies at the end.
+uint64_t page_hash(const uint8_t *page, size_t size) {
+    static const uint64_t KEYS[8] = {
+        0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+        0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+    };
+    const uint64_t PRIME32_1 = 0x9e3779b1ull;
+    const uint64_t PRIME64_1 = 0x9e3779b185ebca87ull;
+    uint64_t acc[8] = {
+        PRIME32_1, PRIME64_1, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull,
+        0x85ebca77c2b2ae63ull, 0x85ebca77ull, 0x27d4eb2f165667c5ull, 0x9e3779b1ull,
+    };
+    for (size_t offset = 0; offset < size; offset += 64) {
+        for (size_t lane = 0; lane < 8; lane++) {
+            uint64_t value;
+            memcpy(&value, page + offset + lane * 8, sizeof(value));
+            const uint64_t keyed = value ^ KEYS[lane];
+            acc[lane ^ 1] += value;
+            acc[lane] += (keyed & 0xffffffffu) * (keyed >> 32);
+        }
+        if (offset % 1024 == 1024 - 64) {
+            for (size_t lane = 0; lane < 8; lane++) {
+                acc[lane] = (acc[lane] ^ acc[lane] >> 47 ^ KEYS[7 - lane]) * PRIME32_1;
+            }
+        }
+    }
+    uint64_t hash = size * PRIME64_1;
+    for (size_t lane = 0; lane < 8; lane += 2) {
+        hash += multiply_fold(acc[lane] ^ KEYS[lane], acc[lane + 1] ^ KEYS[lane + 1]);
+    }
+    // avalanche
+    hash ^= hash >> 37;
+    hash *= 0x165667919e3779f9ull;
+    return hash ^ hash >> 32;
+}
+
+#ifdef __linux__
+/// @return the first line of `path` (e.g. a sysfs setting), or "?" if it can't be read
+std::string read_setting(const char *path) {
+    char line[256];
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+        return "?";
+    }
+    const bool read = fgets(line, sizeof(line), f) != nullptr;
+    fclose(f);
+    if (!read) {
+        return "?";
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return line;
+}
+
+/// @brief `memlens dedup`: find the zero & duplicate pages among the resident pages
+/// of the writable regions of process `pid` (0 for the current one).
+void print_duplicate_pages(int pid, size_t threads) {
+    const size_t CHUNK_SIZE = 1024 * 1024;
+    const size_t page_size = getpagesize();
+    const uint64_t ZERO_PAGE = 0; // the hash of a page that is all zeros (no other hash is 0)
+
+    // the workers share the reader's layout; ours also has the usage (for THP)
+    process_reader_t reader;
+    if (!reader.attach(pid)) {
+        return;
+    }
+    std::vector<memory_region_t> regions = reader.layout();
+    load_memory_usage(regions, pid);
+    residency_scanner_t scanner;
+    if (!scanner.open(pid)) {
+        return;
+    }
+    // only read what's resident: a range per run of resident pages
+    std::vector<scan_range_t> ranges;
+    std::vector<size_t> range_region;
+    std::vector<size_t> resident_pages(regions.size(), 0);
+    region_residency_t residency;
+    for (size_t r = 0; r < regions.size(); r++) {
+        const memory_region_t &region = regions[r];
+        if (!(region.permissions & PERM_READ) || !(region.permissions & PERM_WRIT) || strncmp(region.region_type.c_str(), "vvar", 4) == 0) {
+            continue;
+        }
+        scanner.scan(region, residency);
+        resident_pages[r] = residency.present_pages;
+        for (size_t page = 0; page < residency.pages; ) {
+            if (!((residency.present[page / 64] >> (page % 64)) & 1)) {
+                page++;
+                continue;
+            }
+            size_t end = page + 1;
+            while (end < residency.pages && ((residency.present[end / 64] >> (end % 64)) & 1)) {
+                end++;
+            }
+            const scan_range_t range = {reinterpret_cast<uintptr_t>(region.start_address) + page * page_size, (end - page) * page_size};
+            ranges.push_back(range);
+            range_region.push_back(r);
+            page = end;
+        }
+    }
+
+    // each chunk gets its own slot for the hashes of its pages, so the workers never
+    // share anything but the scheduler
+    std::vector<size_t> chunk_region;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        chunk_region.insert(chunk_region.end(), scan_chunks_of(ranges[i], CHUNK_SIZE), range_region[i]);
+    }
+    std::vector<std::vector<uint64_t> > hashes(chunk_region.size());
+    const std::vector<uint8_t> zeros(page_size, 0);
+    const uint64_t start = now_ns();
+    const size_t unreadable = parallel_scan(reader, ranges, CHUNK_SIZE, 0, threads,
+        [&](size_t chunk, uintptr_t, const uint8_t *bytes, size_t size, size_t) {
+            std::vector<uint64_t> &out = hashes[chunk];
+            const size_t first = out.size();
+            out.resize(first + size / page_size);
+            for (size_t page = first; page < out.size(); page++) {
+                const uint8_t *p = bytes + (page - first) * page_size;
+                // most memory that's wasted is zeros, and memcmp() beats hashing them
+                if (memcmp(p, &zeros[0], page_size) == 0) {
+                    out[page] = ZERO_PAGE;
+                } else {
+                    const uint64_t hash = page_hash(p, page_size);
+                    out[page] = hash != ZERO_PAGE ? hash : 1;
+                }
+            }
+        });
+    const uint64_t hashed = now_ns();
+
+    // sort by hash to find the duplicates; which region a page is in goes along
+    std::vector<std::pair<uint64_t, uint32_t> > pages;
+    std::vector<size_t> zero_pages(regions.size(), 0);
+    for (size_t chunk = 0; chunk < hashes.size(); chunk++) {
+        for (std::vector<uint64_t>::const_iterator it = hashes[chunk].begin(); it != hashes[chunk].end(); ++it) {
+            if (*it == ZERO_PAGE) {
+                zero_pages[chunk_region[chunk]]++;
+            } else {
+                pages.push_back(std::make_pair(*it, (uint32_t)chunk_region[chunk]));
+            }
+        }
+        std::vector<uint64_t>().swap(hashes[chunk]);
+    }
+    std::sort(pages.begin(), pages.end());
+    // every copy of a page but the first is redundant; the first one is the one in
+    // the lowest region, so a region's duplicates are copies of something before it
+    std::vector<size_t> duplicate_pages(regions.size(), 0);
+    size_t distinct_duplicated = 0;
+    for (size_t i = 0; i < pages.size(); ) {
+        size_t end = i + 1;
+        while (end < pages.size() && pages[end].first == pages[i].first) {
+            duplicate_pages[pages[end].second]++;
+            end++;
+        }
+        distinct_duplicated += end - i > 1;
+        i = end;
+    }
+    const uint64_t elapsed = now_ns() - start;
+
+    // with --format, the table becomes records, and the summary goes to stderr
+    const bool text = OUTPUT_FORMAT == FORMAT_TEXT;
+    FILE *summary = text ? stdout : stderr;
+    output_buffer_t out(1, 64 * 1024);
+    record_writer_t records(out, OUTPUT_FORMAT);
+    if (text) {
+        printf("%16s-%-16s %9s %9s %9s %6s  %s\n", "start_addr ", " end_addr", "resident", "zero", "duplicate", "waste", "region");
+    }
+    size_t total_resident = 0;
+    size_t total_zero = 0;
+    size_t total_duplicate = 0;
+    size_t thp_zero = 0;
+    for (size_t r = 0; r < regions.size(); r++) {
+        if (resident_pages[r] == 0) {
+            continue;
+        }
+        const memory_region_t &region = regions[r];
+        total_resident += resident_pages[r];
+        total_zero += zero_pages[r];
+        total_duplicate += duplicate_pages[r];
+        // zero pages within huge pages can't be given back without splitting them
+        const size_t thp_pages = region.anon_huge_size / page_size;
+        thp_zero += zero_pages[r] < thp_pages ? zero_pages[r] : thp_pages;
+        if (!text) {
+            records.begin();
+            records.field_hex("start", reinterpret_cast<uintptr_t>(region.start_address));
+            records.field_hex("end", reinterpret_cast<uintptr_t>(region.start_address) + region.size);
+            records.field_uint("resident", resident_pages[r] * page_size);
+            records.field_uint("zero", zero_pages[r] * page_size);
+            records.field_uint("duplicate", duplicate_pages[r] * page_size);
+            records.field_str("type", region.region_type.c_str());
+            records.field_str("detail", region.region_detail.c_str());
+            records.end();
+            continue;
+        }
+        char waste[16];
+        snprintf(waste, sizeof(waste), "%.0f%%", (zero_pages[r] + duplicate_pages[r]) * 100.0 / resident_pages[r]);
+        printf("%16lx-%-16lx %9s %9s %9s %6s  %s%s%s\n",
+            (unsigned long)reinterpret_cast<uintptr_t>(region.start_address),
+            (unsigned long)reinterpret_cast<uintptr_t>(region.start_address) + region.size,
+            size_str(resident_pages[r] * page_size).c_str(),
+            size_str(zero_pages[r] * page_size).c_str(),
+            size_str(duplicate_pages[r] * page_size).c_str(),
+            waste, region.region_type.c_str(),
+            region.region_detail.c_str()[0] == '/' ? "  " : "",
+            region.region_detail.c_str()[0] == '/' ? region.region_detail.c_str() : "");
+    }
+    if (text) {
+        printf("%33s %9s %9s %9s\n\n", "total", size_str(total_resident * page_size).c_str(),
+            size_str(total_zero * page_size).c_str(), size_str(total_duplicate * page_size).c_str());
+    }
+    records.finish();
+    out.flush();
+    fprintf(summary, "%zu resident pages (%s)%s hashed in %.1f ms (%.2f GB/s, %zu threads), %.1f ms in total\n",
+        total_resident, size_str(total_resident * page_size).c_str(), unreadable_str(unreadable).c_str(), (hashed - start) / 1e6,
+        hashed > start ? total_resident * page_size / (double)(hashed - start) : 0.0, threads, elapsed / 1e6);
+    fprintf(summary, "%zu zero pages (%s), %zu redundant copies of %zu distinct pages (%s)\n", total_zero,
+        size_str(total_zero * page_size).c_str(), total_duplicate, distinct_duplicated, size_str(total_duplicate * page_size).c_str());
+    if (total_resident > 0) {
+        fprintf(summary, "KSM could save up to %s (%.1f%% of resident; ksm run=%s, needs MADV_MERGEABLE or PR_SET_MEMORY_MERGE)\n",
+            size_str((total_zero + total_duplicate) * page_size).c_str(), (total_zero + total_duplicate) * 100.0 / total_resident,
+            read_setting("/sys/kernel/mm/ksm/run").c_str());
+        fprintf(summary, "%s of the zero pages are in huge pages, which KSM only merges after splitting them (thp: %s)\n",
+            size_str(thp_zero * page_size).c_str(), read_setting("/sys/kernel/mm/transparent_hugepage/enabled").c_str());
+    }
+}
+#else
+void print_duplicate_pages(int pid, size_t threads) {
+    (void)pid;
+    (void)threads;
+    std::cerr << "dedup is only supported on linux" << std::endl;
+}
+#endif // __linux__
+
+/// @brief Run `print_duplicate_pages()` on ourselves, after filling a few buffers with
+/// zeros, copies of the same data, and unique data.
+void demo_duplicate_pages(size_t threads) {
+    const size_t SIZE = 16 * 1024 * 1024;
+    std::vector<uint8_t> zeros(SIZE, 1);
+    std::fill(zeros.begin(), zeros.end(), 0); // resident, but zeros
+    std::vector<uint8_t> unique(SIZE);
+    for (size_t i = 0; i < SIZE; i += sizeof(uint64_t)) {
+        const uint64_t value = i * 0x9e3779b97f4a7c15ull;
+        memcpy(&unique[i], &value, sizeof(value));
+    }
+    std::vector<uint8_t> copy(unique);  // every page duplicated once
+    (OUTPUT_FORMAT == FORMAT_TEXT ? std::cout : std::cerr) << "16M of zeros at " << (void*)&zeros[0] << ", 16M of unique data at " << (void*)&unique[0]
+        << " and a copy of it at " << (void*)&copy[0] << std::endl << std::endl;
+    print_duplicate_pages(0, threads);
+}
+
+#endif // MEMLENS_DEDUP_HPP
@@ -0,0 +1,336 @@
+/// @file
+/// @brief What dynamic dispatch costs: timing `bonus()` calls, dispatched four ways.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// `demo-poly` and `demo-late-poly` show where `label()` goes; here we time calls
+/// like it, over arrays of employees & CEOs mixed in different ways:
+/// - mono: only employees, so every call goes to the same place
+/// - bi: employees & CEOs alternating, a pattern branch predictors learn
+/// - random: employees & CEOs at random, which no predictor can learn
+///
+/// The call timed is `bonus()`, which only does arithmetic on a field: `label()`
+/// returns a `std::string`, and building it would cost more than the call itself.
+/// Each mix is run with `bonus()` dispatched as:
+/// - virtual: through the vtable of `EmployeeDyn`/`CEODyn`, an indirect call
+/// - switch: `Employee`/`CEO` tagged with their type, and an `if` on the tag
+/// - variant: `std::variant<Employee, CEO>` and `std::visit()`
+/// - crtp: `EmployeeCRTP`/`CEOCRTP`, which are different types with no common base,
+///   so they can't share an array: each type is kept in its own, and they are called
+///   in the order of the mix, with an `if` on which array the next one is in
+/// - sorted: the same, but calling one array after the other, so not in the order of
+///   the mix (which is the trick, more than CRTP itself: the calls are inlined into
+///   loops without a branch, which the compiler can vectorize)
+///
+/// Where the indirect call costs most is when its target can't be predicted: compare
+/// the random mix with the other two. Each run is repeated 3 times; the fastest is
+/// reported, with how much slower the slowest was (if that's more than a few %, the
+/// machine was busy and the numbers are suspect).
+///
+/// Branch misses come from a hardware counter (`perf_event_open()`), where there is
+/// one; virtual machines often don't expose them.
+
+#ifndef MEMLENS_DISPATCH_HPP
+#define MEMLENS_DISPATCH_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <variant>
+#include <vector>
+#include "memlens.hpp"
+#include "memlens-bench.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/// @brief `Employee`, with `label()` & `bonus()` resolved at compile time through
+/// the derived class, with the "curiously recurring template pattern".
+template <typename Derived>
+class EmployeeBase {
+private:
+    int id;
+    int exp_yrs;
+    int salary;
+public:
+    EmployeeBase(int id, int exp_yrs, int salary)
+        :id(id), exp_yrs(exp_yrs),
+            salary(salary) {}
+
+    int salary_per_yr_of_exp() const {
+        return salary / exp_yrs;
+    }
+
+    std::string label() const {
+        return static_cast<const Derived*>(this)->label_impl();
+    }
+
+    int bonus() const {
+        return static_cast<const Derived*>(this)->bonus_impl();
+    }
+
+    /// @return the bonus of an employee, as `Employee::bonus()`
+    int employee_bonus() const {
+        return salary / 10;
+    }
+};
+
+class EmployeeCRTP : public EmployeeBase<EmployeeCRTP> {
+public:
+    EmployeeCRTP(int id, int exp_yrs, int salary)
+        :EmployeeBase<EmployeeCRTP>(id, exp_yrs, salary) {}
+
+    std::string label_impl() const {
+        // same tracing as the other versions, so that they do the same work
+        typedef std::string (EmployeeCRTP::* pfunc)() const;
+        pfunc fptr = &EmployeeCRTP::label_impl;
+        uint8_t *f_label = *(uint8_t**)&fptr;
+        print_address_of_func(TRACE_CALLS, *f_label, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
+        return "EmployeeCRTP";
+    }
+
+    int bonus_impl() const {
+        return employee_bonus();
+    }
+};
+
+class CEOCRTP : public EmployeeBase<CEOCRTP> {
+public:
+    CEOCRTP(int id, int exp_yrs, int salary)
+        :EmployeeBase<CEOCRTP>(id, exp_yrs, salary) {}
+
+    std::string label_impl() const {
+        typedef std::string (CEOCRTP::* pfunc)() const;
+        pfunc fptr = &CEOCRTP::label_impl;
+        uint8_t *f_label = *(uint8_t**)&fptr;
+        print_address_of_func(TRACE_CALLS, *f_label, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
+        return "CEOCRTP";
+    }
+
+    int bonus_impl() const {
+        return employee_bonus() * 5;
+    }
+};
+
+/// @brief where the result of every run goes, so that no call can be optimized away
+volatile size_t DISPATCH_SINK = 0;
+
+/// @brief Counts the branch mispredictions of this thread, if the hardware (and
+/// kernel) let us.
+class branch_miss_counter_t {
+public:
+    branch_miss_counter_t() :fd(-1) {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+#endif
+    }
+
+    ~branch_miss_counter_t() {
+#ifdef __linux__
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    bool available() const {
+        return fd >= 0;
+    }
+
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /// @return the branch misses since `start()`
+    uint64_t stop() {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd;
+};
+
+/// @brief One of the ways being compared: `run(passes)` makes `passes` passes over
+/// its objects, and returns something computed from every call (which goes to
+/// `DISPATCH_SINK`, so that the calls can't be optimized away).
+typedef struct {
+    const char *name;
+    std::function<size_t(size_t passes)> run;
+} dispatch_contender_t;
+
+/// @brief Run each of `contenders` for `passes` passes over `objects` objects (after
+/// a warm up of 1/16th of that), and print how long a call took, how many branch
+/// misses it had, how much the runs varied, and how much slower it was than the
+/// fastest.
+/// @details Like `COMPARE_TWO_N_TIMES` of the C benchmarks, for any number of
+/// contenders; each is timed 3 times, and the fastest run is kept.
+void compare_dispatch(const char *mix, const std::vector<dispatch_contender_t> &contenders, size_t objects, size_t passes) {
+    branch_miss_counter_t counter;
+    std::vector<double> ns_per_call(contenders.size());
+    std::vector<double> slowest_ns_per_call(contenders.size());
+    std::vector<double> misses_per_call(contenders.size());
+    for (size_t c = 0; c < contenders.size(); c++) {
+        DISPATCH_SINK = contenders[c].run(passes / 16 > 0 ? passes / 16 : 1);
+        ns_per_call[c] = 1e300;
+        slowest_ns_per_call[c] = 0;
+        for (int attempt = 0; attempt < 3; attempt++) {
+            counter.start();
+            const uint64_t start = now_ns();
+            DISPATCH_SINK = contenders[c].run(passes);
+            const uint64_t elapsed = now_ns() - start;
+            const uint64_t misses = counter.stop();
+            const double per_call = (double)elapsed / (objects * passes);
+            if (per_call < ns_per_call[c]) {
+                ns_per_call[c] = per_call;
+                misses_per_call[c] = (double)misses / (objects * passes);
+            }
+            slowest_ns_per_call[c] = per_call > slowest_ns_per_call[c] ? per_call : slowest_ns_per_call[c];
+        }
+    }
+    const double fastest = *std::min_element(ns_per_call.begin(), ns_per_call.end());
+    for (size_t c = 0; c < contenders.size(); c++) {
+        char misses[16];
+        if (counter.available()) {
+            snprintf(misses, sizeof(misses), "%.3f", misses_per_call[c]);
+        } else {
+            snprintf(misses, sizeof(misses), "n/a");
+        }
+        char spread[16];
+        snprintf(spread, sizeof(spread), "+%.1f%%", (slowest_ns_per_call[c] - ns_per_call[c]) * 100 / ns_per_call[c]);
+        char slower[16];
+        snprintf(slower, sizeof(slower), "+%.0f%%", (ns_per_call[c] - fastest) * 100 / fastest);
+        printf("%-7s %-8s %9.2f %8s %13s %10s\n", c == 0 ? mix : "", contenders[c].name, ns_per_call[c], spread, misses,
+            ns_per_call[c] == fastest ? "fastest" : slower);
+    }
+}
+
+/// @brief `memlens bench-dispatch`: time about `calls` calls to `bonus()` for each
+/// mix of types and each way of dispatching.
+void bench_dispatch(size_t calls) {
+    const size_t OBJECTS = 4096; // small enough to stay in L1/L2, so that we time calls, not memory
+    const size_t passes = calls / OBJECTS > 0 ? calls / OBJECTS : 1;
+
+    printf("%zu calls per run, over %zu objects; ns/call of the fastest of 3 runs, spread up to the slowest\n", passes * OBJECTS, OBJECTS);
+    printf("%-7s %-8s %9s %8s %13s %10s\n", "mix", "dispatch", "ns/call", "spread", "br-miss/call", "vs fastest");
+    const char *MIXES[] = {"mono", "bi", "random"};
+    for (size_t m = 0; m < sizeof(MIXES) / sizeof(MIXES[0]); m++) {
+        // which objects are CEOs
+        std::vector<uint8_t> is_ceo(OBJECTS);
+        std::mt19937 random(42);
+        for (size_t i = 0; i < OBJECTS; i++) {
+            is_ceo[i] = m == 0 ? 0 : m == 1 ? i % 2 : random() & 1;
+        }
+
+        std::vector<EmployeeDyn> dyn_employees;
+        std::vector<CEODyn> dyn_ceos;
+        std::vector<CEO> tagged;   // a CEO is an employee with a different bonus()
+        std::vector<std::variant<Employee, CEO> > variants;
+        std::vector<EmployeeCRTP> crtp_employees;
+        std::vector<CEOCRTP> crtp_ceos;
+        dyn_employees.reserve(OBJECTS);
+        dyn_ceos.reserve(OBJECTS);
+        for (size_t i = 0; i < OBJECTS; i++) {
+            const int id = (int)i;
+            const int exp_yrs = 1 + (int)(i % 30);
+            const int salary = 1000 * (int)(i % 200);
+            tagged.push_back(CEO(id, exp_yrs, salary));
+            if (is_ceo[i]) {
+                dyn_ceos.push_back(CEODyn(id, exp_yrs, salary));
+                variants.push_back(CEO(id, exp_yrs, salary));
+                crtp_ceos.push_back(CEOCRTP(id, exp_yrs, salary));
+            } else {
+                dyn_employees.push_back(EmployeeDyn(id, exp_yrs, salary));
+                variants.push_back(Employee(id, exp_yrs, salary));
+                crtp_employees.push_back(EmployeeCRTP(id, exp_yrs, salary));
+            }
+        }
+        // the virtual calls go through pointers, in the order of the mix
+        std::vector<const EmployeeDyn*> dyns;
+        for (size_t i = 0, e = 0, c = 0; i < OBJECTS; i++) {
+            dyns.push_back(is_ceo[i] ? static_cast<const EmployeeDyn*>(&dyn_ceos[c++]) : &dyn_employees[e++]);
+        }
+
+        std::vector<dispatch_contender_t> contenders;
+        contenders.push_back({"virtual", [&](size_t n) {
+            size_t sum = 0;
+            for (size_t pass = 0; pass < n; pass++) {
+                for (std::vector<const EmployeeDyn*>::const_iterator it = dyns.begin(); it != dyns.end(); ++it) {
+                    sum += (*it)->bonus();
+                }
+            }
+            return sum;
+        }});
+        contenders.push_back({"switch", [&](size_t n) {
+            size_t sum = 0;
+            for (size_t pass = 0; pass < n; pass++) {
+                for (size_t i = 0; i < tagged.size(); i++) {
+                    sum += is_ceo[i] ? tagged[i].bonus() : tagged[i].Employee::bonus();
+                }
+            }
+            return sum;
+        }});
+        contenders.push_back({"variant", [&](size_t n) {
+            size_t sum = 0;
+            for (size_t pass = 0; pass < n; pass++) {
+                for (std::vector<std::variant<Employee, CEO> >::const_iterator it = variants.begin(); it != variants.end(); ++it) {
+                    sum += std::visit([](const auto &employee) { return employee.bonus(); }, *it);
+                }
+            }
+            return sum;
+        }});
+        contenders.push_back({"crtp", [&](size_t n) {
+            size_t sum = 0;
+            for (size_t pass = 0; pass < n; pass++) {
+                for (size_t i = 0, e = 0, c = 0; i < OBJECTS; i++) {
+                    sum += is_ceo[i] ? crtp_ceos[c++].bonus() : crtp_employees[e++].bonus();
+                }
+            }
+            return sum;
+        }});
+        contenders.push_back({"sorted", [&](size_t n) {
+            size_t sum = 0;
+            for (size_t pass = 0; pass < n; pass++) {
+                for (std::vector<EmployeeCRTP>::const_iterator it = crtp_employees.begin(); it != crtp_employees.end(); ++it) {
+                    sum += it->bonus();
+                }
+                for (std::vector<CEOCRTP>::const_iterator it = crtp_ceos.begin(); it != crtp_ceos.end(); ++it) {
+                    sum += it->bonus();
+                }
+            }
+            return sum;
+        }});
+        compare_dispatch(MIXES[m], contenders, OBJECTS, passes);
+    }
+    branch_miss_counter_t counter;
+    if (!counter.available()) {
+        printf("(no branch miss counter: perf_event_open() failed, e.g. in a VM without a PMU)\n");
+    }
+}
+
+#endif // MEMLENS_DISPATCH_HPP
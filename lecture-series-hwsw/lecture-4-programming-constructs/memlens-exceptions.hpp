@@ -0,0 +1,252 @@
+/// @file
+/// @brief What exceptions cost, compared with returning errors.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// `demo-try-catch` shows where an exception object lives; here we time a chain of
+/// calls, `depth` frames deep, whose innermost call fails (or doesn't), with the
+/// failure reported three ways:
+/// - exceptions: the innermost call throws, and the outermost catches
+/// - expected: every call returns a value-or-error (a stand-in for C++23's
+///   `std::expected`), and each caller checks it and passes errors up
+/// - error code: every call returns an error code, with the value in an out parameter
+///
+/// Exceptions are "zero cost" in the sense that nothing is checked on the way back
+/// when nothing is thrown: the cost of a throw is all paid when it happens, by
+/// looking up each frame's unwind tables and running its clean ups (destructors),
+/// which is why frames with and without destructors are timed separately.
+/// (Expect all three to slow down per frame past a depth of ~16-32, whatever the
+/// error handling: that's where the CPU's return address predictor runs out.)
+///
+/// Each case is timed many times, two ways. In batches of calls long enough (a few
+/// us) for the clock not to matter, whose median per call is what to expect: a batch
+/// averages its calls, so it hides their tail. And one call at a time, whose 99th
+/// percentile is what a slow call costs, less what reading the clock costs (which
+/// makes it coarse, to a few ns, for the cheap paths).
+
+#ifndef MEMLENS_EXCEPTIONS_HPP
+#define MEMLENS_EXCEPTIONS_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <type_traits>
+#include <vector>
+#include "memlens.hpp"
+#include "memlens-allocs.hpp"
+#include "memlens-bench.hpp"
+
+/// @brief incremented by every `frame_guard_t` that goes out of scope
+volatile int FRAME_GUARDS_RUN = 0;
+
+/// @brief set to fail the innermost call; read through a volatile, so the compiler
+/// can't specialize the call chains for either outcome
+volatile bool FAIL_INNERMOST = false;
+
+/// @brief Something with a destructor that has to run when its frame is left.
+class frame_guard_t {
+public:
+    ~frame_guard_t() {
+        FRAME_GUARDS_RUN = FRAME_GUARDS_RUN + 1;
+    }
+};
+
+/// @brief Nothing to clean up.
+typedef struct {} no_guard_t;
+
+/// @brief The exception thrown by `parse_throwing()`.
+class parse_error_t : public std::exception {
+public:
+    explicit parse_error_t(int code) :code(code) {}
+
+    const char* what() const noexcept override {
+        return "parse error";
+    }
+
+    int code;
+};
+
+/// @brief A value, or the error that kept us from getting one.
+typedef struct {
+    int value;
+    int error;  // 0 if there is a value
+} parse_result_t;
+
+/// @return the depth of the chain, or throw if the innermost call fails
+template <bool GUARDED>
+MEMLENS_NOINLINE int parse_throwing(int depth, bool fail) {
+    typename std::conditional<GUARDED, frame_guard_t, no_guard_t>::type guard;
+    (void)guard;
+    if (depth == 0) {
+        if (fail) {
+            throw parse_error_t(EINVAL);
+        }
+        return 1;
+    }
+    return parse_throwing<GUARDED>(depth - 1, fail) + 1;
+}
+
+/// @return the depth of the chain, or the error of the innermost call
+template <bool GUARDED>
+MEMLENS_NOINLINE parse_result_t parse_expected(int depth, bool fail) {
+    typename std::conditional<GUARDED, frame_guard_t, no_guard_t>::type guard;
+    (void)guard;
+    if (depth == 0) {
+        const parse_result_t result = {fail ? 0 : 1, fail ? EINVAL : 0};
+        return result;
+    }
+    parse_result_t result = parse_expected<GUARDED>(depth - 1, fail);
+    if (result.error != 0) {
+        return result;
+    }
+    result.value++;
+    return result;
+}
+
+/// @return 0 with the depth of the chain in `value`, or the error of the innermost call
+template <bool GUARDED>
+MEMLENS_NOINLINE int parse_error_code(int depth, bool fail, int &value) {
+    typename std::conditional<GUARDED, frame_guard_t, no_guard_t>::type guard;
+    (void)guard;
+    if (depth == 0) {
+        if (fail) {
+            return EINVAL;
+        }
+        value = 1;
+        return 0;
+    }
+    const int error = parse_error_code<GUARDED>(depth - 1, fail, value);
+    if (error != 0) {
+        return error;
+    }
+    value++;
+    return 0;
+}
+
+/// @brief Median & 99th percentile of a set of timings.
+typedef struct {
+    double median_ns;   // of the mean of batches of calls
+    double p99_ns;      // of single calls
+} call_timing_t;
+
+/// @return the median time it takes to read the clock, which timing a single call
+/// also measures
+double clock_read_ns() {
+    static double median = -1;
+    if (median < 0) {
+        std::vector<uint64_t> reads(1001);
+        for (size_t i = 0; i < reads.size(); i++) {
+            const uint64_t start = now_ns();
+            reads[i] = now_ns() - start;
+        }
+        std::sort(reads.begin(), reads.end());
+        median = (double)reads[reads.size() / 2];
+    }
+    return median;
+}
+
+/// @brief Time `call()` (which returns something depending on its work) `samples`
+/// times, each a batch of calls taking a few microseconds, then `samples` times, a
+/// single call at a time.
+/// @return the median time per call of the batches, and the p99 of the single calls
+/// (less the time it takes to read the clock)
+template <typename F>
+call_timing_t time_call(F call, size_t samples) {
+    // size batches from a rough first measurement, after a warm up
+    size_t checksum = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < 64; i++) {
+        checksum += call();
+    }
+    const double rough_ns = (double)(now_ns() - start) / 64;
+    const size_t batch = rough_ns * 1024 < 5000 ? 1024 : rough_ns > 5000 ? 1 : (size_t)(5000 / rough_ns);
+
+    std::vector<double> per_call(samples);
+    for (size_t s = 0; s < samples; s++) {
+        start = now_ns();
+        for (size_t i = 0; i < batch; i++) {
+            checksum += call();
+        }
+        per_call[s] = (double)(now_ns() - start) / batch;
+    }
+    std::sort(per_call.begin(), per_call.end());
+
+    std::vector<double> single(samples);
+    for (size_t s = 0; s < samples; s++) {
+        start = now_ns();
+        checksum += call();
+        single[s] = (double)(now_ns() - start) - clock_read_ns();
+    }
+    std::sort(single.begin(), single.end());
+    const double p99 = single[samples * 99 / 100];
+    call_timing_t timing = {per_call[samples / 2], p99 > 0 ? p99 : 0};
+    if (checksum == 0) {
+        timing.median_ns = -1; // never, but the compiler can't know that
+    }
+    return timing;
+}
+
+/// @brief Time the three ways of failing for one chain, `depth` frames deep.
+template <bool GUARDED>
+void time_error_paths(int depth, bool fail, size_t samples, call_timing_t timings[3]) {
+    FAIL_INNERMOST = fail;
+    timings[0] = time_call([depth]() {
+        try {
+            return parse_throwing<GUARDED>(depth, FAIL_INNERMOST);
+        } catch (const parse_error_t &err) {
+            return -err.code;
+        }
+    }, samples);
+    timings[1] = time_call([depth]() {
+        const parse_result_t result = parse_expected<GUARDED>(depth, FAIL_INNERMOST);
+        return result.error != 0 ? -result.error : result.value;
+    }, samples);
+    timings[2] = time_call([depth]() {
+        int value = 0;
+        const int error = parse_error_code<GUARDED>(depth, FAIL_INNERMOST, value);
+        return error != 0 ? -error : value;
+    }, samples);
+}
+
+/// @brief `memlens bench-exceptions`: time exceptions against error returns, for
+/// chains of different depths, with & without destructors, that fail or don't.
+void bench_exceptions(size_t samples) {
+    const int DEPTHS[] = {1, 4, 16, 64};
+    const size_t DEPTH_COUNT = sizeof(DEPTHS) / sizeof(DEPTHS[0]);
+    if (samples < 100) {
+        samples = 100;
+    }
+    printf("ns per call: median of %zu batches / p99 of %zu single calls (less %.0f ns to read the clock)\n",
+        samples, samples, clock_read_ns());
+    printf("%5s %5s %6s %17s %17s %17s\n", "depth", "dtors", "result", "exceptions", "expected", "error code");
+    // [depth][guarded][failed][way]
+    std::vector<call_timing_t> results(DEPTH_COUNT * 2 * 2 * 3);
+    for (size_t d = 0; d < DEPTH_COUNT; d++) {
+        for (int guarded = 0; guarded < 2; guarded++) {
+            for (int fail = 0; fail < 2; fail++) {
+                call_timing_t *timings = &results[((d * 2 + guarded) * 2 + fail) * 3];
+                if (guarded) {
+                    time_error_paths<true>(DEPTHS[d], fail, samples, timings);
+                } else {
+                    time_error_paths<false>(DEPTHS[d], fail, samples, timings);
+                }
+                printf("%5d %5s %6s", DEPTHS[d], guarded ? "yes" : "no", fail ? "error" : "ok");
+                for (int way = 0; way < 3; way++) {
+                    printf(" %8.1f / %6.1f", timings[way].median_ns, timings[way].p99_ns);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    // the summary: the deepest chain, with destructors
+    const call_timing_t *ok = &results[(((DEPTH_COUNT - 1) * 2 + 1) * 2 + 0) * 3];
+    const call_timing_t *failed = &results[(((DEPTH_COUNT - 1) * 2 + 1) * 2 + 1) * 3];
+    const int depth = DEPTHS[DEPTH_COUNT - 1];
+    printf("\nwhen nothing is thrown (depth %d, with destructors): exceptions %.1f ns, error codes %.1f ns (%+.0f%%)\n",
+        depth, ok[0].median_ns, ok[2].median_ns, (ok[0].median_ns - ok[2].median_ns) * 100 / ok[2].median_ns);
+    printf("when the innermost call fails: a throw costs %.1f ns, %.0fx an error code return (%.1f ns), %.0f ns per frame unwound\n",
+        failed[0].median_ns, failed[0].median_ns / failed[2].median_ns, failed[2].median_ns,
+        (failed[0].median_ns - results[((0 * 2 + 1) * 2 + 1) * 3].median_ns) / (depth - DEPTHS[0]));
+}
+
+#endif // MEMLENS_EXCEPTIONS_HPP
@@ -0,0 +1,393 @@
+/// @file
+/// @brief What the allocator knows about the heap.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// The kernel only names the region the main glibc arena grows via `brk()` as
+/// `[heap]`. Every other arena (glibc creates them for threads contending on
+/// malloc), every large allocation served directly by `mmap()`, and everything
+/// jemalloc manages shows up as an anonymous region. Here we ask the allocator for
+/// its view (`malloc_info()` for glibc, `mallctl()` for jemalloc), report how much
+/// of each arena is in use, free, or free but fragmented (`memlens heap`), and tie
+/// anonymous regions back to the arena they belong to, which `memlens layout`
+/// shows too.
+
+#ifndef MEMLENS_HEAP_HPP
+#define MEMLENS_HEAP_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memlens.hpp"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <dlfcn.h>
+#endif
+#ifdef __GLIBC__
+#include <gnu/libc-version.h>
+#include <malloc.h>
+#endif
+
+/// @brief Usage of one allocator arena.
+typedef struct {
+    int number;
+    size_t system_size;         // obtained from the OS
+    size_t max_system_size;
+    size_t free_size;           // free chunks, including the top chunk
+    size_t fragmented_size;     // free chunks other than the top chunk
+    size_t regions;             // regions of the layout found to belong to this arena
+} heap_arena_t;
+
+#ifdef __GLIBC__
+/// @return the value of attribute `name` in `line` (e.g. size in `<total size="1"/>`),
+/// or 0 if it isn't there
+uint64_t xml_attribute(const char *line, const char *name) {
+    char key[32];
+    snprintf(key, sizeof(key), " %s=\"", name);
+    const char *found = strstr(line, key);
+    return found != nullptr ? strtoull(found + strlen(key), nullptr, 10) : 0;
+}
+
+/// @brief Parse the output of glibc's `malloc_info()` into `arenas`.
+/// @param mmapped set to the number & size of chunks allocated directly via mmap()
+/// @return false if malloc_info() failed
+bool load_glibc_arenas(std::vector<heap_arena_t> &arenas, size_t &mmapped_count, size_t &mmapped_size) {
+    char *xml = nullptr;
+    size_t xml_len = 0;
+    FILE *out = open_memstream(&xml, &xml_len);
+    if (out == nullptr || malloc_info(0, out) != 0) {
+        if (out != nullptr) {
+            fclose(out);
+        }
+        free(xml);
+        return false;
+    }
+    fclose(out);
+
+    // malloc_info() prints one element per line; "rest" includes the top chunk,
+    // while the sizes listed per bin don't
+    heap_arena_t *arena = nullptr;
+    size_t fast = 0;
+    size_t rest = 0;
+    size_t in_bins = 0;
+    arenas.clear();
+    mmapped_count = mmapped_size = 0;
+    for (char *line = strtok(xml, "\n"); line != nullptr; line = strtok(nullptr, "\n")) {
+        if (strstr(line, "<heap ") != nullptr) {
+            arenas.push_back(heap_arena_t());
+            arena = &arenas.back();
+            arena->number = (int)xml_attribute(line, "nr");
+            fast = rest = in_bins = 0;
+        } else if (strstr(line, "</heap>") != nullptr && arena != nullptr) {
+            arena->free_size = fast + rest;
+            arena->fragmented_size = in_bins;
+            arena = nullptr;
+        } else if (arena != nullptr && (strstr(line, "<size ") != nullptr || strstr(line, "<unsorted ") != nullptr)) {
+            in_bins += xml_attribute(line, "total");
+        } else if (arena != nullptr && strstr(line, "type=\"fast\"") != nullptr) {
+            fast = xml_attribute(line, "size");
+        } else if (arena != nullptr && strstr(line, "type=\"rest\"") != nullptr) {
+            rest = xml_attribute(line, "size");
+        } else if (arena != nullptr && strstr(line, "<system type=\"current\"") != nullptr) {
+            arena->system_size = xml_attribute(line, "size");
+        } else if (arena != nullptr && strstr(line, "<system type=\"max\"") != nullptr) {
+            arena->max_system_size = xml_attribute(line, "size");
+        } else if (arena == nullptr && strstr(line, "type=\"mmap\"") != nullptr) {
+            mmapped_count = xml_attribute(line, "count");
+            mmapped_size = xml_attribute(line, "size");
+        }
+    }
+    free(xml);
+    return true;
+}
+
+/// @brief The header glibc puts at the start of every heap of a non-main arena.
+typedef struct {
+    void *arena;        // the arena's malloc_state
+    void *prev;         // the arena's previous heap
+    size_t size;        // bytes of this heap in use (read/write)
+    size_t mprotect_size;
+} glibc_heap_info_t;
+
+/// @brief glibc aligns non-main arena heaps to their maximum size (HEAP_MAX_SIZE)
+const uintptr_t GLIBC_HEAP_MAX_SIZE = 2 * 4 * 1024 * 1024 * sizeof(long);
+
+/// @return true if `region` (of this process) is made up of chunks that glibc
+/// allocated directly with mmap()
+/// @details Only unlabelled, page aligned, read/write anonymous regions are looked
+/// at: a chunk header is only a guess, and a stack or an arena heap can start with
+/// words that pass for one.
+bool is_glibc_mmapped_chunks(const memory_region_t &region) {
+    const size_t IS_MMAPPED = 2;
+    if (region.region_type != "-" || !region.region_detail.empty()
+        || (region.permissions & (PERM_READ | PERM_WRIT)) != (PERM_READ | PERM_WRIT)
+        || reinterpret_cast<uintptr_t>(region.start_address) % getpagesize() != 0) {
+        return false;
+    }
+    const uint8_t *p = (const uint8_t*)region.start_address;
+    const uint8_t *end = p + region.size;
+    // neighbouring mmap()s can be merged into a single region, so walk them all
+    while (p < end) {
+        const size_t header = ((const size_t*)p)[1];
+        const size_t size = header & ~(size_t)7;
+        if (!(header & IS_MMAPPED) || size == 0 || size > (size_t)(end - p) || size % getpagesize() != 0) {
+            return false;
+        }
+        p += size;
+    }
+    return true;
+}
+
+/// @return the numbers `malloc_info()` gives the non-main arenas whose malloc_state
+/// is at each of `ids` (-1 for all of them, if they can't be told apart)
+/// @details malloc_info() numbers arenas along the list linked by each malloc_state's
+/// `next`: the main arena is 0, followed by the newest arena, down to the oldest,
+/// whose `next` is the main arena again (in libc's data). Where `next` is within
+/// malloc_state differs between glibc versions, so we look for the first word that
+/// links all of `ids` into such a chain.
+/// @param readable how many bytes from each of `ids` can be read
+std::vector<int> glibc_arena_numbers(const std::vector<const void*> &ids, size_t readable) {
+    std::vector<int> numbers(ids.size(), -1);
+    if (ids.empty()) {
+        return numbers;
+    }
+    if (ids.size() == 1) {
+        numbers[0] = 1;
+        return numbers;
+    }
+    std::vector<size_t> next(ids.size());   // position in `ids` each arena links to, ids.size() for the main arena
+    std::vector<bool> linked_to(ids.size());
+    const size_t MAX_STATE_SIZE = 4096; // malloc_state is a little over 2K on 64 bit
+    readable = readable < MAX_STATE_SIZE ? readable : MAX_STATE_SIZE;
+    for (size_t offset = 0; offset + sizeof(void*) <= readable; offset += sizeof(void*)) {
+        const void *main_arena = nullptr;
+        bool chained = true;
+        linked_to.assign(ids.size(), false);
+        for (size_t i = 0; i < ids.size() && chained; i++) {
+            const void *link = *(const void* const*)((const uint8_t*)ids[i] + offset);
+            next[i] = std::find(ids.begin(), ids.end(), link) - ids.begin();
+            if (next[i] < ids.size()) {
+                chained = !linked_to[next[i]] && next[i] != i;
+                linked_to[next[i]] = true;
+            } else {
+                const memory_region_t *region = MEMORY_INDEX.find(link);
+                chained = main_arena == nullptr && region != nullptr && region->region_detail.find("libc") != std::string::npos;
+                main_arena = link;
+            }
+        }
+        if (!chained || main_arena == nullptr) {
+            continue;
+        }
+        // the newest arena is the one no other arena links to
+        size_t arena = std::find(linked_to.begin(), linked_to.end(), false) - linked_to.begin();
+        int number = 1;
+        for (; arena < ids.size() && numbers[arena] < 0; arena = next[arena]) {
+            numbers[arena] = number++;
+        }
+        if (number == (int)ids.size() + 1) {
+            return numbers;
+        }
+        numbers.assign(ids.size(), -1);
+    }
+    return numbers;
+}
+#endif // __GLIBC__
+
+#if defined(__linux__) || defined(__APPLE__)
+typedef int (*mallctl_t)(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
+/// @return jemalloc's `mallctl()`, if jemalloc is the allocator in use
+mallctl_t find_mallctl() {
+    return (mallctl_t)dlsym(RTLD_DEFAULT, "mallctl");
+}
+
+/// @return a jemalloc statistic, or 0 if it can't be read
+template <typename T>
+T mallctl_value(mallctl_t mallctl, const std::string &name) {
+    T value = 0;
+    size_t len = sizeof(value);
+    return mallctl(name.c_str(), &value, &len, nullptr, 0) == 0 ? value : 0;
+}
+
+/// @brief Print per-arena statistics of jemalloc.
+void print_jemalloc_arenas(mallctl_t mallctl) {
+    // statistics are a snapshot, refreshed by writing to "epoch"
+    uint64_t epoch = 1;
+    size_t len = sizeof(epoch);
+    mallctl("epoch", &epoch, &len, &epoch, len);
+
+    const size_t page = mallctl_value<size_t>(mallctl, "arenas.page");
+    const unsigned narenas = mallctl_value<unsigned>(mallctl, "arenas.narenas");
+    printf("allocator: jemalloc, %u arenas, %s allocated, %s active, %s resident, %s mapped, %s retained\n", narenas,
+        size_str(mallctl_value<size_t>(mallctl, "stats.allocated")).c_str(),
+        size_str(mallctl_value<size_t>(mallctl, "stats.active")).c_str(),
+        size_str(mallctl_value<size_t>(mallctl, "stats.resident")).c_str(),
+        size_str(mallctl_value<size_t>(mallctl, "stats.mapped")).c_str(),
+        size_str(mallctl_value<size_t>(mallctl, "stats.retained")).c_str());
+    printf("%6s %9s %9s %9s %11s %9s\n", "arena", "mapped", "in use", "free", "fragmented", "dirty");
+    for (unsigned i = 0; i < narenas; i++) {
+        const std::string prefix = "stats.arenas." + std::to_string(i) + ".";
+        const size_t mapped = mallctl_value<size_t>(mallctl, prefix + "mapped");
+        if (mapped == 0) {
+            continue; // never used
+        }
+        const size_t allocated = mallctl_value<size_t>(mallctl, prefix + "small.allocated") + mallctl_value<size_t>(mallctl, prefix + "large.allocated");
+        const size_t active = mallctl_value<size_t>(mallctl, prefix + "pactive") * page;
+        const size_t dirty = mallctl_value<size_t>(mallctl, prefix + "pdirty") * page;
+        // free space within active pages can only be used for allocations of the
+        // right size class: that's jemalloc's fragmentation
+        printf("%6u %9s %9s %9s %11s %9s\n", i, size_str(mapped).c_str(), size_str(allocated).c_str(),
+            size_str(mapped - allocated).c_str(), size_str(active > allocated ? active - allocated : 0).c_str(), size_str(dirty).c_str());
+    }
+}
+#endif
+
+/// @brief Make the allocator do some work on a few threads, so that `memlens heap`
+/// has something to show: every thread allocates & frees every other block
+/// (fragmenting its arena), and makes one large allocation.
+/// @return the blocks still allocated (which are intentionally never freed)
+std::vector<void*> heap_demo_workload(size_t threads) {
+    std::vector<std::vector<void*> > kept(threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.push_back(std::thread([t, &kept]() {
+            std::vector<void*> blocks;
+            for (size_t i = 0; i < 20000; i++) {
+                blocks.push_back(malloc(32 + (i * 7 + t * 13) % 480));
+            }
+            for (size_t i = 0; i < blocks.size(); i++) {
+                if (i % 2 == 0) {
+                    free(blocks[i]);
+                } else {
+                    kept[t].push_back(blocks[i]);
+                }
+            }
+            kept[t].push_back(malloc(1024 * 1024));
+        }));
+    }
+    std::vector<void*> all;
+    for (size_t t = 0; t < threads; t++) {
+        workers[t].join();
+        all.insert(all.end(), kept[t].begin(), kept[t].end());
+    }
+    return all;
+}
+
+/// @brief Name the regions of `regions` (the layout of this process) that belong to
+/// the allocator: the heaps of glibc's non-main arenas as `arena` (with the arena's
+/// number as detail, as `malloc_info()` numbers them), and the chunks glibc mmap()ed
+/// directly as `mmapped`.
+/// @details Each heap of a non-main arena is aligned to GLIBC_HEAP_MAX_SIZE and
+/// starts with a header pointing at its arena's malloc_state, which lives in the
+/// arena's first heap, just after that header. Regions that are already labelled
+/// (e.g. thread stacks) are left alone.
+void label_heap_regions(std::vector<memory_region_t> &regions) {
+#ifdef __GLIBC__
+    static const interned_str_t ARENA("arena");
+    static const interned_str_t MMAPPED("mmapped");
+    std::vector<size_t> heaps;          // positions in `regions` of arena heaps
+    std::vector<const void*> ids;       // malloc_state of each arena, from its first heap
+    size_t readable = (size_t)-1;       // bytes that can be read from every malloc_state
+    for (size_t i = 0; i < regions.size(); i++) {
+        const memory_region_t &region = regions[i];
+        if (region.region_type != "-" || !region.region_detail.empty() || (region.permissions & (PERM_READ | PERM_WRIT)) != (PERM_READ | PERM_WRIT)) {
+            continue;
+        }
+        const uintptr_t start = reinterpret_cast<uintptr_t>(region.start_address);
+        const glibc_heap_info_t *info = (const glibc_heap_info_t*)region.start_address;
+        if (start % GLIBC_HEAP_MAX_SIZE != 0 || info->size == 0 || info->size > region.size) {
+            continue;
+        }
+        heaps.push_back(i);
+        const uintptr_t arena = reinterpret_cast<uintptr_t>(info->arena);
+        if (arena > start && arena < start + region.size) {
+            ids.push_back(info->arena);
+            readable = std::min(readable, (size_t)(start + region.size - arena));
+        }
+    }
+    const std::vector<int> numbers = glibc_arena_numbers(ids, readable);
+    for (size_t h = 0; h < heaps.size(); h++) {
+        memory_region_t &region = regions[heaps[h]];
+        const size_t i = std::find(ids.begin(), ids.end(), ((const glibc_heap_info_t*)region.start_address)->arena) - ids.begin();
+        region.region_type = ARENA;
+        region.region_detail = interned_str_t(i < ids.size() && numbers[i] >= 0 ? std::to_string(numbers[i]) : "?");
+    }
+    for (std::vector<memory_region_t>::iterator it = regions.begin(); it != regions.end(); ++it) {
+        if (is_glibc_mmapped_chunks(*it)) {
+            it->region_type = MMAPPED;
+        }
+    }
+#else
+    (void)regions;
+#endif
+}
+
+/// @brief Print the allocator's view of the heap of this process.
+void print_heap_info() {
+    update_memory_layout();
+#if defined(__linux__) || defined(__APPLE__)
+    const mallctl_t mallctl = find_mallctl();
+    if (mallctl != nullptr) {
+        print_jemalloc_arenas(mallctl);
+        return;
+    }
+#endif
+#ifdef __GLIBC__
+    std::vector<heap_arena_t> arenas;
+    size_t mmapped_count;
+    size_t mmapped_size;
+    if (!load_glibc_arenas(arenas, mmapped_count, mmapped_size)) {
+        std::cerr << "malloc_info() failed" << std::endl;
+        return;
+    }
+
+    // a labelled copy: MEMORY_REGIONS keeps the names that maps gives
+    std::vector<memory_region_t> regions = MEMORY_REGIONS;
+    label_thread_stacks(0, regions);
+    label_heap_regions(regions);
+    size_t mmapped_regions = 0;
+    for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+        int number = -1;
+        if (it->region_type == "heap") {
+            number = 0;
+        } else if (it->region_type == "arena" && it->region_detail != "?") {
+            number = std::stoi(it->region_detail.str());
+        }
+        mmapped_regions += it->region_type == "mmapped";
+        for (std::vector<heap_arena_t>::iterator arena = arenas.begin(); arena != arenas.end(); ++arena) {
+            arena->regions += arena->number == number;
+        }
+    }
+
+    printf("allocator: glibc %s, %zu arenas\n", gnu_get_libc_version(), arenas.size());
+    printf("%6s %9s %9s %9s %9s %11s %8s\n", "arena", "system", "max", "in use", "free", "fragmented", "regions");
+    heap_arena_t total = heap_arena_t();
+    for (std::vector<heap_arena_t>::const_iterator it = arenas.begin(); it != arenas.end(); ++it) {
+        printf("%6d %9s %9s %9s %9s %11s %8zu\n", it->number, size_str(it->system_size).c_str(), size_str(it->max_system_size).c_str(),
+            size_str(it->system_size - it->free_size).c_str(), size_str(it->free_size).c_str(), size_str(it->fragmented_size).c_str(), it->regions);
+        total.system_size += it->system_size;
+        total.max_system_size += it->max_system_size;
+        total.free_size += it->free_size;
+        total.fragmented_size += it->fragmented_size;
+        total.regions += it->regions;
+    }
+    printf("%6s %9s %9s %9s %9s %11s %8zu\n", "total", size_str(total.system_size).c_str(), size_str(total.max_system_size).c_str(),
+        size_str(total.system_size - total.free_size).c_str(), size_str(total.free_size).c_str(), size_str(total.fragmented_size).c_str(), total.regions);
+    printf("mmapped chunks: %zu (%s), in %zu regions\n", mmapped_count, size_str(mmapped_size).c_str(), mmapped_regions);
+
+    std::cout << std::endl;
+    print_memory_layout(true, std::vector<memory_region_t>());
+    for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+        if (it->region_type == "heap" || it->region_type == "arena" || it->region_type == "mmapped") {
+            print_region(*it, true);
+        }
+    }
+#elif defined(__linux__) || defined(__APPLE__)
+    std::cerr << "heap needs glibc or jemalloc" << std::endl;
+#else
+    std::cerr << "heap is not supported on this platform" << std::endl;
+#endif
+}
+
+#endif // MEMLENS_HEAP_HPP
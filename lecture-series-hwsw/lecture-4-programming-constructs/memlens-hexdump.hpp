@@ -0,0 +1,340 @@
+/// @file
+/// @brief Fast hexdump formatting.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// Formatting a byte at a time through `std::cout` costs far more than reading the
+/// memory in the first place. Here whole 16 byte rows are converted to hex and
+/// printable ASCII at once: with AVX2 (two rows at a time), SSE2, or a table driven
+/// scalar loop, picked at runtime. The output is byte for byte what the original
+/// `std::cout` based formatter printed:
+///
+///     <row address in hex>  xx xx .. xx   |ascii...........|
+
+#ifndef MEMLENS_HEXDUMP_HPP
+#define MEMLENS_HEXDUMP_HPP
+
+#include <cstring>
+#include <stdint.h>
+#include "memlens-output.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MEMLENS_HEXDUMP_X86 1
+#include <immintrin.h>
+#endif
+
+/// @brief Which implementation formats full rows.
+enum hexdump_kernel_t {
+    HEXDUMP_SCALAR,
+    HEXDUMP_SSE2,
+    HEXDUMP_AVX2,
+    HEXDUMP_BEST,   // the fastest one this CPU supports
+};
+
+const char* const HEXDUMP_KERNEL_NAMES[] = {"scalar", "sse2", "avx2", "best"};
+
+/// @brief characters of a row after its address, besides the 48 hex & 16 ascii ones
+const size_t HEXDUMP_ROW_TAIL = 2 + 48 + 3 + 16 + 2;
+
+/// @brief Lookup tables for the scalar formatter.
+struct hexdump_tables_t {
+    char hex[256][2];
+    char ascii[256];
+
+    hexdump_tables_t() {
+        static const char HEX[] = "0123456789abcdef";
+        for (int c = 0; c < 256; c++) {
+            hex[c][0] = HEX[c >> 4];
+            hex[c][1] = HEX[c & 0xf];
+            ascii[c] = c >= 32 && c < 127 ? (char)c : '.';
+        }
+    }
+};
+
+const hexdump_tables_t HEXDUMP_TABLES;
+
+/// @brief Write `address` in hex (without leading zeroes) at `out`.
+/// @return number of characters written
+inline size_t hexdump_address(uintptr_t address, char *out) {
+    size_t digits = 1;
+    while (digits < sizeof(address) * 2 && (address >> (4 * digits)) != 0) {
+        digits++;
+    }
+    // two digits at a time, from the right
+    size_t i = digits;
+    for (; i >= 2; i -= 2, address >>= 8) {
+        memcpy(out + i - 2, HEXDUMP_TABLES.hex[address & 0xff], 2);
+    }
+    if (i == 1) {
+        out[0] = HEXDUMP_TABLES.hex[address & 0xf][1];
+    }
+    return digits;
+}
+
+/// @brief The hex text of consecutive row addresses, incremented in place rather
+/// than formatted from scratch for every row.
+struct hexdump_address_t {
+    char text[16];
+    size_t len;
+
+    explicit hexdump_address_t(uintptr_t address) {
+        len = hexdump_address(address, text);
+    }
+
+    /// @brief Move on to the next row, 16 bytes on.
+    void next() {
+        // the last digit stays 0, as rows are 16 byte aligned
+        for (size_t i = len - 1; i-- > 0;) {
+            char &c = text[i];
+            if (c == '9') {
+                c = 'a';
+                return;
+            } else if (c != 'f') {
+                c++;
+                return;
+            }
+            c = '0';
+        }
+        if (len < sizeof(text)) {
+            memmove(text + 1, text, len);
+            text[0] = '1';
+            len++;
+        }
+    }
+
+    /// @brief Copy the address to `out`, which must have room for 16 characters.
+    /// @return number of characters of the address
+    size_t write(char *out) const {
+        memcpy(out, text, sizeof(text));
+        return len;
+    }
+};
+
+/// @brief Format a row, of which only bytes [from, to) are to be shown.
+/// @param bytes the contents of the row (only [from, to) is read)
+/// @return number of characters written
+inline size_t hexdump_row_scalar(const uint8_t *bytes, const hexdump_address_t &address, size_t from, size_t to, char *out) {
+    char *p = out + address.write(out);
+    *p++ = ' ';
+    *p++ = ' ';
+    for (size_t i = 0; i < 16; i++, p += 3) {
+        if (i >= from && i < to) {
+            p[0] = HEXDUMP_TABLES.hex[bytes[i]][0];
+            p[1] = HEXDUMP_TABLES.hex[bytes[i]][1];
+        } else {
+            p[0] = p[1] = ' ';
+        }
+        p[2] = ' ';
+    }
+    memcpy(p, "  |", 3);
+    p += 3;
+    for (size_t i = 0; i < 16; i++) {
+        *p++ = i >= from && i < to ? HEXDUMP_TABLES.ascii[bytes[i]] : ' ';
+    }
+    *p++ = '|';
+    *p++ = '\n';
+    return p - out;
+}
+
+/// @brief Format `rows` full rows with the scalar formatter.
+inline void hexdump_rows_scalar(const uint8_t *bytes, hexdump_address_t &address, size_t rows, output_buffer_t &out) {
+    for (size_t row = 0; row < rows; row++, address.next()) {
+        char *p = out.reserve(16 + HEXDUMP_ROW_TAIL);
+        out.commit(hexdump_row_scalar(bytes + row * 16, address, 0, 16, p));
+    }
+}
+
+#ifdef MEMLENS_HEXDUMP_X86
+/// @brief Format `rows` full rows with SSE2: hex digits and ASCII are computed 16
+/// bytes at a time, the hex pairs are then spread out to make room for the spaces.
+__attribute__((target("sse2")))
+inline void hexdump_rows_sse2(const uint8_t *bytes, hexdump_address_t &address, size_t rows, output_buffer_t &out) {
+    const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero_char = _mm_set1_epi8('0');
+    const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+    const __m128i space = _mm_set1_epi8(' ' - 1);
+    const __m128i del = _mm_set1_epi8(127);
+    const __m128i dot = _mm_set1_epi8('.');
+    alignas(16) char pairs[32];
+    for (size_t row = 0; row < rows; row++, address.next()) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(bytes + row * 16));
+        const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble_mask);
+        const __m128i lo = _mm_and_si128(v, nibble_mask);
+        // nibble n becomes '0' + n, plus the gap to 'a' if n > 9
+        const __m128i hi_hex = _mm_add_epi8(_mm_add_epi8(hi, zero_char), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letter_gap));
+        const __m128i lo_hex = _mm_add_epi8(_mm_add_epi8(lo, zero_char), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letter_gap));
+        _mm_store_si128((__m128i*)pairs, _mm_unpacklo_epi8(hi_hex, lo_hex));
+        _mm_store_si128((__m128i*)(pairs + 16), _mm_unpackhi_epi8(hi_hex, lo_hex));
+        // printable is [32, 127), and as signed bytes, 128..255 are negative
+        const __m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, space));
+        const __m128i ascii = _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, dot));
+
+        char *start = out.reserve(16 + HEXDUMP_ROW_TAIL);
+        char *p = start + address.write(start);
+        memset(p, ' ', 2 + 48 + 2);
+        for (size_t i = 0; i < 16; i++) {
+            memcpy(p + 2 + 3 * i, pairs + 2 * i, 2);
+        }
+        p += 2 + 48 + 2;
+        *p++ = '|';
+        _mm_storeu_si128((__m128i*)p, ascii);
+        p += 16;
+        *p++ = '|';
+        *p++ = '\n';
+        out.commit(p - start);
+    }
+}
+
+/// @brief `vpshufb` masks that spread 16 hex pairs (in two registers) into the 48
+/// characters of "xx xx .. ", and the spaces to OR in. -1 selects a zero byte.
+struct hexdump_avx2_masks_t {
+    alignas(32) int8_t first[3][32];    // picks from the pairs of bytes 0-7
+    alignas(32) int8_t second[3][32];   // picks from the pairs of bytes 8-15
+    alignas(32) int8_t spaces[3][32];
+
+    hexdump_avx2_masks_t() {
+        for (int chunk = 0; chunk < 3; chunk++) {
+            for (int k = 0; k < 32; k++) {
+                const int pos = chunk * 16 + k % 16; // both lanes do the same
+                const int byte = pos / 3;
+                const bool is_space = pos % 3 == 2;
+                first[chunk][k] = !is_space && byte < 8 ? 2 * byte + pos % 3 : -1;
+                second[chunk][k] = !is_space && byte >= 8 ? 2 * (byte - 8) + pos % 3 : -1;
+                spaces[chunk][k] = is_space ? ' ' : 0;
+            }
+        }
+    }
+};
+
+/// @brief Format `rows` full rows with AVX2: two rows at a time, one per 128 bit
+/// lane, with the hex digits spread out by byte shuffles.
+__attribute__((target("avx2")))
+inline void hexdump_rows_avx2(const uint8_t *bytes, hexdump_address_t &address, size_t rows, output_buffer_t &out) {
+    static const hexdump_avx2_masks_t MASKS;
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+    const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+                                            '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i space = _mm256_set1_epi8(' ' - 1);
+    const __m256i del = _mm256_set1_epi8(127);
+    const __m256i dot = _mm256_set1_epi8('.');
+    __m256i first[3], second[3], spaces[3];
+    for (int chunk = 0; chunk < 3; chunk++) {
+        first[chunk] = _mm256_load_si256((const __m256i*)MASKS.first[chunk]);
+        second[chunk] = _mm256_load_si256((const __m256i*)MASKS.second[chunk]);
+        spaces[chunk] = _mm256_load_si256((const __m256i*)MASKS.spaces[chunk]);
+    }
+
+    // room is reserved for a batch of rows at a time
+    const size_t BATCH_ROWS = 64;
+    char *start = nullptr;
+    char *p = nullptr;
+    size_t row = 0;
+    for (; row + 2 <= rows; row += 2) {
+        if (row % BATCH_ROWS == 0) {
+            if (start != nullptr) {
+                out.commit(p - start);
+            }
+            start = p = out.reserve(BATCH_ROWS * (16 + HEXDUMP_ROW_TAIL));
+        }
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(bytes + row * 16));
+        const __m256i hi_hex = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble_mask));
+        const __m256i lo_hex = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, nibble_mask));
+        const __m256i pairs_lo = _mm256_unpacklo_epi8(hi_hex, lo_hex);
+        const __m256i pairs_hi = _mm256_unpackhi_epi8(hi_hex, lo_hex);
+        __m256i hex[3];
+        for (int chunk = 0; chunk < 3; chunk++) {
+            hex[chunk] = _mm256_or_si256(_mm256_or_si256(
+                _mm256_shuffle_epi8(pairs_lo, first[chunk]),
+                _mm256_shuffle_epi8(pairs_hi, second[chunk])), spaces[chunk]);
+        }
+        const __m256i printable = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, space));
+        const __m256i ascii = _mm256_blendv_epi8(dot, v, printable);
+
+        for (int lane = 0; lane < 2; lane++) {
+            p += address.write(p);
+            address.next();
+            p[0] = p[1] = ' ';
+            p += 2;
+            for (int chunk = 0; chunk < 3; chunk++, p += 16) {
+                _mm_storeu_si128((__m128i*)p, lane == 0 ? _mm256_castsi256_si128(hex[chunk]) : _mm256_extracti128_si256(hex[chunk], 1));
+            }
+            memcpy(p, "  |", 3);
+            p += 3;
+            _mm_storeu_si128((__m128i*)p, lane == 0 ? _mm256_castsi256_si128(ascii) : _mm256_extracti128_si256(ascii, 1));
+            p += 16;
+            p[0] = '|';
+            p[1] = '\n';
+            p += 2;
+        }
+    }
+    if (start != nullptr) {
+        out.commit(p - start);
+    }
+    hexdump_rows_sse2(bytes + row * 16, address, rows - row, out);
+}
+#endif // MEMLENS_HEXDUMP_X86
+
+/// @return whether this CPU can run `kernel`
+bool hexdump_kernel_supported(hexdump_kernel_t kernel) {
+#ifdef MEMLENS_HEXDUMP_X86
+    switch (kernel) {
+        case HEXDUMP_SSE2: return __builtin_cpu_supports("sse2");
+        case HEXDUMP_AVX2: return __builtin_cpu_supports("avx2");
+        default: return true;
+    }
+#else
+    return kernel == HEXDUMP_SCALAR || kernel == HEXDUMP_BEST;
+#endif
+}
+
+/// @brief Format `size` bytes in hexdump format into `out`, as if they were located
+/// at `address`.
+/// @details Rows are aligned to 16 bytes, so a large range can be formatted a piece
+/// at a time, as long as each piece starts at a 16 byte boundary.
+/// @param bytes the contents of memory at [address, address + size)
+void hexdump_rows(const uint8_t *bytes, const void *address, size_t size, output_buffer_t &out, hexdump_kernel_t kernel = HEXDUMP_BEST) {
+    if (kernel == HEXDUMP_BEST) {
+        static const hexdump_kernel_t BEST = hexdump_kernel_supported(HEXDUMP_AVX2) ? HEXDUMP_AVX2
+            : hexdump_kernel_supported(HEXDUMP_SSE2) ? HEXDUMP_SSE2 : HEXDUMP_SCALAR;
+        kernel = BEST;
+    }
+    const uintptr_t start = reinterpret_cast<uintptr_t>(address);
+    const uintptr_t end = start + size;
+    uintptr_t row_address = start & ~(uintptr_t)0xf;
+    if (size == 0 && row_address == start) {
+        return; // (but an unaligned empty range gets a blank row, as it always did)
+    }
+
+    hexdump_address_t address_text(row_address);
+
+    // a leading partial row, with `bytes` shifted so that bytes[i] is at row_address + i
+    if (row_address != start || end - row_address < 16) {
+        const size_t to = end - row_address < 16 ? end - row_address : 16;
+        char *p = out.reserve(16 + HEXDUMP_ROW_TAIL);
+        out.commit(hexdump_row_scalar(bytes - (start - row_address), address_text, start - row_address, to, p));
+        bytes += row_address + to - start;
+        row_address += 16;
+        address_text.next();
+    }
+    if (row_address >= end) {
+        return;
+    }
+
+    const size_t full_rows = (end - row_address) / 16;
+    switch (kernel) {
+#ifdef MEMLENS_HEXDUMP_X86
+        case HEXDUMP_AVX2: hexdump_rows_avx2(bytes, address_text, full_rows, out); break;
+        case HEXDUMP_SSE2: hexdump_rows_sse2(bytes, address_text, full_rows, out); break;
+#endif
+        default: hexdump_rows_scalar(bytes, address_text, full_rows, out); break;
+    }
+    bytes += full_rows * 16;
+    row_address += full_rows * 16;
+
+    // a trailing partial row
+    if (row_address < end) {
+        char *p = out.reserve(16 + HEXDUMP_ROW_TAIL);
+        out.commit(hexdump_row_scalar(bytes, address_text, 0, end - row_address, p));
+    }
+}
+
+#endif // MEMLENS_HEXDUMP_HPP
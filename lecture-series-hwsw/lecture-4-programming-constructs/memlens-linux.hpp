@@ -3,96 +3,658 @@
 
 #ifdef __linux__
 
-#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <cerrno>
+#include <climits>
 #include <iomanip>
 #include <iostream>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "memlens.hpp"
 
 #define is_term() isatty(fileno(stdout))
 
-void load_memory_layout(std::vector<memory_region_t> &regions) {
-    std::ifstream maps("/proc/self/maps");
-    if (!maps.is_open()) {
-        std::cerr << "failed to open /proc/self/maps" << std::endl;
+size_t system_page_size() {
+    return getpagesize();
+}
+
+/// @brief Reads a file under /proc in large blocks and hands out one line at a
+/// time as a pointer into its own buffer, so that callers can tokenize in place
+/// instead of paying for a `std::string` (or an `std::istringstream`) per line.
+class proc_reader_t {
+public:
+    explicit proc_reader_t(size_t block_size = 256 * 1024)
+        :fd(-1), buf(block_size), begin(0), end(0), eof(false) {}
+
+    ~proc_reader_t() {
+        close();
+    }
+
+    /// @return true if `path` could be opened for reading
+    /// @details A reader can be reopened any number of times, reusing its buffer.
+    bool open(const char *path) {
+        close();
+        fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        begin = end = 0;
+        eof = fd < 0;
+        return fd >= 0;
+    }
+
+    /// @brief Fetch the next line (without its trailing newline).
+    /// @return false once the whole file has been consumed
+    bool next_line(const char *&line, size_t &len) {
+        while (true) {
+            const char *nl = (const char*)memchr(buf.data() + begin, '\n', end - begin);
+            if (nl != nullptr) {
+                line = buf.data() + begin;
+                len = nl - line;
+                begin += len + 1;
+                return true;
+            }
+            if (eof) {
+                if (begin == end) {
+                    return false;
+                }
+                line = buf.data() + begin;
+                len = end - begin;
+                begin = end;
+                return true;
+            }
+            // move the partial line to the front and refill the rest of the block
+            memmove(buf.data(), buf.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            if (end == buf.size()) {
+                buf.resize(buf.size() * 2); // a single line longer than the block
+            }
+            const ssize_t n = read(fd, buf.data() + end, buf.size() - end);
+            if (n <= 0) {
+                eof = true;
+            } else {
+                end += n;
+            }
+        }
+    }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    int fd;
+    std::vector<char> buf;
+    size_t begin;
+    size_t end;
+    bool eof;
+};
+
+inline bool is_lower_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+
+/// @brief Parse a hex number at `p`, advancing `p` past it.
+inline uint64_t parse_hex(const char *&p, const char *end) {
+    uint64_t value = 0;
+    for (; p < end; p++) {
+        const char c = *p;
+        if (c >= '0' && c <= '9') {
+            value = (value << 4) | (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = (value << 4) | (c - 'a' + 10);
+        } else {
+            break;
+        }
+    }
+    return value;
+}
+
+/// @brief Parse a decimal number at `p` (skipping leading blanks), advancing `p` past it.
+inline uint64_t parse_dec(const char *&p, const char *end) {
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    uint64_t value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + (*p - '0');
+    }
+    return value;
+}
+
+/// @brief The smaps keys we care about, and where each one lands in `memory_region_t`.
+const struct {
+    const char *key;
+    size_t len;
+    size_t memory_region_t::*field;
+} SMAPS_FIELDS[] = {
+    {"Rss", 3, &memory_region_t::resident_size},
+    {"Pss", 3, &memory_region_t::pss_size},
+    {"Shared_Clean", 12, &memory_region_t::shared_clean_size},
+    {"Shared_Dirty", 12, &memory_region_t::shared_dirty_size},
+    {"Private_Clean", 13, &memory_region_t::private_clean_size},
+    {"Private_Dirty", 13, &memory_region_t::private_dirty_size},
+    {"Swap", 4, &memory_region_t::swap_size},
+    {"AnonHugePages", 13, &memory_region_t::anon_huge_size},
+};
+
+/// @return "/proc/self/<file>" if `pid` is 0, else "/proc/<pid>/<file>", in `path`
+const char* proc_path(char (&path)[64], int pid, const char *file) {
+    if (pid == 0) {
+        snprintf(path, sizeof(path), "/proc/self/%s", file);
+    } else {
+        snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+    }
+    return path;
+}
+
+/// @brief Fill in resident, PSS, clean/dirty, swap and THP sizes of `regions` from
+/// /proc/<pid>/smaps, in a single pass over the file.
+/// @details `regions` must be sorted by start address (which is how maps lists them).
+/// Mappings that appeared after `regions` was loaded are skipped.
+/// @param pid the process to look at, or 0 for the current one
+void load_memory_usage(std::vector<memory_region_t> &regions, int pid = 0) {
+    static thread_local proc_reader_t smaps;
+    char path[64];
+    if (!smaps.open(proc_path(path, pid, "smaps"))) {
+        std::cerr << "failed to open " << path << ": " << strerror(errno) << std::endl;
         return;
     }
 
-    std::string line;
-    while (std::getline(maps, line)) {
-        std::istringstream iss(line);
-        memory_region_t region;
-        iss >> std::hex >> region.start_address;
-        iss.ignore(1); // skip '-'
-        void *end_address;
-        iss >> std::hex >> end_address;
-        region.size = (uint8_t*)end_address - (uint8_t*)region.start_address;
-        // iss.ignore(1); // skip ' '
-        std::string perms;
-        iss >> perms;
-        region.permissions = 0;
-        if (perms.find('r') != std::string::npos) {
-            region.permissions |= PERM_READ;
-        }
-        if (perms.find('w') != std::string::npos) {
-            region.permissions |= PERM_WRIT;
-        }
-        if (perms.find('x') != std::string::npos) {
-            region.permissions |= PERM_EXEC;
-        }
-        region.resident_size = 0; // TODO: implement via /proc/self/smaps
-        // iss.ignore(1); // skip ' '
-        uint64_t file_offset;
-        iss >> std::hex >> file_offset;
-        std::string ignore;
-        iss >> ignore; // skip device major minor
-        iss >> ignore; // skip inode
-        std::string detail;
-        iss >> detail;
-        if (detail.length() > 0 && detail[0] == '/') {
-            region.region_detail = detail;
-            bool this_file = detail.find("/memlens") != std::string::npos;
-            if (file_offset == 0) {
-                if (this_file) {
-                    region.region_type = "loader";
-                } else {
-                    region.region_type = "-";
-                    region.region_detail += " (loader)";
+    size_t next = 0;
+    memory_region_t *current = nullptr;
+    const char *line;
+    size_t len;
+    while (smaps.next_line(line, len)) {
+        const char *end = line + len;
+        if (len == 0) {
+            continue;
+        }
+        if (is_lower_hex(line[0])) {
+            // a new mapping starts, e.g. "7f736d21e000-7f736d244000 r--p ..."
+            const uintptr_t start = parse_hex(line, end);
+            while (next < regions.size() && reinterpret_cast<uintptr_t>(regions[next].start_address) < start) {
+                next++;
+            }
+            current = next < regions.size() && reinterpret_cast<uintptr_t>(regions[next].start_address) == start ? &regions[next] : nullptr;
+            continue;
+        }
+        if (current == nullptr) {
+            continue;
+        }
+        // a "Key:   value kB" line
+        const char *colon = (const char*)memchr(line, ':', len);
+        if (colon == nullptr) {
+            continue;
+        }
+        const size_t key_len = colon - line;
+        for (size_t i = 0; i < sizeof(SMAPS_FIELDS) / sizeof(SMAPS_FIELDS[0]); i++) {
+            if (SMAPS_FIELDS[i].len == key_len && memcmp(SMAPS_FIELDS[i].key, line, key_len) == 0) {
+                const char *p = colon + 1;
+                current->*SMAPS_FIELDS[i].field = parse_dec(p, end) * 1024;
+                break;
+            }
+        }
+    }
+    smaps.close();
+}
+
+/// @brief Sum up all mappings of process `pid` into `total`: the virtual size from
+/// /proc/<pid>/maps, and resident/PSS/dirty/swap/THP sizes from
+/// /proc/<pid>/smaps_rollup (which the kernel sums up for us), or from
+/// /proc/<pid>/smaps on kernels older than 4.14.
+/// @details Only start/end addresses are parsed and nothing is interned, so this
+/// does not allocate once `reader` has warmed up, and it is safe to call from a
+/// thread other than the one maintaining `MEMORY_REGIONS`.
+/// @return number of mappings, or 0 if the process could not be read
+size_t load_memory_totals(memory_region_t &total, proc_reader_t &reader, int pid = 0) {
+    char path[64];
+    total = memory_region_t();
+    if (!reader.open(proc_path(path, pid, "maps"))) {
+        return 0;
+    }
+    size_t mappings = 0;
+    const char *line;
+    size_t len;
+    while (reader.next_line(line, len)) {
+        const char *end = line + len;
+        const uint64_t start = parse_hex(line, end);
+        line++; // '-'
+        total.size += parse_hex(line, end) - start;
+        mappings++;
+    }
+
+    if (!reader.open(proc_path(path, pid, "smaps_rollup")) && !reader.open(proc_path(path, pid, "smaps"))) {
+        return mappings;
+    }
+    while (reader.next_line(line, len)) {
+        const char *colon = (const char*)memchr(line, ':', len);
+        if (len == 0 || is_lower_hex(line[0]) || colon == nullptr) {
+            continue; // header line of a mapping
+        }
+        const size_t key_len = colon - line;
+        for (size_t i = 0; i < sizeof(SMAPS_FIELDS) / sizeof(SMAPS_FIELDS[0]); i++) {
+            if (SMAPS_FIELDS[i].len == key_len && memcmp(SMAPS_FIELDS[i].key, line, key_len) == 0) {
+                const char *p = colon + 1;
+                total.*SMAPS_FIELDS[i].field += parse_dec(p, line + len) * 1024;
+                break;
+            }
+        }
+    }
+    reader.close();
+    return mappings;
+}
+
+/// @brief Call `f(usage, name)` for each mapping of process `pid`, with `usage` (its
+/// start address, size, and resident/PSS/dirty/swap/THP sizes) from
+/// /proc/<pid>/smaps, and `name` its path or pseudo name (e.g. "[heap]"), truncated,
+/// and empty for anonymous mappings.
+/// @details Like `load_memory_totals()`, nothing is interned, so this does not
+/// allocate once `reader` has warmed up.
+/// @return number of mappings, or 0 if the process could not be read
+template <typename F>
+size_t for_each_mapping_usage(proc_reader_t &reader, int pid, F f) {
+    char path[64];
+    if (!reader.open(proc_path(path, pid, "smaps"))) {
+        return 0;
+    }
+    size_t mappings = 0;
+    memory_region_t current = memory_region_t();
+    char name[128] = "";
+    const char *line;
+    size_t len;
+    while (reader.next_line(line, len)) {
+        const char *end = line + len;
+        if (len == 0) {
+            continue;
+        }
+        if (is_lower_hex(line[0])) {
+            // a new mapping starts, e.g. "7f736d21e000-7f736d244000 r--p 00000000 08:01 1234  /usr/lib/libc.so.6"
+            if (mappings > 0) {
+                f(current, name);
+            }
+            current = memory_region_t();
+            const uintptr_t start = parse_hex(line, end);
+            line++; // '-'
+            current.start_address = reinterpret_cast<void*>(start);
+            current.size = parse_hex(line, end) - start;
+            // the name comes after permissions, offset, device & inode
+            for (int field = 0; field < 4; field++) {
+                while (line < end && *line == ' ') {
+                    line++;
                 }
-            } else if (region.permissions & PERM_EXEC) {
-                if (this_file) {
-                    region.region_type = "code";
-                } else {
-                    region.region_type = "-";
-                    region.region_detail += " (code)";
+                while (line < end && *line != ' ') {
+                    line++;
                 }
+            }
+            while (line < end && *line == ' ') {
+                line++;
+            }
+            const size_t name_len = (size_t)(end - line) < sizeof(name) - 1 ? end - line : sizeof(name) - 1;
+            memcpy(name, line, name_len);
+            name[name_len] = '\0';
+            mappings++;
+            continue;
+        }
+        if (mappings == 0) {
+            continue;
+        }
+        // a "Key:   value kB" line
+        const char *colon = (const char*)memchr(line, ':', len);
+        if (colon == nullptr) {
+            continue;
+        }
+        const size_t key_len = colon - line;
+        for (size_t i = 0; i < sizeof(SMAPS_FIELDS) / sizeof(SMAPS_FIELDS[0]); i++) {
+            if (SMAPS_FIELDS[i].len == key_len && memcmp(SMAPS_FIELDS[i].key, line, key_len) == 0) {
+                const char *p = colon + 1;
+                current.*SMAPS_FIELDS[i].field = parse_dec(p, end) * 1024;
+                break;
+            }
+        }
+    }
+    if (mappings > 0) {
+        f(current, name);
+    }
+    reader.close();
+    return mappings;
+}
+
+/// @brief Read all of `path` into `buf`, growing it if needed.
+/// @details procfs hands out maps roughly a page per `read()`, so we keep reading
+/// into the tail of the same buffer. Reusing `buf` across calls means a steady
+/// state refresh does not allocate.
+/// @return number of bytes read, or -1 if `path` could not be opened
+ssize_t read_proc_file(const char *path, std::vector<char> &buf) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (buf.size() < 64 * 1024) {
+        buf.resize(64 * 1024);
+    }
+    size_t len = 0;
+    while (true) {
+        if (len == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+        const ssize_t n = read(fd, &buf[len], buf.size() - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    return len;
+}
+
+/// @brief what the kernel appends to the path of a mapped file that was since deleted
+const char DELETED_SUFFIX[] = " (deleted)";
+const size_t DELETED_LEN = sizeof(DELETED_SUFFIX) - 1;
+
+inline bool ends_with_deleted(const char *path, size_t len) {
+    return len > DELETED_LEN && memcmp(path + len - DELETED_LEN, DELETED_SUFFIX, DELETED_LEN) == 0;
+}
+
+/// @brief Parse the contents of a /proc/<pid>/maps file into `regions` (appending).
+/// @details Fields are tokenized in place, and the region type & detail are interned,
+/// so parsing does not allocate once all the pathnames have been seen before.
+/// @param exe_path path of the process' executable, whose mappings are named
+///   loader/code/data/const (other files get these as a suffix to their detail)
+void parse_memory_maps(const char *data, size_t len, std::vector<memory_region_t> &regions, const char *exe_path) {
+    const size_t exe_len = strlen(exe_path);
+    static const interned_str_t NO_TYPE("-");
+    static const interned_str_t LOADER("loader");
+    static const interned_str_t CODE("code");
+    static const interned_str_t DATA("data");
+    static const interned_str_t CONST("const");
+    static const char *const SUFFIXES[] = {" (loader)", " (code)", " (data)", " (const)"};
+    static thread_local char detail_buf[PATH_MAX + 16];
+
+    const char *const data_end = data + len;
+    while (data < data_end) {
+        const char *nl = (const char*)memchr(data, '\n', data_end - data);
+        const char *end = nl != nullptr ? nl : data_end;
+        const char *p = data;
+        data = end + 1;
+
+        // e.g. "7f736d21e000-7f736d244000 r--p 00000000 fe:00 467394    /usr/lib/libc.so.6"
+        memory_region_t region = memory_region_t();
+        const uintptr_t start = parse_hex(p, end);
+        if (p == end || *p != '-') {
+            continue;
+        }
+        p++;
+        const uintptr_t stop = parse_hex(p, end);
+        region.start_address = reinterpret_cast<void*>(start);
+        region.size = stop - start;
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        for (; p < end && *p != ' '; p++) {
+            switch (*p) {
+                case 'r': region.permissions |= PERM_READ; break;
+                case 'w': region.permissions |= PERM_WRIT; break;
+                case 'x': region.permissions |= PERM_EXEC; break;
+            }
+        }
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        const uint64_t file_offset = parse_hex(p, end);
+        // skip device major:minor & inode
+        for (int field = 0; field < 2; field++) {
+            while (p < end && *p == ' ') {
+                p++;
+            }
+            while (p < end && *p != ' ') {
+                p++;
+            }
+        }
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        const char *detail = p;
+        const size_t detail_len = end - p;
+
+        if (detail_len > 0 && detail[0] == '/') {
+            // a file replaced since it was mapped (e.g. a rebuilt executable) is listed as "<path> (deleted)"
+            const size_t path_len = detail_len - (ends_with_deleted(detail, detail_len) ? DELETED_LEN : 0);
+            const bool this_file = path_len == exe_len && memcmp(detail, exe_path, exe_len) == 0;
+            int kind; // index into SUFFIXES, or -1 for none
+            if (file_offset == 0) {
+                kind = 0;
+                region.region_type = LOADER;
+            } else if (region.permissions & PERM_EXEC) {
+                kind = 1;
+                region.region_type = CODE;
             } else if (region.permissions & PERM_WRIT) {
-                if (this_file) {
-                    region.region_type = "data";
-                } else {
-                    region.region_type = "-";
-                    region.region_detail += " (data)";
-                }
+                kind = 2;
+                region.region_type = DATA;
             } else if (region.permissions & PERM_READ) {
-                if (this_file) {
-                    region.region_type = "const";
+                kind = 3;
+                region.region_type = CONST;
+            } else {
+                kind = -1;
+            }
+            if (this_file && kind >= 0) {
+                region.region_detail = interned_str_t(detail, detail_len);
+            } else {
+                region.region_type = NO_TYPE;
+                if (kind < 0 || detail_len > PATH_MAX) {
+                    region.region_detail = interned_str_t(detail, detail_len);
                 } else {
-                    region.region_type = "-";
-                    region.region_detail += " (const)";
+                    const size_t suffix_len = strlen(SUFFIXES[kind]);
+                    memcpy(detail_buf, detail, detail_len);
+                    memcpy(detail_buf + detail_len, SUFFIXES[kind], suffix_len);
+                    region.region_detail = interned_str_t(detail_buf, detail_len + suffix_len);
                 }
-            } else {
-                region.region_type = "-";
             }
-        } else if (detail.length() > 0 && detail[0] == '[') {
-            region.region_type = detail.substr(1, detail.length() - 2);
-            region.region_detail = "-";
+        } else if (detail_len > 0 && detail[0] == '[') {
+            const char *close = (const char*)memchr(detail, ']', detail_len);
+            region.region_type = interned_str_t(detail + 1, (close != nullptr ? close : detail + detail_len) - detail - 1);
+            region.region_detail = NO_TYPE;
         } else {
-            region.region_type = "-";
-            region.region_detail = detail;
+            region.region_type = NO_TYPE;
+            region.region_detail = interned_str_t(detail, detail_len);
         }
         regions.push_back(region);
     }
 }
 
+/// @brief Resolve the executable of process `pid` (0 for the current one) into `path`.
+/// @return `path`, which is left empty if the executable can't be resolved
+/// @details The " (deleted)" suffix of an executable replaced while running is
+/// dropped, as it is when `parse_memory_maps()` compares against it.
+const char* exe_path_of(char (&path)[PATH_MAX], int pid) {
+    char link[64];
+    ssize_t len = readlink(proc_path(link, pid, "exe"), path, sizeof(path) - 1);
+    if (len > 0 && ends_with_deleted(path, len)) {
+        len -= DELETED_LEN;
+    }
+    path[len > 0 ? len : 0] = '\0';
+    return path;
+}
+
+bool load_process_memory_layout(int pid, std::vector<memory_region_t> &regions, bool with_usage) {
+    static thread_local std::vector<char> buf;
+    static const std::string self_exe = []() {
+        char exe[PATH_MAX];
+        return std::string(exe_path_of(exe, 0));
+    }();
+    static thread_local char other_exe[PATH_MAX];
+    char path[64];
+    const ssize_t len = read_proc_file(proc_path(path, pid, "maps"), buf);
+    if (len < 0) {
+        std::cerr << "failed to open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    parse_memory_maps(&buf[0], len, regions, pid == 0 ? self_exe.c_str() : exe_path_of(other_exe, pid));
+    if (with_usage) {
+        load_memory_usage(regions, pid);
+    }
+    return true;
+}
+
+void load_memory_layout(std::vector<memory_region_t> &regions, bool with_usage) {
+    load_process_memory_layout(0, regions, with_usage);
+}
+
+/// @brief Reads the memory of another process in large batches.
+/// @details Each `read()` is split along the process' readable regions, and all the
+/// pieces go to the kernel in as few `process_vm_readv()` calls as possible (up to
+/// IOV_MAX pieces per call). Unreadable holes are zero-filled without a syscall. If
+/// `process_vm_readv()` isn't available (e.g. blocked by a seccomp filter), or fails
+/// part way through, we fall back to `pread()` on /proc/<pid>/mem.
+class process_reader_t {
+public:
+    process_reader_t() :pid(0), mem_fd(-1), owner(this) {}
+
+    ~process_reader_t() {
+        if (mem_fd >= 0) {
+            close(mem_fd);
+        }
+    }
+
+    /// @brief Attach to `pid`, loading its memory layout.
+    /// @return false if the process can't be inspected
+    bool attach(int target) {
+        pid = target;
+        owner = this;
+        regions.clear();
+        if (!load_process_memory_layout(pid, regions, false)) {
+            return false;
+        }
+        index.build(regions);
+        return true;
+    }
+
+    /// @brief Read from the process `attached` is attached to, sharing its layout
+    /// (which must outlive this reader, and not change): readers aren't thread safe,
+    /// so each thread needs its own, but there's no need for each to load the layout.
+    void share(const process_reader_t &attached) {
+        pid = attached.pid;
+        owner = &attached;
+    }
+
+    /// @return the memory layout of the attached process
+    const std::vector<memory_region_t>& layout() const {
+        return owner->regions;
+    }
+
+    /// @return the index over `layout()`
+    const region_index_t& layout_index() const {
+        return owner->index;
+    }
+
+    /// @brief Copy `size` bytes at `address` (in the attached process) into `buf`.
+    /// @return the number of bytes that could be read; the rest are zero-filled
+    size_t read(const void *address, void *buf, size_t size) {
+        const uintptr_t end = reinterpret_cast<uintptr_t>(address) + size;
+        uintptr_t cursor = reinterpret_cast<uintptr_t>(address);
+        uint8_t *out = (uint8_t*)buf;
+        size_t count = 0;
+        size_t bytes_read = 0;
+        while (cursor < end) {
+            const memory_region_t *region = owner->index.find_at_or_after(reinterpret_cast<void*>(cursor));
+            const uintptr_t region_start = region != nullptr ? reinterpret_cast<uintptr_t>(region->start_address) : end;
+            if (region_start >= end || region_start > cursor) {
+                // a hole in the address space
+                const uintptr_t hole_end = region_start < end ? region_start : end;
+                memset(out + (cursor - reinterpret_cast<uintptr_t>(address)), 0, hole_end - cursor);
+                cursor = hole_end;
+                continue;
+            }
+            const uintptr_t region_end = region_start + region->size;
+            const uintptr_t piece_end = region_end < end ? region_end : end;
+            uint8_t *piece = out + (cursor - reinterpret_cast<uintptr_t>(address));
+            if (region->permissions & PERM_READ) {
+                local_iov[count].iov_base = piece;
+                local_iov[count].iov_len = piece_end - cursor;
+                remote_iov[count].iov_base = reinterpret_cast<void*>(cursor);
+                remote_iov[count].iov_len = piece_end - cursor;
+                if (++count == MAX_IOV) {
+                    bytes_read += read_batch(count);
+                    count = 0;
+                }
+            } else {
+                memset(piece, 0, piece_end - cursor);
+            }
+            cursor = piece_end;
+        }
+        if (count > 0) {
+            bytes_read += read_batch(count);
+        }
+        return bytes_read;
+    }
+
+private:
+    static const size_t MAX_IOV = IOV_MAX;
+
+    int pid;
+    int mem_fd;
+    std::vector<memory_region_t> regions;
+    region_index_t index;
+    const process_reader_t *owner;  // whose layout we use: this one, or the one we share
+    struct iovec local_iov[MAX_IOV];
+    struct iovec remote_iov[MAX_IOV];
+
+    /// @brief Read all the pieces queued up in `local_iov`/`remote_iov`.
+    size_t read_batch(size_t count) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            total += local_iov[i].iov_len;
+        }
+        const ssize_t n = process_vm_readv(pid == 0 ? getpid() : pid, local_iov, count, remote_iov, count, 0);
+        if (n == (ssize_t)total) {
+            return total;
+        }
+        // skip over what was read, and fall back to /proc/<pid>/mem for the rest
+        size_t done = n > 0 ? n : 0;
+        size_t bytes_read = done;
+        for (size_t i = 0; i < count; i++) {
+            if (done >= local_iov[i].iov_len) {
+                done -= local_iov[i].iov_len;
+                continue;
+            }
+            bytes_read += read_mem(
+                (uint8_t*)local_iov[i].iov_base + done,
+                reinterpret_cast<uintptr_t>(remote_iov[i].iov_base) + done,
+                local_iov[i].iov_len - done);
+            done = 0;
+        }
+        return bytes_read;
+    }
+
+    /// @brief Read via /proc/<pid>/mem, zero-filling pages that can't be read.
+    size_t read_mem(uint8_t *out, uintptr_t remote, size_t size) {
+        if (mem_fd < 0) {
+            char path[64];
+            mem_fd = open(proc_path(path, pid, "mem"), O_RDONLY | O_CLOEXEC);
+        }
+        const size_t page_size = getpagesize();
+        size_t bytes_read = 0;
+        while (size > 0) {
+            const ssize_t n = mem_fd >= 0 ? pread(mem_fd, out, size, remote) : -1;
+            size_t skip;
+            if (n > 0) {
+                skip = n;
+                bytes_read += n;
+            } else {
+                // unreadable page (e.g. [vvar]): zero it, and move on to the next one
+                skip = page_size - remote % page_size;
+                skip = skip < size ? skip : size;
+                memset(out, 0, skip);
+            }
+            out += skip;
+            remote += skip;
+            size -= skip;
+        }
+        return bytes_read;
+    }
+};
+
 #endif // is linux
 #endif // MEMLENS_LINUX_HPP
\ No newline at end of file
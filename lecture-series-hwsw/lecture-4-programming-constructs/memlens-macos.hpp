@@ -23,7 +23,11 @@
 
 #define is_term() isatty(fileno(stdout))
 
-void load_memory_layout(std::vector<memory_region_t> &regions) {
+size_t system_page_size() {
+    return getpagesize();
+}
+
+void load_memory_layout(std::vector<memory_region_t> &regions, bool /* with_usage: always available */) {
     mach_port_t task = mach_task_self();
     mach_vm_address_t address = 0;
     mach_vm_size_t size = 0;
@@ -51,7 +55,7 @@ void load_memory_layout(std::vector<memory_region_t> &regions) {
             user_tag = ext_info.user_tag;
         }
 
-        memory_region_t region;
+        memory_region_t region = memory_region_t();
         region.start_address = (void*)address;
         region.size = size;
         region.region_type = "-";
@@ -142,15 +146,16 @@ void load_memory_layout(std::vector<memory_region_t> &regions) {
                     }
                 } else {
                     region.region_type = "-";
-                    region.region_detail = "";
+                    std::string detail;
                     if (info.reserved) {
-                        if (region.region_detail.size() > 0) region.region_detail.append(", ");
-                        region.region_detail.append("reserved");
+                        if (detail.size() > 0) detail.append(", ");
+                        detail.append("reserved");
                     }
                     if (info.shared) {
-                        if (region.region_detail.size() > 0) region.region_detail.append(", ");
-                        region.region_detail.append("shared");
+                        if (detail.size() > 0) detail.append(", ");
+                        detail.append("shared");
                     }
+                    region.region_detail = detail;
                 }
             }
         }
@@ -174,5 +179,53 @@ void load_memory_layout(std::vector<memory_region_t> &regions) {
     }
 }
 
+bool load_process_memory_layout(int pid, std::vector<memory_region_t> &regions, bool with_usage) {
+    if (pid != 0) {
+        std::cerr << "inspecting other processes is not supported on macOS" << std::endl;
+        return false;
+    }
+    load_memory_layout(regions, with_usage);
+    return true;
+}
+
+/// @brief Reads the memory of a process. Only the current process (pid 0) is
+/// supported on macOS, see `load_process_memory_layout()`.
+class process_reader_t {
+public:
+    process_reader_t() :owner(this) {}
+
+    bool attach(int target) {
+        owner = this;
+        regions.clear();
+        if (!load_process_memory_layout(target, regions, false)) {
+            return false;
+        }
+        index.build(regions);
+        return true;
+    }
+
+    void share(const process_reader_t &attached) {
+        owner = &attached;
+    }
+
+    const std::vector<memory_region_t>& layout() const {
+        return owner->regions;
+    }
+
+    const region_index_t& layout_index() const {
+        return owner->index;
+    }
+
+    size_t read(const void *address, void *buf, size_t size) {
+        memcpy(buf, address, size);
+        return size;
+    }
+
+private:
+    std::vector<memory_region_t> regions;
+    region_index_t index;
+    const process_reader_t *owner;
+};
+
 #endif // __APPLE__
 #endif // MEMLENS_MACOS_HPP
\ No newline at end of file
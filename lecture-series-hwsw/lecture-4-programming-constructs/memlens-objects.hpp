@@ -0,0 +1,242 @@
+/// @file
+/// @brief Object layouts: where each field of a class lives, and what's wasted.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// C++ has no reflection (yet), so a class lists its fields with `MEMLENS_FIELDS()`,
+/// which expands to constexpr functions that describe each field (its offset, size
+/// and alignment) from inside the class, where private fields are accessible. A
+/// derived class can't get at the private fields of its base, so it names its base
+/// with `MEMLENS_FIELDS_DERIVED()`, which pulls in the fields the base listed.
+/// `memlens::layout_of<T>()` turns that into a full picture of `T`: the fields in memory
+/// order, the vptr of polymorphic classes, the padding between and after fields, and
+/// how objects of `T` fall on cache lines when they are packed in an array. All of
+/// it is computed by the compiler, so it can be checked with `static_assert()` and
+/// costs nothing at run time.
+
+#ifndef MEMLENS_OBJECTS_HPP
+#define MEMLENS_OBJECTS_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <type_traits>
+
+namespace memlens {
+
+/// @brief the cache line size assumed for layouts (it is 64 bytes on x86-64, and on
+/// most ARM cores; Apple's M series have 128 byte lines)
+const size_t LAYOUT_CACHE_LINE = 64;
+
+/// @brief the most fields `MEMLENS_FIELDS()` takes
+const size_t MAX_LAYOUT_FIELDS = 16;
+
+/// @brief A field of an object.
+typedef struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+    size_t align;
+    size_t padding_before;      // bytes of padding between the previous field and this one
+    const char *base;           // the base class it's inherited from, or nullptr
+} field_layout_t;
+
+/// @brief The layout of a class, as worked out by `layout_of()`.
+typedef struct {
+    size_t size;
+    size_t align;
+    bool has_vptr;              // polymorphic, with the vptr at offset 0
+    size_t field_count;
+    field_layout_t fields[MAX_LAYOUT_FIELDS];   // in order of offset
+    size_t tail_padding;        // bytes after the last field, up to `size`
+    size_t padding;             // all padding, including the tail
+    size_t objects_per_line;    // objects of an array that share a cache line (0 if bigger than a line)
+    size_t straddling;          // of every `straddle_period` objects of an array that starts on a
+    size_t straddle_period;     // cache line, this many span two lines (or more than they must)
+} object_layout_t;
+
+/// @return the offset of the `Base` part of a `Derived`, its only (non-virtual) base
+/// @details As with the vptr in `layout_of()`, this follows the Itanium and MSVC ABIs:
+/// the base comes first, unless `Derived` brings in a vptr that `Base` doesn't have.
+template <typename Derived, typename Base>
+constexpr size_t base_offset() {
+    return std::is_polymorphic<Derived>::value && !std::is_polymorphic<Base>::value
+        ? (sizeof(void*) + alignof(Base) - 1) / alignof(Base) * alignof(Base) : 0;
+}
+
+/// @return `field` of `Base`, as a field of `Derived`
+template <typename Derived, typename Base>
+constexpr field_layout_t inherited_field(field_layout_t field, const char *base) {
+    field.offset += base_offset<Derived, Base>();
+    field.base = field.base != nullptr ? field.base : base;
+    return field;
+}
+
+} // namespace memlens
+
+#define MEMLENS_EXPAND(x) x
+#define MEMLENS_CONCAT_(a, b) a##b
+#define MEMLENS_CONCAT(a, b) MEMLENS_CONCAT_(a, b)
+#define MEMLENS_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, n, ...) n
+#define MEMLENS_NARGS(...) MEMLENS_EXPAND(MEMLENS_NARGS_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+
+// MEMLENS_FOR_EACH(m, t, a, b, ...) is m(t, a), m(t, b), ...
+#define MEMLENS_FOR_EACH_1(m, t, x) m(t, x)
+#define MEMLENS_FOR_EACH_2(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_1(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_3(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_2(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_4(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_3(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_5(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_4(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_6(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_5(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_7(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_6(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_8(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_7(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_9(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_8(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_10(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_9(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_11(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_10(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_12(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_11(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_13(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_12(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_14(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_13(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_15(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_14(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH_16(m, t, x, ...) m(t, x), MEMLENS_EXPAND(MEMLENS_FOR_EACH_15(m, t, __VA_ARGS__))
+#define MEMLENS_FOR_EACH(m, t, ...) MEMLENS_EXPAND(MEMLENS_CONCAT(MEMLENS_FOR_EACH_, MEMLENS_NARGS(__VA_ARGS__))(m, t, __VA_ARGS__))
+
+#define MEMLENS_FIELD_LAYOUT(type, field) {#field, offsetof(type, field), sizeof(type::field), alignof(decltype(type::field)), 0, nullptr}
+
+// offsetof() is only guaranteed for standard layout classes, which polymorphic ones
+// aren't, but compilers support it for any class without virtual bases
+#if defined(__GNUC__)
+#define MEMLENS_OFFSETOF_BEGIN _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Winvalid-offsetof\"")
+#define MEMLENS_OFFSETOF_END _Pragma("GCC diagnostic pop")
+#else
+#define MEMLENS_OFFSETOF_BEGIN
+#define MEMLENS_OFFSETOF_END
+#endif
+
+/// @brief List the fields of class `type` for `layout_of()`. Put it last in the
+/// class (it leaves what follows public). Derived classes that add no fields of their
+/// own inherit the list of their base; `layout_of()` rejects those that do (as far
+/// as it can tell: their objects are bigger than their base's), they need
+/// `MEMLENS_FIELDS_DERIVED()`.
+#define MEMLENS_FIELDS(type, ...) \
+public: \
+    static_assert(MEMLENS_NARGS(__VA_ARGS__) <= memlens::MAX_LAYOUT_FIELDS, "too many fields for MEMLENS_FIELDS()"); \
+    typedef type memlens_fields_of; \
+    static constexpr size_t memlens_field_count() { \
+        return MEMLENS_NARGS(__VA_ARGS__); \
+    } \
+    static constexpr memlens::field_layout_t memlens_field(size_t i) { \
+        MEMLENS_OFFSETOF_BEGIN \
+        const memlens::field_layout_t fields[] = {MEMLENS_FOR_EACH(MEMLENS_FIELD_LAYOUT, type, __VA_ARGS__)}; \
+        MEMLENS_OFFSETOF_END \
+        return fields[i]; \
+    }
+
+/// @brief `MEMLENS_FIELDS()` for class `type` derived from `base` (its only base,
+/// not a virtual one, with its own `MEMLENS_FIELDS()`): the fields of `base`, private
+/// ones included, followed by those `type` adds (at least one).
+#define MEMLENS_FIELDS_DERIVED(type, base, ...) \
+public: \
+    static_assert(base::memlens_field_count() + MEMLENS_NARGS(__VA_ARGS__) <= memlens::MAX_LAYOUT_FIELDS, \
+        "too many fields for MEMLENS_FIELDS_DERIVED()"); \
+    typedef type memlens_fields_of; \
+    static constexpr size_t memlens_field_count() { \
+        return base::memlens_field_count() + MEMLENS_NARGS(__VA_ARGS__); \
+    } \
+    static constexpr memlens::field_layout_t memlens_field(size_t i) { \
+        MEMLENS_OFFSETOF_BEGIN \
+        const memlens::field_layout_t fields[] = {MEMLENS_FOR_EACH(MEMLENS_FIELD_LAYOUT, type, __VA_ARGS__)}; \
+        MEMLENS_OFFSETOF_END \
+        return i < base::memlens_field_count() ? memlens::inherited_field<type, base>(base::memlens_field(i), #base) \
+            : fields[i - base::memlens_field_count()]; \
+    }
+
+namespace memlens {
+
+/// @return the layout of `T`, whose fields are listed with `MEMLENS_FIELDS()`
+/// @details The vptr is assumed to be at offset 0, where the Itanium (gcc, clang)
+/// and MSVC ABIs put it for classes without virtual bases.
+template <typename T>
+constexpr object_layout_t layout_of() {
+    static_assert(std::is_same<T, typename T::memlens_fields_of>::value || sizeof(T) == sizeof(typename T::memlens_fields_of),
+        "T adds fields to the class whose MEMLENS_FIELDS() it inherits, it needs a MEMLENS_FIELDS() of its own");
+    object_layout_t layout = {};
+    layout.size = sizeof(T);
+    layout.align = alignof(T);
+    layout.field_count = T::memlens_field_count();
+    for (size_t i = 0; i < layout.field_count; i++) {
+        // insertion sort, by offset
+        const field_layout_t field = T::memlens_field(i);
+        size_t j = i;
+        for (; j > 0 && layout.fields[j - 1].offset > field.offset; j--) {
+            layout.fields[j] = layout.fields[j - 1];
+        }
+        layout.fields[j] = field;
+    }
+    layout.has_vptr = std::is_polymorphic<T>::value && (layout.field_count == 0 || layout.fields[0].offset >= sizeof(void*));
+
+    size_t end = layout.has_vptr ? sizeof(void*) : 0;
+    for (size_t i = 0; i < layout.field_count; i++) {
+        field_layout_t &field = layout.fields[i];
+        field.padding_before = field.offset > end ? field.offset - end : 0;
+        layout.padding += field.padding_before;
+        end = field.offset + field.size > end ? field.offset + field.size : end;
+    }
+    layout.tail_padding = layout.size > end ? layout.size - end : 0;
+    layout.padding += layout.tail_padding;
+
+    layout.objects_per_line = layout.size <= LAYOUT_CACHE_LINE ? LAYOUT_CACHE_LINE / layout.size : 0;
+    // objects of an array fall on cache lines the same way every lcm(size, line) bytes
+    size_t gcd = layout.size;
+    for (size_t b = LAYOUT_CACHE_LINE; b != 0; ) {
+        const size_t r = gcd % b;
+        gcd = b;
+        b = r;
+    }
+    layout.straddle_period = LAYOUT_CACHE_LINE / gcd;
+    const size_t min_lines = (layout.size + LAYOUT_CACHE_LINE - 1) / LAYOUT_CACHE_LINE;
+    for (size_t k = 0; k < layout.straddle_period; k++) {
+        const size_t first = k * layout.size / LAYOUT_CACHE_LINE;
+        const size_t last = ((k + 1) * layout.size - 1) / LAYOUT_CACHE_LINE;
+        layout.straddling += last - first + 1 > min_lines;
+    }
+    return layout;
+}
+
+/// @brief Print `layout` (of the class called `name`) field by field, with its padding
+/// and how it falls on cache lines.
+void print_object_layout(const char *name, const object_layout_t &layout) {
+    printf("%s: %zu bytes, aligned to %zu%s\n", name, layout.size, layout.align, layout.has_vptr ? ", with a vptr" : "");
+    printf("  %6s %5s %5s %5s  %s\n", "offset", "size", "align", "line", "field");
+    if (layout.has_vptr) {
+        printf("  %6d %5zu %5zu %5d  %s\n", 0, sizeof(void*), alignof(void*), 0, "[vptr]");
+    }
+    for (size_t i = 0; i < layout.field_count; i++) {
+        const field_layout_t &field = layout.fields[i];
+        if (field.padding_before > 0) {
+            printf("  %6zu %5zu %5s %5s  %s\n", field.offset - field.padding_before, field.padding_before, "", "", "[padding]");
+        }
+        const size_t line = field.offset / LAYOUT_CACHE_LINE;
+        const bool split = (field.offset + field.size - 1) / LAYOUT_CACHE_LINE != line;
+        printf("  %6zu %5zu %5zu %5zu  %s%s%s%s\n", field.offset, field.size, field.align, line,
+            field.base != nullptr ? field.base : "", field.base != nullptr ? "::" : "", field.name,
+            split ? "  (split across cache lines)" : "");
+    }
+    if (layout.tail_padding > 0) {
+        printf("  %6zu %5zu %5s %5s  %s\n", layout.size - layout.tail_padding, layout.tail_padding, "", "", "[padding]");
+    }
+    printf("  %zu bytes of padding (%.0f%%)", layout.padding, layout.size > 0 ? layout.padding * 100.0 / layout.size : 0.0);
+    if (layout.objects_per_line > 1) {
+        // neighbours in an array share lines: threads writing to different objects
+        // would still fight over the same cache lines
+        printf(", %zu objects per %zu byte cache line (false sharing, unless aligned to %zu)", layout.objects_per_line,
+            LAYOUT_CACHE_LINE, LAYOUT_CACHE_LINE);
+    } else {
+        printf(", %zu cache line(s) per object", (layout.size + LAYOUT_CACHE_LINE - 1) / LAYOUT_CACHE_LINE);
+    }
+    if (layout.straddling > 0) {
+        printf(", %zu of every %zu objects in an array straddle cache lines", layout.straddling, layout.straddle_period);
+    }
+    printf("\n");
+}
+
+} // namespace memlens
+
+#define print_layout_of(T) memlens::print_object_layout(#T, memlens::layout_of<T>())
+
+#endif // MEMLENS_OBJECTS_HPP
@@ -0,0 +1,343 @@
+/// @file
+/// @brief Buffered output, formatted by hand.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// `std::cout` is convenient, but formatting through it costs a few virtual calls
+/// per field, and `std::endl` flushes on every line. For large outputs (huge dumps,
+/// long running samplers) we instead format into one large buffer, and hand it to
+/// the OS with a single `write()` when it fills up.
+///
+/// The same goes for machine readable output (`--format json|csv|ndjson`): records
+/// are written field by field straight into the buffer, with numbers formatted by
+/// hand and strings escaped in place, so nothing is allocated per record.
+
+#ifndef MEMLENS_OUTPUT_HPP
+#define MEMLENS_OUTPUT_HPP
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
+#include <io.h>
+#define memlens_write _write
+#else
+#include <unistd.h>
+#define memlens_write write
+#endif
+
+/// @brief A large output buffer that is written out to a file descriptor when full.
+/// @details If mixing with `std::cout` on the same descriptor, flush one before
+/// writing to the other. With a negative `fd`, nothing is written out, and the
+/// buffer grows to hold everything appended (see `data()`).
+class output_buffer_t {
+public:
+    explicit output_buffer_t(int fd = 1, size_t capacity = 1 << 20)
+        :fd(fd), buf(capacity), used(0) {}
+
+    ~output_buffer_t() {
+        flush();
+    }
+
+    /// @return a pointer to at least `len` bytes of free space; call `commit()`
+    /// with how many of them were filled in
+    char* reserve(size_t len) {
+        if (used + len > buf.size()) {
+            flush();
+            if (used + len > buf.size()) {
+                buf.resize(used + len > 2 * buf.size() ? used + len : 2 * buf.size());
+            }
+        }
+        return &buf[used];
+    }
+
+    void commit(size_t len) {
+        used += len;
+    }
+
+    void append(const char *str, size_t len) {
+        memcpy(reserve(len), str, len);
+        used += len;
+    }
+
+    void append(const char *str) {
+        append(str, strlen(str));
+    }
+
+    void append_char(char c) {
+        *reserve(1) = c;
+        used++;
+    }
+
+    /// @brief Append `value` in decimal, right aligned to `width` characters.
+    void append_dec(uint64_t value, int width = 0, char pad = ' ') {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value != 0);
+        append_digits(digits, n, width, pad);
+    }
+
+    /// @brief Append `value` in (lower case) hex, right aligned to `width` characters.
+    void append_hex(uint64_t value, int width = 0, char pad = '0') {
+        static const char HEX[] = "0123456789abcdef";
+        char digits[16];
+        int n = 0;
+        do {
+            digits[n++] = HEX[value & 0xf];
+            value >>= 4;
+        } while (value != 0);
+        append_digits(digits, n, width, pad);
+    }
+
+    /// @brief Write out everything buffered so far.
+    void flush() {
+        if (fd < 0) {
+            return;
+        }
+        size_t done = 0;
+        while (done < used) {
+            const long n = memlens_write(fd, &buf[done], (unsigned int)(used - done));
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        used = 0;
+    }
+
+    size_t size() const {
+        return used;
+    }
+
+    const char* data() const {
+        return &buf[0];
+    }
+
+    /// @brief Discard everything buffered so far.
+    void clear() {
+        used = 0;
+    }
+
+private:
+    int fd;
+    std::vector<char> buf;
+    size_t used;
+
+    /// @brief Append `n` digits stored least significant first.
+    void append_digits(const char *digits, int n, int width, char pad) {
+        char *out = reserve((width > n ? width : n));
+        int i = 0;
+        for (; i < width - n; i++) {
+            out[i] = pad;
+        }
+        while (n > 0) {
+            out[i++] = digits[--n];
+        }
+        used += i;
+    }
+};
+
+/// @brief How commands print their results.
+enum output_format_t {
+    FORMAT_TEXT,    // tables for humans (the default)
+    FORMAT_JSON,    // a JSON array of objects
+    FORMAT_NDJSON,  // a JSON object per line, for streams
+    FORMAT_CSV,     // a header line, then a line per record
+};
+
+/// @return the format named `name`, or false if there is no such format
+bool parse_output_format(const char *name, output_format_t &format) {
+    const struct {
+        const char *name;
+        output_format_t format;
+    } FORMATS[] = {
+        {"text", FORMAT_TEXT},
+        {"json", FORMAT_JSON},
+        {"ndjson", FORMAT_NDJSON},
+        {"csv", FORMAT_CSV},
+    };
+    for (size_t i = 0; i < sizeof(FORMATS) / sizeof(FORMATS[0]); i++) {
+        if (strcmp(name, FORMATS[i].name) == 0) {
+            format = FORMATS[i].format;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Writes records (flat objects of named fields) as JSON, NDJSON or CSV into
+/// an `output_buffer_t`.
+/// @details Call `begin()`, then a `field_*()` per field, then `end()` for each
+/// record; every record should have the same fields in the same order. For CSV,
+/// the header comes from the field names of the first record: its values are held
+/// back in a small side buffer until the record ends. Addresses are written as hex
+/// strings, since JSON numbers can't hold 64 bit values exactly.
+class record_writer_t {
+public:
+    record_writer_t(output_buffer_t &out, output_format_t format)
+        :out(out), format(format), records(0), fields(0), first_row(-1, 4096) {}
+
+    ~record_writer_t() {
+        finish();
+    }
+
+    void begin() {
+        fields = 0;
+        if (format == FORMAT_JSON) {
+            out.append(records == 0 ? "[\n{" : ",\n{");
+        } else if (format == FORMAT_NDJSON) {
+            out.append_char('{');
+        }
+    }
+
+    void end() {
+        if (format == FORMAT_CSV) {
+            out.append_char('\n');
+            if (records == 0) {
+                out.append(first_row.data(), first_row.size());
+                out.append_char('\n');
+                first_row.clear();
+            }
+        } else {
+            out.append(format == FORMAT_JSON ? "}" : "}\n");
+        }
+        records++;
+    }
+
+    /// @brief Close the JSON array (if any). Called by the destructor too, but
+    /// call it before flushing `out` for the last time.
+    void finish() {
+        if (format == FORMAT_JSON && records >= 0) {
+            out.append(records == 0 ? "[]\n" : "\n]\n");
+        }
+        records = -1;
+    }
+
+    void field_uint(const char *name, uint64_t value) {
+        value_out(name).append_dec(value);
+    }
+
+    void field_int(const char *name, int64_t value) {
+        output_buffer_t &o = value_out(name);
+        if (value < 0) {
+            o.append_char('-');
+        }
+        o.append_dec(value < 0 ? 0 - (uint64_t)value : (uint64_t)value);
+    }
+
+    /// @brief A number with a fraction, `precision` digits after the point.
+    void field_double(const char *name, double value, int precision = 3) {
+        output_buffer_t &o = value_out(name);
+        if (value != value || value - value != 0) {
+            o.append(format == FORMAT_CSV ? "" : "null"); // NaN & infinity aren't JSON
+            return;
+        }
+        char *p = o.reserve(32);
+        const int n = snprintf(p, 32, "%.*f", precision, value);
+        o.commit(n > 0 && n < 32 ? n : 0);
+    }
+
+    void field_bool(const char *name, bool value) {
+        value_out(name).append(value ? "true" : "false");
+    }
+
+    /// @brief An address (or any other bit pattern), as "0x..." hex.
+    void field_hex(const char *name, uint64_t value) {
+        output_buffer_t &o = value_out(name);
+        if (format != FORMAT_CSV) {
+            o.append_char('"');
+        }
+        o.append("0x");
+        o.append_hex(value);
+        if (format != FORMAT_CSV) {
+            o.append_char('"');
+        }
+    }
+
+    void field_str(const char *name, const char *value) {
+        field_str(name, value, strlen(value));
+    }
+
+    void field_str(const char *name, const char *value, size_t len) {
+        output_buffer_t &o = value_out(name);
+        if (format == FORMAT_CSV) {
+            // quoted only if needed, with quotes doubled
+            bool quote = false;
+            for (size_t i = 0; i < len && !quote; i++) {
+                quote = value[i] == ',' || value[i] == '"' || value[i] == '\n' || value[i] == '\r';
+            }
+            if (quote) {
+                o.append_char('"');
+                for (size_t i = 0; i < len; i++) {
+                    if (value[i] == '"') {
+                        o.append_char('"');
+                    }
+                    o.append_char(value[i]);
+                }
+                o.append_char('"');
+            } else {
+                o.append(value, len);
+            }
+            return;
+        }
+        static const char HEX[] = "0123456789abcdef";
+        // worst case, every byte becomes \u00XX
+        char *p = o.reserve(len * 6 + 2);
+        char *start = p;
+        *p++ = '"';
+        for (size_t i = 0; i < len; i++) {
+            const unsigned char c = (unsigned char)value[i];
+            if (c == '"' || c == '\\') {
+                *p++ = '\\';
+                *p++ = (char)c;
+            } else if (c < 0x20) {
+                memcpy(p, "\\u00", 4);
+                p[4] = HEX[c >> 4];
+                p[5] = HEX[c & 0xf];
+                p += 6;
+            } else {
+                *p++ = (char)c;
+            }
+        }
+        *p++ = '"';
+        o.commit(p - start);
+    }
+
+private:
+    output_buffer_t &out;
+    output_format_t format;
+    long records;               // records written so far, -1 once finished
+    size_t fields;              // fields of the current record so far
+    output_buffer_t first_row;  // CSV values of the first record, while its header is written
+
+    /// @brief Write the separator and name of the next field.
+    /// @return the buffer its value goes to
+    output_buffer_t& value_out(const char *name) {
+        if (format == FORMAT_CSV) {
+            if (records > 0) {
+                if (fields++ > 0) {
+                    out.append_char(',');
+                }
+                return out;
+            }
+            if (fields++ > 0) {
+                out.append_char(',');
+                first_row.append_char(',');
+            }
+            out.append(name);
+            return first_row;
+        }
+        if (fields++ > 0) {
+            out.append_char(',');
+        }
+        out.append_char('"');
+        out.append(name);
+        out.append("\":");
+        return out;
+    }
+};
+
+#endif // MEMLENS_OUTPUT_HPP
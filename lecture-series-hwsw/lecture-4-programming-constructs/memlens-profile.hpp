@@ -0,0 +1,597 @@
+/// @file
+/// @brief A sampling profiler: which regions & functions a program spends its time in.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// `memlens profile -- <cmd>` runs `<cmd>` with a software cpu-clock event (see
+/// `man perf_event_open`) on every online CPU it may run on, which interrupts it at
+/// a fixed rate and records its instruction pointer & call chain into a ring buffer
+/// we `mmap()`, one ring per CPU so that CPUs never contend with each other. The kernel also
+/// records every `mmap()` the program makes, from which we rebuild its memory
+/// layout. Samples are only counted while the program runs (each distinct stack
+/// once, in a hash table that doesn't allocate per sample), and resolved to regions
+/// & symbols at the end, once per distinct address.
+///
+/// Call chains are collected by the kernel following frame pointers, so programs
+/// built without them (`-fomit-frame-pointer` is the default at -O1 and up) give
+/// shallow or partly bogus stacks; build with `-fno-omit-frame-pointer`.
+
+#ifndef MEMLENS_PROFILE_HPP
+#define MEMLENS_PROFILE_HPP
+
+#include <csignal>
+#include <map>
+#include <string>
+#include <vector>
+#include "memlens.hpp"
+#include "memlens-output.hpp"
+#include "memlens-symbols.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/// @brief One CPU's ring buffer of perf records.
+class perf_ring_t {
+public:
+    perf_ring_t() :fd(-1), meta(nullptr), data(nullptr), data_size(0), map_size(0) {}
+
+    ~perf_ring_t() {
+        if (meta != nullptr) {
+            munmap(meta, map_size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    /// @brief Open the event described by `attr` for `pid` on `cpu`.
+    /// @return false (with errno set) if the event couldn't be opened
+    bool open(perf_event_attr &attr, int pid, int cpu) {
+        fd = (int)syscall(SYS_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+        return fd >= 0;
+    }
+
+    /// @brief Map the ring of the opened event, `pages` (a power of 2) pages long.
+    /// @return false (with errno set) if it couldn't be mapped
+    bool map(size_t pages) {
+        const size_t page_size = getpagesize();
+        data_size = pages * page_size;
+        map_size = data_size + page_size; // the first page holds the head & tail
+        void *map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        meta = (perf_event_mmap_page*)map;
+        data = (uint8_t*)map + page_size;
+        return true;
+    }
+
+    int file_descriptor() const {
+        return fd;
+    }
+
+    /// @brief Call `on_record(const perf_event_header*)` for every record the kernel
+    /// wrote since the last drain, then hand the space back to the kernel.
+    template <typename F>
+    void drain(F on_record) {
+        // the kernel publishes data_head after writing records, and reads
+        // data_tail before overwriting them
+        const uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+        uint64_t tail = meta->data_tail;
+        while (tail < head) {
+            const size_t offset = tail & (data_size - 1);
+            // records are 8 byte aligned, so only a record's body can wrap around
+            const perf_event_header *header = (const perf_event_header*)(data + offset);
+            if (offset + header->size > data_size) {
+                const size_t first = data_size - offset;
+                scratch.resize(header->size);
+                memcpy(&scratch[0], data + offset, first);
+                memcpy(&scratch[first], data, header->size - first);
+                header = (const perf_event_header*)&scratch[0];
+            }
+            if (header->size == 0) {
+                break; // can't happen, but would loop forever
+            }
+            on_record(header);
+            tail += header->size;
+        }
+        __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    perf_ring_t(const perf_ring_t&);
+    perf_ring_t& operator=(const perf_ring_t&);
+
+    int fd;
+    perf_event_mmap_page *meta;
+    uint8_t *data;
+    size_t data_size;
+    size_t map_size;
+    std::vector<uint8_t> scratch;   // for records that wrap around
+};
+
+/// @brief Sample counts per distinct (pid, call chain).
+/// @details Open addressing, with the call chains packed one after another in a
+/// single array, so that counting a sample whose stack was seen before (most of
+/// them) is a hash, a probe or two, and a compare.
+class stack_counts_t {
+public:
+    stack_counts_t() :used(0), total(0) {
+        slots.resize(4096);
+    }
+
+    /// @brief Count one sample of process `pid` with call chain `ips` (leaf first).
+    void add(uint32_t pid, const uint64_t *ips, size_t count) {
+        uint64_t hash = pid * 0x9e3779b97f4a7c15ull;
+        for (size_t i = 0; i < count; i++) {
+            hash = (hash ^ ips[i]) * 0x9e3779b97f4a7c15ull;
+            hash ^= hash >> 29;
+        }
+        total++;
+        const size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            slot_t &slot = slots[i];
+            if (slot.count == 0) {
+                slot.hash = hash;
+                slot.offset = frames.size();
+                slot.count = 1;
+                frames.push_back(pid);
+                frames.push_back(count);
+                frames.insert(frames.end(), ips, ips + count);
+                if (++used * 2 > slots.size()) {
+                    grow();
+                }
+                return;
+            }
+            if (slot.hash == hash && frames[slot.offset] == pid && frames[slot.offset + 1] == count
+                    && memcmp(&frames[slot.offset + 2], ips, count * sizeof(uint64_t)) == 0) {
+                slot.count++;
+                return;
+            }
+        }
+    }
+
+    /// @brief Call `f(pid, ips, ips_count, samples)` for every distinct stack.
+    template <typename F>
+    void for_each(F f) const {
+        for (std::vector<slot_t>::const_iterator it = slots.begin(); it != slots.end(); ++it) {
+            if (it->count > 0) {
+                f((uint32_t)frames[it->offset], &frames[it->offset + 2], (size_t)frames[it->offset + 1], it->count);
+            }
+        }
+    }
+
+    /// @return the number of samples counted
+    uint64_t samples() const {
+        return total;
+    }
+
+    /// @return the number of distinct stacks
+    size_t size() const {
+        return used;
+    }
+
+private:
+    typedef struct {
+        uint64_t hash;
+        uint64_t offset;    // into `frames`: pid, ips count, ips...
+        uint64_t count;     // 0 for an empty slot
+    } slot_t;
+
+    void grow() {
+        std::vector<slot_t> old(slots.size() * 2);
+        old.swap(slots);
+        const size_t mask = slots.size() - 1;
+        for (std::vector<slot_t>::const_iterator it = old.begin(); it != old.end(); ++it) {
+            if (it->count > 0) {
+                size_t i = it->hash & mask;
+                while (slots[i].count != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = *it;
+            }
+        }
+    }
+
+    std::vector<slot_t> slots;
+    std::vector<uint64_t> frames;
+    size_t used;
+    uint64_t total;
+};
+
+/// @brief The memory layout of a profiled process, rebuilt from the kernel's
+/// mmap records.
+typedef struct {
+    std::string comm;
+    std::vector<memory_region_t> regions;
+} profiled_process_t;
+
+/// @brief Record a new mapping of `filename` into `process`, replacing whatever
+/// it overlaps (e.g. the loader maps a whole library, then maps its segments over it).
+void add_profiled_mapping(profiled_process_t &process, uint64_t address, uint64_t len, uint32_t prot, const char *filename) {
+    static const interned_str_t NO_TYPE("-");
+    static const interned_str_t CODE("code");
+    std::vector<memory_region_t> &regions = process.regions;
+    const size_t count = regions.size();
+    for (size_t i = 0; i < count; i++) {
+        const uint64_t start = reinterpret_cast<uintptr_t>(regions[i].start_address);
+        const uint64_t end = start + regions[i].size;
+        if (start >= address + len || address >= end) {
+            continue;
+        }
+        // keep the parts on either side of the new mapping
+        if (end > address + len) {
+            memory_region_t after = regions[i];
+            after.start_address = reinterpret_cast<void*>(address + len);
+            after.size = end - (address + len);
+            regions.push_back(after);
+        }
+        regions[i].size = start < address ? address - start : 0;
+    }
+    regions.erase(std::remove_if(regions.begin(), regions.end(), [](const memory_region_t &region) {
+        return region.size == 0;
+    }), regions.end());
+    memory_region_t region = memory_region_t();
+    region.start_address = reinterpret_cast<void*>(address);
+    region.size = len;
+    region.permissions = (prot & PROT_READ ? PERM_READ : 0) | (prot & PROT_WRITE ? PERM_WRIT : 0) | (prot & PROT_EXEC ? PERM_EXEC : 0);
+    region.region_type = prot & PROT_EXEC ? CODE : NO_TYPE;
+    region.region_detail = strcmp(filename, "//anon") == 0 ? NO_TYPE : interned_str_t(filename);
+    regions.push_back(region);
+}
+
+/// @return the number of data pages to give each CPU's ring: as many as fit (with
+/// the ring's header page) in the per-CPU budget of locked memory the kernel grants
+/// perf rings without CAP_IPC_LOCK (perf_event_mlock_kb), as a power of 2, up to 256
+size_t perf_ring_pages() {
+    const size_t MAX_PAGES = 256;
+    size_t budget_kb = 516; // the kernel's default
+    FILE *f = fopen("/proc/sys/kernel/perf_event_mlock_kb", "r");
+    if (f != nullptr) {
+        unsigned long kb;
+        if (fscanf(f, "%lu", &kb) == 1) {
+            budget_kb = kb;
+        }
+        fclose(f);
+    }
+    const size_t budget_pages = budget_kb * 1024 / getpagesize();
+    size_t pages = 1;
+    while (pages * 2 <= MAX_PAGES && pages * 2 + 1 <= budget_pages) {
+        pages *= 2;
+    }
+    return pages;
+}
+
+/// @return the CPUs `pid` may run on that are online (from
+/// /sys/devices/system/cpu/online, e.g. "0-3,6"), in ascending order
+/// @details The program inherits our affinity, so unless it widens its own, it is
+/// never sampled anywhere else.
+std::vector<int> profiled_cpus(int pid) {
+    std::vector<int> online;
+    FILE *f = fopen("/sys/devices/system/cpu/online", "r");
+    if (f != nullptr) {
+        int first, last;
+        char sep = ',';
+        while (sep == ',' && fscanf(f, "%d", &first) == 1) {
+            last = first;
+            if (fscanf(f, "%c", &sep) == 1 && sep == '-' && (fscanf(f, "%d", &last) != 1 || fscanf(f, "%c", &sep) != 1)) {
+                sep = '\n';
+            }
+            for (int cpu = first; cpu <= last; cpu++) {
+                online.push_back(cpu);
+            }
+        }
+        fclose(f);
+    }
+    if (online.empty()) {
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++) {
+            online.push_back((int)cpu);
+        }
+    }
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    if (sched_getaffinity(pid, sizeof(affinity), &affinity) != 0) {
+        return online;
+    }
+    std::vector<int> cpus;
+    for (std::vector<int>::const_iterator cpu = online.begin(); cpu != online.end(); ++cpu) {
+        if (*cpu < CPU_SETSIZE && CPU_ISSET(*cpu, &affinity)) {
+            cpus.push_back(*cpu);
+        }
+    }
+    return cpus.empty() ? online : cpus;
+}
+
+/// @return true once `pid` has exited (reaping it, and setting `status`)
+bool profiled_child_exited(int pid, int &status) {
+    return waitpid(pid, &status, WNOHANG) == pid;
+}
+
+/// @brief Run `argv` (which must be nullptr terminated), sampling it `frequency`
+/// times per second of CPU time, and print where it spent that time.
+/// @param folded_path also write folded stacks (e.g. for flamegraph.pl) here,
+///   "-" for stdout, or nullptr for none
+/// @return the exit status of the program, or -1 if it couldn't be profiled
+int profile_command(char *const *argv, uint64_t frequency, const char *folded_path) {
+    // the child waits for the events to be set up before running the program
+    int ready[2];
+    if (pipe(ready) != 0) {
+        std::cerr << "pipe() failed: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    const pid_t child = fork();
+    if (child < 0) {
+        std::cerr << "fork() failed: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (child == 0) {
+        close(ready[1]);
+        char go;
+        if (read(ready[0], &go, 1) != 1) {
+            _exit(127); // the profiler gave up
+        }
+        close(ready[0]);
+        execvp(argv[0], argv);
+        fprintf(stderr, "failed to run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(ready[0]);
+
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.sample_period = 1000000000 / (frequency > 0 ? frequency : 1); // cpu-clock counts in ns
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;        // start at execvp(), not while memlens is still in the child
+    attr.inherit = 1;               // follow the threads & processes it starts
+    attr.exclude_kernel = 1;        // also works with perf_event_paranoid = 2
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.mmap = 1;
+    attr.mmap_data = 1;             // data mappings too, to find where each file starts
+    attr.mmap2 = 1;
+    attr.comm = 1;
+    attr.task = 1;
+    attr.watermark = 1;
+
+    // wake up when a ring is a quarter full, which at 10 kHz with deep stacks is
+    // every few tens of ms; the rest gives the kernel slack while we drain
+    const size_t ring_pages = perf_ring_pages();
+    attr.wakeup_watermark = ring_pages * getpagesize() / 4;
+    const std::vector<int> cpus = profiled_cpus(child);
+    std::vector<perf_ring_t*> rings;
+    for (std::vector<int>::const_iterator cpu = cpus.begin(); cpu != cpus.end(); ++cpu) {
+        perf_ring_t *ring = new perf_ring_t();
+        const bool opened = ring->open(attr, child, *cpu);
+        if (!opened || !ring->map(ring_pages)) {
+            const int error = errno;
+            delete ring;
+            if (!opened) {
+                std::cerr << "perf_event_open() on cpu " << *cpu << " failed: " << strerror(error)
+                    << (error == EACCES || error == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" : "") << std::endl;
+            } else {
+                std::cerr << "mmap() of a " << ring_pages << " page ring on cpu " << *cpu << " failed: " << strerror(error)
+                    << (error == EPERM || error == ENOMEM ? " (see /proc/sys/kernel/perf_event_mlock_kb & ulimit -l)" : "") << std::endl;
+            }
+            for (std::vector<perf_ring_t*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+                delete *it;
+            }
+            close(ready[1]);
+            int status;
+            waitpid(child, &status, 0);
+            return -1;
+        }
+        rings.push_back(ring);
+    }
+
+    std::map<uint32_t, profiled_process_t> processes;
+    processes[child].comm = argv[0];
+    stack_counts_t stacks;
+    uint64_t lost = 0;
+    const auto on_record = [&](const perf_event_header *header) {
+        const uint8_t *body = (const uint8_t*)(header + 1);
+        switch (header->type) {
+            case PERF_RECORD_SAMPLE: {
+                // pid, tid, nr, ips[nr]
+                const uint32_t pid = *(const uint32_t*)body;
+                const uint64_t count = *(const uint64_t*)(body + 8);
+                const uint64_t *ips = (const uint64_t*)(body + 16);
+                // user space call chains start with a PERF_CONTEXT_USER marker
+                size_t skip = 0;
+                while (skip < count && ips[skip] >= (uint64_t)PERF_CONTEXT_MAX) {
+                    skip++;
+                }
+                stacks.add(pid, ips + skip, count - skip);
+                break;
+            }
+            case PERF_RECORD_MMAP2: {
+                // pid, tid, addr, len, pgoff, maj, min, ino, ino_generation, prot, flags, filename
+                const uint32_t pid = *(const uint32_t*)body;
+                const uint64_t *fields = (const uint64_t*)(body + 8);
+                const uint32_t prot = *(const uint32_t*)(body + 56);
+                add_profiled_mapping(processes[pid], fields[0], fields[1], prot, (const char*)(body + 64));
+                break;
+            }
+            case PERF_RECORD_COMM: {
+                // pid, tid, comm
+                const uint32_t pid = *(const uint32_t*)body;
+                // on exec, the new program's mappings replace the old ones as they
+                // overlap (rather than clearing them here, as this record may be
+                // drained after those mmap records, which can be in another CPU's ring)
+                if (pid == *(const uint32_t*)(body + 4)) {
+                    processes[pid].comm = (const char*)(body + 8);
+                }
+                break;
+            }
+            case PERF_RECORD_FORK: {
+                // pid, ppid, tid, ptid: a new process starts with a copy of its parent's layout
+                const uint32_t pid = *(const uint32_t*)body;
+                const uint32_t ppid = *(const uint32_t*)(body + 4);
+                if (pid != ppid && processes.find(pid) == processes.end()) {
+                    profiled_process_t copy = processes[ppid];
+                    processes[pid] = copy;
+                }
+                break;
+            }
+            case PERF_RECORD_LOST:
+                lost += ((const uint64_t*)body)[1];
+                break;
+        }
+    };
+
+    // Ctrl-C goes to the program; we stay around to report
+    void (*previous_handler)(int) = std::signal(SIGINT, SIG_IGN);
+    if (write(ready[1], "x", 1) != 1) {
+        std::cerr << "failed to start the program" << std::endl;
+    }
+    close(ready[1]);
+
+    std::vector<pollfd> fds(rings.size());
+    for (size_t i = 0; i < rings.size(); i++) {
+        fds[i].fd = rings[i]->file_descriptor();
+        fds[i].events = POLLIN;
+    }
+    const uint64_t started = now_ns();
+    int status = 0;
+    bool exited = false;
+    while (!exited) {
+        poll(fds.empty() ? nullptr : &fds[0], fds.size(), 100);
+        exited = profiled_child_exited(child, status);
+        for (std::vector<perf_ring_t*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+            (*it)->drain(on_record);
+        }
+    }
+    const uint64_t elapsed_ns = now_ns() - started;
+    std::signal(SIGINT, previous_handler);
+    for (std::vector<perf_ring_t*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+        delete *it;
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    const double profiler_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3 + usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+
+    // resolve each distinct address once
+    std::map<uint32_t, symbol_table_t> symbols;
+    std::map<uint32_t, region_index_t> indexes;
+    for (std::map<uint32_t, profiled_process_t>::iterator it = processes.begin(); it != processes.end(); ++it) {
+        std::sort(it->second.regions.begin(), it->second.regions.end(), [](const memory_region_t &a, const memory_region_t &b) {
+            return a.start_address < b.start_address;
+        });
+        symbols[it->first].build(it->second.regions);
+        indexes[it->first].build(it->second.regions);
+    }
+    std::map<std::pair<uint32_t, uint64_t>, std::pair<std::string, std::string> > names; // -> (region, symbol)
+    const auto name_of = [&](uint32_t pid, uint64_t ip) -> const std::pair<std::string, std::string>& {
+        std::map<std::pair<uint32_t, uint64_t>, std::pair<std::string, std::string> >::iterator it = names.find(std::make_pair(pid, ip));
+        if (it != names.end()) {
+            return it->second;
+        }
+        std::pair<std::string, std::string> &name = names[std::make_pair(pid, ip)];
+        const memory_region_t *region = indexes[pid].find(reinterpret_cast<void*>(ip));
+        if (region == nullptr) {
+            name.first = "[unknown]";
+        } else if (region->region_detail.c_str()[0] == '/' || region->region_detail.c_str()[0] == '[') {
+            name.first = region->region_detail.c_str();
+        } else {
+            name.first = "[anon]";
+        }
+        size_t offset;
+        const elf_symbol_t *symbol = symbols[pid].find(reinterpret_cast<void*>(ip), offset);
+        if (symbol != nullptr) {
+            name.second = demangle(symbol->name);
+        } else {
+            const size_t slash = name.first.rfind('/');
+            name.second = "[" + (slash != std::string::npos ? name.first.substr(slash + 1) : name.first) + "]";
+        }
+        return name;
+    };
+
+    // self samples per region & symbol (of the leaf of each stack)
+    std::map<std::string, uint64_t> by_region;
+    std::map<std::string, uint64_t> by_symbol;
+    stacks.for_each([&](uint32_t pid, const uint64_t *ips, size_t count, uint64_t samples) {
+        if (count == 0) {
+            by_region["[no stack]"] += samples;
+            by_symbol["[no stack]"] += samples;
+            return;
+        }
+        const std::pair<std::string, std::string> &name = name_of(pid, ips[0]);
+        by_region[name.first] += samples;
+        by_symbol[name.second] += samples;
+    });
+
+    const uint64_t total = stacks.samples();
+    printf("%llu samples at %llu Hz over %.2f s (%zu distinct stacks, %llu lost), profiler used %.1f ms of CPU\n",
+        (unsigned long long)total, (unsigned long long)frequency, elapsed_ns / 1e9, stacks.size(), (unsigned long long)lost, profiler_ms);
+    const struct {
+        const char *title;
+        const std::map<std::string, uint64_t> *counts;
+    } TABLES[] = {{"region", &by_region}, {"symbol", &by_symbol}};
+    for (size_t t = 0; t < sizeof(TABLES) / sizeof(TABLES[0]); t++) {
+        std::vector<std::pair<uint64_t, std::string> > sorted;
+        for (std::map<std::string, uint64_t>::const_iterator it = TABLES[t].counts->begin(); it != TABLES[t].counts->end(); ++it) {
+            sorted.push_back(std::make_pair(it->second, it->first));
+        }
+        std::sort(sorted.rbegin(), sorted.rend());
+        printf("\n%8s %6s  %s\n", "samples", "%", TABLES[t].title);
+        for (size_t i = 0; i < sorted.size() && i < 20; i++) {
+            printf("%8llu %5.1f%%  %s\n", (unsigned long long)sorted[i].first, total > 0 ? sorted[i].first * 100.0 / total : 0.0, sorted[i].second.c_str());
+        }
+        if (sorted.size() > 20) {
+            printf("(%zu more)\n", sorted.size() - 20);
+        }
+    }
+
+    if (folded_path != nullptr) {
+        // one line per stack, "comm;outermost;...;innermost count"
+        const int fd = strcmp(folded_path, "-") == 0 ? 1 : ::open(folded_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "failed to open " << folded_path << ": " << strerror(errno) << std::endl;
+        } else {
+            // stacks that differ only in addresses within the same functions are one line
+            std::map<std::string, uint64_t> lines;
+            stacks.for_each([&](uint32_t pid, const uint64_t *ips, size_t count, uint64_t samples) {
+                std::string line = processes[pid].comm;
+                for (size_t i = count; i-- > 0; ) {
+                    // callers' addresses are return addresses, which point after the
+                    // call (and so possibly past the end of a function): use the call
+                    line += ';';
+                    line += name_of(pid, ips[i] - (i > 0)).second;
+                }
+                lines[line] += samples;
+            });
+            std::cout << std::flush;
+            output_buffer_t out(fd);
+            for (std::map<std::string, uint64_t>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+                out.append(it->first.data(), it->first.size());
+                out.append_char(' ');
+                out.append_dec(it->second);
+                out.append_char('\n');
+            }
+            out.flush();
+            if (fd != 1) {
+                close(fd);
+            }
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+#else
+int profile_command(char *const *argv, uint64_t frequency, const char *folded_path) {
+    (void)argv;
+    (void)frequency;
+    (void)folded_path;
+    std::cerr << "profile is not supported on this platform" << std::endl;
+    return -1;
+}
+#endif // __linux__
+
+#endif // MEMLENS_PROFILE_HPP
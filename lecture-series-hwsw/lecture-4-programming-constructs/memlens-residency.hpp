@@ -0,0 +1,262 @@
+/// @file
+/// @brief Page level residency of memory regions.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// The `resident` column of `memlens layout` tells us how much of a region is in
+/// RAM (smaps' Rss), but not which pages, nor what happened to the rest. Here we
+/// look at every page of a region: via `mincore()` for file mappings (is the page in
+/// the page cache?) and via /proc/<pid>/pagemap for everything (is it mapped,
+/// swapped out, soft-dirty, or part of a transparent huge page?).
+
+#ifndef MEMLENS_RESIDENCY_HPP
+#define MEMLENS_RESIDENCY_HPP
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "memlens.hpp"
+
+#ifdef __linux__
+#include <sys/mman.h>
+
+// see https://www.kernel.org/doc/Documentation/vm/pagemap.txt
+const uint64_t PAGEMAP_PRESENT = 1ull << 63;
+const uint64_t PAGEMAP_SWAPPED = 1ull << 62;
+const uint64_t PAGEMAP_SOFT_DIRTY = 1ull << 55;
+const uint64_t PAGEMAP_PFN_MASK = (1ull << 55) - 1;
+const uint64_t KPAGEFLAGS_THP = 1ull << 22;
+
+/// @brief Residency of the pages of a single region.
+typedef struct {
+    size_t pages;
+    size_t present_pages;       // in RAM (for file mappings: in the page cache)
+    size_t swapped_pages;
+    size_t soft_dirty_pages;    // written to since soft-dirty bits were last cleared
+    size_t thp_pages;           // backed by a transparent huge page
+    bool thp_estimated;         // true if `thp_pages` comes from smaps, not per page
+    std::vector<uint64_t> present;  // bitmap, bit i is set if page i is present
+} region_residency_t;
+
+/// @brief Walks the pages of regions, a chunk at a time, so that even huge regions
+/// are scanned with a fixed amount of memory (besides the 1 bit per page bitmap).
+class residency_scanner_t {
+public:
+    residency_scanner_t() :pid(0), pagemap_fd(-1), kpageflags_fd(-1), entries(CHUNK_PAGES), flags(CHUNK_PAGES), incore(CHUNK_PAGES) {}
+
+    ~residency_scanner_t() {
+        if (pagemap_fd >= 0) {
+            close(pagemap_fd);
+        }
+        if (kpageflags_fd >= 0) {
+            close(kpageflags_fd);
+        }
+    }
+
+    /// @param target the process to look at, or 0 for the current one
+    /// @return false if its pagemap can't be read
+    bool open(int target) {
+        char path[64];
+        pid = target;
+        pagemap_fd = ::open(proc_path(path, pid, "pagemap"), O_RDONLY | O_CLOEXEC);
+        if (pagemap_fd < 0) {
+            std::cerr << "failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        // needs CAP_SYS_ADMIN (without it, pagemap reports every PFN as 0 anyway)
+        kpageflags_fd = ::open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+        return true;
+    }
+
+    /// @brief Scan all pages of `region` into `out`.
+    void scan(const memory_region_t &region, region_residency_t &out) {
+        const size_t page_size = getpagesize();
+        const uintptr_t start = reinterpret_cast<uintptr_t>(region.start_address);
+        out.pages = region.size / page_size;
+        out.present_pages = out.swapped_pages = out.soft_dirty_pages = out.thp_pages = 0;
+        out.thp_estimated = true;
+        out.present.assign((out.pages + 63) / 64, 0);
+        // mincore() only works on our own address space
+        const bool use_mincore = pid == 0 && region.region_detail.c_str()[0] == '/';
+
+        for (size_t first = 0; first < out.pages; first += CHUNK_PAGES) {
+            const size_t count = out.pages - first < CHUNK_PAGES ? out.pages - first : CHUNK_PAGES;
+            const uintptr_t chunk_start = start + first * page_size;
+            const ssize_t n = pread(pagemap_fd, &entries[0], count * sizeof(uint64_t), chunk_start / page_size * sizeof(uint64_t));
+            const size_t valid = n > 0 ? n / sizeof(uint64_t) : 0;
+            const bool have_incore = use_mincore && mincore(reinterpret_cast<void*>(chunk_start), count * page_size, &incore[0]) == 0;
+            for (size_t i = 0; i < count; i++) {
+                const uint64_t entry = i < valid ? entries[i] : 0;
+                const bool present = have_incore ? (incore[i] & 1) : (entry & PAGEMAP_PRESENT) != 0;
+                if (present) {
+                    out.present[(first + i) / 64] |= 1ull << ((first + i) % 64);
+                    out.present_pages++;
+                }
+                out.swapped_pages += (entry & PAGEMAP_SWAPPED) != 0;
+                out.soft_dirty_pages += (entry & PAGEMAP_SOFT_DIRTY) != 0;
+            }
+            count_thp(valid, out);
+        }
+        if (out.thp_estimated) {
+            out.thp_pages = region.anon_huge_size / page_size;
+        }
+    }
+
+private:
+    static const size_t CHUNK_PAGES = 16384;
+
+    int pid;
+    int pagemap_fd;
+    int kpageflags_fd;
+    std::vector<uint64_t> entries;      // pagemap entries of the current chunk
+    std::vector<uint64_t> flags;        // kpageflags of a run of physical pages
+    std::vector<unsigned char> incore;  // mincore() output of the current chunk
+
+    /// @brief Count THP backed pages of the current chunk via /proc/kpageflags, if we can.
+    /// @details Pages that are next to each other physically (as all 512 of a THP
+    /// are) have their flags read with a single `pread()`.
+    void count_thp(size_t valid, region_residency_t &out) {
+        if (kpageflags_fd < 0) {
+            return;
+        }
+        size_t i = 0;
+        while (i < valid) {
+            const uint64_t pfn = entries[i] & PAGEMAP_PFN_MASK;
+            if (!(entries[i] & PAGEMAP_PRESENT) || pfn == 0) {
+                i++;
+                continue;
+            }
+            size_t run = 1;
+            while (i + run < valid && (entries[i + run] & PAGEMAP_PRESENT) && (entries[i + run] & PAGEMAP_PFN_MASK) == pfn + run) {
+                run++;
+            }
+            const ssize_t n = pread(kpageflags_fd, &flags[0], run * sizeof(uint64_t), pfn * sizeof(uint64_t));
+            for (ssize_t k = 0; k < n / (ssize_t)sizeof(uint64_t); k++) {
+                out.thp_estimated = false;
+                out.thp_pages += (flags[k] & KPAGEFLAGS_THP) != 0;
+            }
+            i += run;
+        }
+    }
+};
+
+/// @return a strip of `width` characters picturing which parts of `bitmap` are set,
+/// from ' ' (nothing) through '.', 'o' and 'O' to '#' (everything)
+std::string residency_strip(const std::vector<uint64_t> &bitmap, size_t pages, size_t width) {
+    static const char SHADES[] = " .oO#";
+    std::string strip(width, ' ');
+    if (pages == 0) {
+        return strip;
+    }
+    for (size_t cell = 0; cell < width; cell++) {
+        const size_t from = pages * cell / width;
+        const size_t to = pages * (cell + 1) / width;
+        if (to <= from) {
+            strip[cell] = cell > 0 ? strip[cell - 1] : ' ';
+            continue;
+        }
+        size_t set = 0;
+        for (size_t page = from; page < to; page++) {
+            set += (bitmap[page / 64] >> (page % 64)) & 1;
+        }
+        strip[cell] = SHADES[set == 0 ? 0 : set == to - from ? 4 : 1 + set * 3 / (to - from + 1)];
+    }
+    return strip;
+}
+#endif // __linux__
+
+/// @brief Print per-page residency of the memory regions of process `pid`.
+/// @param pid the process to look at, or 0 for the current one
+/// @param name only show the region with this type (or containing this address),
+///   or all regions if empty
+void print_memory_residency(int pid, const std::string &name) {
+#ifdef __linux__
+    std::vector<memory_region_t> regions;
+    if (!load_process_memory_layout(pid, regions, true)) {
+        return;
+    }
+    residency_scanner_t scanner;
+    if (!scanner.open(pid)) {
+        return;
+    }
+    const memory_region_t *only = nullptr;
+    if (!name.empty()) {
+        region_index_t index;
+        index.build(regions);
+        only = index.find_by_type(name.data(), name.size());
+        if (only == nullptr) {
+            only = index.find((void*)std::stoull(name, nullptr, 0));
+        }
+        if (only == nullptr) {
+            std::cerr << "no such region: " << name << std::endl;
+            return;
+        }
+    }
+
+    const size_t page_size = getpagesize();
+    region_residency_t residency;
+    if (OUTPUT_FORMAT != FORMAT_TEXT) {
+        output_buffer_t out(1);
+        record_writer_t records(out, OUTPUT_FORMAT);
+        for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+            if (only != nullptr && &*it != only) {
+                continue;
+            }
+            scanner.scan(*it, residency);
+            records.begin();
+            records.field_hex("start", reinterpret_cast<uintptr_t>(it->start_address));
+            records.field_hex("end", reinterpret_cast<uintptr_t>(it->start_address) + it->size);
+            records.field_uint("size", it->size);
+            records.field_uint("present", residency.present_pages * page_size);
+            records.field_uint("swapped", residency.swapped_pages * page_size);
+            records.field_uint("soft_dirty", residency.soft_dirty_pages * page_size);
+            records.field_uint("thp", residency.thp_pages * page_size);
+            records.field_bool("thp_estimated", residency.thp_estimated);
+            records.field_str("type", it->region_type.c_str());
+            records.field_str("detail", it->region_detail.c_str());
+            records.end();
+        }
+        records.finish();
+        return;
+    }
+
+    printf("%16s-%-16s %5s %8s %8s %8s %8s  %-8s %s\n", "start_addr ", " end_addr", "range", "present", "swapped", "sdirty", "thp", "type", "pages");
+    printf("------------------------------------------------------------\n");
+    size_t totals[4] = {0, 0, 0, 0};
+    bool thp_estimated = false;
+    for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+        if (only != nullptr && &*it != only) {
+            continue;
+        }
+        scanner.scan(*it, residency);
+        totals[0] += residency.present_pages;
+        totals[1] += residency.swapped_pages;
+        totals[2] += residency.soft_dirty_pages;
+        totals[3] += residency.thp_pages;
+        thp_estimated |= residency.thp_estimated && residency.thp_pages > 0;
+        printf("%16lx-%-16lx %5s %8s %8s %8s %8s%s %-8s [%s]\n",
+            (unsigned long)reinterpret_cast<uintptr_t>(it->start_address),
+            (unsigned long)reinterpret_cast<uintptr_t>(it->start_address) + it->size,
+            size_str(it->size).c_str(),
+            size_str(residency.present_pages * page_size).c_str(),
+            size_str(residency.swapped_pages * page_size).c_str(),
+            size_str(residency.soft_dirty_pages * page_size).c_str(),
+            size_str(residency.thp_pages * page_size).c_str(),
+            residency.thp_estimated && residency.thp_pages > 0 ? "*" : " ",
+            it->region_type.c_str(),
+            residency_strip(residency.present, residency.pages, 32).c_str());
+    }
+    printf("%34s %5s %8s %8s %8s %8s\n", "total", "",
+        size_str(totals[0] * page_size).c_str(),
+        size_str(totals[1] * page_size).c_str(),
+        size_str(totals[2] * page_size).c_str(),
+        size_str(totals[3] * page_size).c_str());
+    if (thp_estimated) {
+        printf("* THP size from smaps (per page THP needs CAP_SYS_ADMIN for /proc/kpageflags)\n");
+    }
+#else
+    (void)pid;
+    (void)name;
+    std::cerr << "residency is only supported on linux" << std::endl;
+#endif
+}
+
+#endif // MEMLENS_RESIDENCY_HPP
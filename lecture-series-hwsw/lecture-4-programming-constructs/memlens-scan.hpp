@@ -0,0 +1,425 @@
+/// @file
+/// @brief Scanning memory in parallel: pattern search & zero page detection.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// A single thread copying & looking at memory tops out well below what the memory
+/// system can deliver, so the ranges to scan are split into page aligned chunks, and
+/// a thread per CPU works through them. Each thread starts with an equal share of
+/// the chunks; one that runs out of work steals half of what's left of another
+/// thread's share, so that a few slow chunks (e.g. pages that have to be faulted in)
+/// don't leave the other threads idle. Results are kept per chunk, and merged in
+/// address order at the end, so the output doesn't depend on the scheduling.
+
+#ifndef MEMLENS_SCAN_HPP
+#define MEMLENS_SCAN_HPP
+
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memlens.hpp"
+
+/// @brief A range of addresses to scan.
+typedef struct {
+    uintptr_t address;
+    size_t size;
+} scan_range_t;
+
+/// @brief Hands out chunk indices to worker threads, with work stealing.
+/// @details Each worker owns a range [begin, end) of chunks, packed into a single
+/// 64 bit word so that it can be updated with one compare-and-swap: the owner
+/// takes chunks from the front, thieves take the back half.
+class chunk_scheduler_t {
+public:
+    chunk_scheduler_t(size_t chunks, size_t workers) :ranges(workers) {
+        for (size_t w = 0; w < workers; w++) {
+            ranges[w].value.store(pack(chunks * w / workers, chunks * (w + 1) / workers));
+        }
+    }
+
+    /// @brief Get the next chunk for `worker` to scan.
+    /// @return false once there are no chunks left anywhere
+    bool next(size_t worker, size_t &chunk) {
+        std::atomic<uint64_t> &own = ranges[worker].value;
+        uint64_t range = own.load(std::memory_order_acquire);
+        while (begin_of(range) < end_of(range)) {
+            if (own.compare_exchange_weak(range, pack(begin_of(range) + 1, end_of(range)), std::memory_order_acq_rel)) {
+                chunk = begin_of(range);
+                return true;
+            }
+        }
+        // out of work: steal the back half of someone else's
+        for (size_t i = 1; i < ranges.size(); i++) {
+            std::atomic<uint64_t> &victim = ranges[(worker + i) % ranges.size()].value;
+            uint64_t theirs = victim.load(std::memory_order_acquire);
+            while (begin_of(theirs) < end_of(theirs)) {
+                const uint64_t middle = begin_of(theirs) + (end_of(theirs) - begin_of(theirs)) / 2;
+                if (victim.compare_exchange_weak(theirs, pack(begin_of(theirs), middle), std::memory_order_acq_rel)) {
+                    // keep chunk `middle`, and own the rest of what was stolen
+                    own.store(pack(middle + 1, end_of(theirs)), std::memory_order_release);
+                    chunk = middle;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+private:
+    static uint64_t pack(uint64_t begin, uint64_t end) {
+        return begin | end << 32;
+    }
+
+    static uint64_t begin_of(uint64_t range) {
+        return range & 0xffffffffu;
+    }
+
+    static uint64_t end_of(uint64_t range) {
+        return range >> 32;
+    }
+
+    struct alignas(64) padded_range_t {
+        std::atomic<uint64_t> value;
+    };
+    std::vector<padded_range_t> ranges;
+};
+
+/// @return the number of chunks of `chunk_size` (aligned to `chunk_size`) that
+/// `range` is split into
+size_t scan_chunks_of(const scan_range_t &range, size_t chunk_size) {
+    return range.size == 0 ? 0 : (range.address + range.size - 1) / chunk_size - range.address / chunk_size + 1;
+}
+
+/// @return the number of threads to scan with by default
+size_t default_scan_threads() {
+    const unsigned cpus = std::thread::hardware_concurrency();
+    return cpus > 0 ? cpus : 1;
+}
+
+/// @brief Scan `ranges` of the process `attached` is attached to, in parallel.
+/// @details Each thread reads with a reader of its own that shares the layout of
+/// `attached`, which is only read. Calls `scan(chunk, address, bytes, size, available)` for every chunk,
+/// from `threads` threads, where `chunk` is the index of the chunk (chunks are
+/// numbered in the order of `ranges`, then by address), `bytes` is a copy of the
+/// `size` bytes at `address`, followed by up to `overlap` bytes of the next chunk in
+/// the same range (`available` in total), for matches that straddle chunks. Pages
+/// that can't be read are left out: `scan` is then called once for each run of
+/// pages of the chunk that could be, so it may be called more than once per chunk
+/// (from the same thread).
+/// @param chunk_size bytes per chunk, a multiple of the page size
+/// @return the number of bytes that couldn't be read
+template <typename F>
+size_t parallel_scan(const process_reader_t &attached, const std::vector<scan_range_t> &ranges, size_t chunk_size, size_t overlap, size_t threads, F scan) {
+    std::vector<scan_range_t> chunks;
+    std::vector<uintptr_t> range_ends;
+    for (std::vector<scan_range_t>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        // chunk boundaries are aligned to chunk_size, so that chunks are page aligned
+        // (and the same, whichever range they're in)
+        for (uintptr_t address = it->address; address < it->address + it->size; ) {
+            const uintptr_t boundary = (address / chunk_size + 1) * chunk_size;
+            const uintptr_t end = boundary < it->address + it->size ? boundary : it->address + it->size;
+            const scan_range_t chunk = {address, end - address};
+            chunks.push_back(chunk);
+            range_ends.push_back(it->address + it->size);
+            address = end;
+        }
+    }
+    if (chunks.empty()) {
+        return 0;
+    }
+    if (threads > chunks.size()) {
+        threads = chunks.size();
+    }
+
+    const size_t page_size = system_page_size();
+    std::atomic<size_t> unreadable(0);
+    chunk_scheduler_t scheduler(chunks.size(), threads);
+    const auto worker = [&](size_t w) {
+        // readers aren't thread safe (they batch up requests), so one per thread
+        process_reader_t reader;
+        reader.share(attached);
+        std::vector<uint8_t> buf(chunk_size + overlap);
+        size_t chunk;
+        while (scheduler.next(w, chunk)) {
+            const scan_range_t &c = chunks[chunk];
+            const size_t tail = range_ends[chunk] - (c.address + c.size);
+            const size_t available = c.size + (tail < overlap ? tail : overlap);
+            if (reader.read(reinterpret_cast<void*>(c.address), &buf[0], available) == available) {
+                scan(chunk, c.address, (const uint8_t*)&buf[0], c.size, available);
+                continue;
+            }
+            // some of it couldn't be read (and came back as zeros): read it again a
+            // page at a time, and scan the runs of pages that could be read
+            size_t offset = 0;
+            while (offset < c.size) {
+                size_t run = offset;
+                size_t piece = 0;
+                while (run < available) {
+                    piece = page_size - (c.address + run) % page_size;
+                    piece = piece < available - run ? piece : available - run;
+                    if (reader.read(reinterpret_cast<void*>(c.address + run), &buf[run], piece) != piece) {
+                        break;
+                    }
+                    run += piece;
+                }
+                if (run > offset) {
+                    scan(chunk, c.address + offset, (const uint8_t*)&buf[offset], (run < c.size ? run : c.size) - offset, run - offset);
+                }
+                if (run < c.size) {
+                    piece = piece < c.size - run ? piece : c.size - run;
+                    unreadable.fetch_add(piece, std::memory_order_relaxed);
+                    run += piece;
+                }
+                offset = run;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t w = 1; w < threads; w++) {
+        workers.push_back(std::thread(worker, w));
+    }
+    worker(0);
+    for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+    }
+    return unreadable.load();
+}
+
+/// @return what to add to the summary of a scan that couldn't read `unreadable` bytes
+std::string unreadable_str(size_t unreadable) {
+    return unreadable > 0 ? " (" + size_str(unreadable) + " couldn't be read, skipped)" : "";
+}
+
+/// @return the bytes of `hex`, e.g. "deadbeef", "de ad be ef" or "0xdeadbeef"
+std::string parse_hex_bytes(const std::string &hex) {
+    std::string bytes;
+    std::string digits;
+    for (size_t i = 0; i < hex.size(); i++) {
+        if (hex[i] == '0' && i + 1 < hex.size() && (hex[i + 1] == 'x' || hex[i + 1] == 'X') && digits.empty()) {
+            i++;
+        } else if (isxdigit((unsigned char)hex[i])) {
+            digits += hex[i];
+        } else if (hex[i] != ' ' && hex[i] != ':') {
+            show_usage(("invalid hex pattern: " + hex).c_str());
+        }
+    }
+    if (digits.empty() || digits.size() % 2 != 0) {
+        show_usage(("invalid hex pattern: " + hex).c_str());
+    }
+    for (size_t i = 0; i < digits.size(); i += 2) {
+        bytes += (char)std::stoul(digits.substr(i, 2), nullptr, 16);
+    }
+    return bytes;
+}
+
+/// @brief Find every occurrence of `pattern` within `ranges` (of `regions`) of
+/// process `pid`, read with `reader`, and print them (up to `limit`, unless
+/// `--format` is given) in address order.
+void scan_for_pattern(const process_reader_t &reader, int pid, const std::vector<scan_range_t> &ranges, const std::vector<const memory_region_t*> &regions,
+        const std::string &pattern, size_t threads, size_t limit) {
+    const size_t CHUNK_SIZE = 1024 * 1024;
+    // chunks are numbered up front, so each has its own slot for its results
+    std::vector<size_t> chunk_first(ranges.size() + 1, 0); // first chunk of each range
+    for (size_t i = 0; i < ranges.size(); i++) {
+        chunk_first[i + 1] = chunk_first[i] + scan_chunks_of(ranges[i], CHUNK_SIZE);
+    }
+    std::vector<std::vector<uintptr_t> > matches(chunk_first.back());
+
+    // look for one byte of the pattern with memchr() (vectorized), then compare the
+    // rest; memory is mostly zeros, so look for a byte that isn't 0 (or 0xff)
+    size_t anchor = 0;
+    while (anchor < pattern.size() && (pattern[anchor] == '\0' || pattern[anchor] == '\xff')) {
+        anchor++;
+    }
+    anchor = anchor < pattern.size() ? anchor : 0;
+    const char anchor_byte = pattern[anchor];
+
+    const uint64_t start = now_ns();
+    const size_t unreadable = parallel_scan(reader, ranges, CHUNK_SIZE, pattern.size() - 1, threads,
+        [&](size_t chunk, uintptr_t address, const uint8_t *bytes, size_t size, size_t available) {
+            // matches must start within this chunk, but may end in the next one
+            const uint8_t *p = bytes + anchor;
+            const uint8_t *last = bytes + (available >= pattern.size() ? available - pattern.size() : 0) + anchor;
+            const uint8_t *limit = bytes + size + anchor;
+            while (available >= pattern.size() && p <= last && p < limit) {
+                const uint8_t *found = (const uint8_t*)memchr(p, anchor_byte, last - p + 1);
+                if (found == nullptr || found >= limit) {
+                    break;
+                }
+                if (memcmp(found - anchor, pattern.data(), pattern.size()) == 0) {
+                    matches[chunk].push_back(address + (found - anchor - bytes));
+                }
+                p = found + 1;
+            }
+        });
+    const uint64_t elapsed = now_ns() - start;
+
+    size_t total = 0;
+    size_t bytes = 0;
+    for (std::vector<scan_range_t>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+        bytes += it->size;
+    }
+    if (OUTPUT_FORMAT != FORMAT_TEXT) {
+        std::cout << std::flush;
+        output_buffer_t out(1);
+        record_writer_t records(out, OUTPUT_FORMAT);
+        for (size_t i = 0; i < ranges.size(); i++) {
+            const uintptr_t region_start = reinterpret_cast<uintptr_t>(regions[i]->start_address);
+            for (size_t chunk = chunk_first[i]; chunk < chunk_first[i + 1]; chunk++) {
+                for (std::vector<uintptr_t>::const_iterator it = matches[chunk].begin(); it != matches[chunk].end(); ++it, ++total) {
+                    records.begin();
+                    records.field_hex("address", *it);
+                    records.field_str("region", regions[i]->region_type.c_str());
+                    records.field_uint("offset", *it - region_start);
+                    records.end();
+                }
+            }
+        }
+        records.finish();
+        out.flush();
+        fprintf(stderr, "%zu matches in %s%s, scanned in %.1f ms (%.2f GB/s, %zu threads)\n", total, size_str(bytes).c_str(), unreadable_str(unreadable).c_str(),
+            elapsed / 1e6, elapsed > 0 ? bytes / (double)elapsed : 0.0, threads);
+        return;
+    }
+    for (std::vector<std::vector<uintptr_t> >::const_iterator chunk = matches.begin(); chunk != matches.end(); ++chunk) {
+        for (std::vector<uintptr_t>::const_iterator it = chunk->begin(); it != chunk->end(); ++it, ++total) {
+            if (total < limit) {
+                std::cout << (pid == 0 ? named_address(reinterpret_cast<void*>(*it)) : named_address(reinterpret_cast<void*>(*it), nullptr)) << std::endl;
+            }
+        }
+    }
+    if (total > limit) {
+        std::cout << "(" << total - limit << " more)" << std::endl;
+    }
+    printf("%zu matches in %s%s, scanned in %.1f ms (%.2f GB/s, %zu threads)\n", total, size_str(bytes).c_str(), unreadable_str(unreadable).c_str(),
+        elapsed / 1e6, elapsed > 0 ? bytes / (double)elapsed : 0.0, threads);
+}
+
+/// @brief Find the pages of `ranges` that are all zeros, read with `reader`, and
+/// print how many each region has.
+void scan_for_zero_pages(const process_reader_t &reader, const std::vector<scan_range_t> &ranges, const std::vector<const memory_region_t*> &regions, size_t threads) {
+    const size_t CHUNK_SIZE = 1024 * 1024;
+    const size_t page_size = system_page_size();
+    const std::vector<uint8_t> zeros(page_size, 0);
+    std::vector<size_t> chunk_first(ranges.size() + 1, 0); // first chunk of each range
+    for (size_t i = 0; i < ranges.size(); i++) {
+        chunk_first[i + 1] = chunk_first[i] + scan_chunks_of(ranges[i], CHUNK_SIZE);
+    }
+    std::vector<size_t> zero_pages(chunk_first.back(), 0);
+
+    const uint64_t start = now_ns();
+    const size_t unreadable = parallel_scan(reader, ranges, CHUNK_SIZE, 0, threads,
+        [&](size_t chunk, uintptr_t, const uint8_t *bytes, size_t size, size_t) {
+            size_t count = 0;
+            for (size_t offset = 0; offset < size; offset += page_size) {
+                // memcmp() is vectorized, so this runs at memory speed
+                count += memcmp(bytes + offset, &zeros[0], page_size) == 0;
+            }
+            zero_pages[chunk] += count;
+        });
+    const uint64_t elapsed = now_ns() - start;
+
+    if (OUTPUT_FORMAT != FORMAT_TEXT) {
+        std::cout << std::flush;
+        output_buffer_t out(1);
+        record_writer_t records(out, OUTPUT_FORMAT);
+        size_t total_pages = 0;
+        size_t total_zero = 0;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            size_t zero = 0;
+            for (size_t c = chunk_first[i]; c < chunk_first[i + 1]; c++) {
+                zero += zero_pages[c];
+            }
+            total_pages += ranges[i].size / page_size;
+            total_zero += zero;
+            records.begin();
+            records.field_hex("start", ranges[i].address);
+            records.field_hex("end", ranges[i].address + ranges[i].size);
+            records.field_uint("pages", ranges[i].size / page_size);
+            records.field_uint("zero_pages", zero);
+            records.field_str("type", regions[i]->region_type.c_str());
+            records.field_str("detail", regions[i]->region_detail.c_str());
+            records.end();
+        }
+        records.finish();
+        out.flush();
+        fprintf(stderr, "%zu of %zu pages are all zeros%s, scanned in %.1f ms (%.2f GB/s, %zu threads)\n", total_zero, total_pages,
+            unreadable_str(unreadable).c_str(), elapsed / 1e6, elapsed > 0 ? total_pages * page_size / (double)elapsed : 0.0, threads);
+        return;
+    }
+    std::cout << std::setw(16) << std::right << "start_addr " << "-" << std::setw(16) << std::left << " end_addr"
+        << " " << std::setw(8) << std::right << "pages" << " " << std::setw(10) << std::right << "zero pages"
+        << " " << std::setw(6) << std::right << "zero%" << "  " << "region" << std::endl;
+    size_t total_pages = 0;
+    size_t total_zero = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        size_t zero = 0;
+        for (size_t c = chunk_first[i]; c < chunk_first[i + 1]; c++) {
+            zero += zero_pages[c];
+        }
+        const size_t pages = ranges[i].size / page_size;
+        total_pages += pages;
+        total_zero += zero;
+        char percent[16];
+        snprintf(percent, sizeof(percent), "%.1f%%", pages > 0 ? zero * 100.0 / pages : 0.0);
+        std::cout << std::hex << std::setw(16) << std::right << ranges[i].address << "-" << std::setw(16) << std::left << ranges[i].address + ranges[i].size
+            << std::dec << " " << std::setw(8) << std::right << pages << " " << std::setw(10) << std::right << zero
+            << " " << std::setw(6) << std::right << percent << "  " << regions[i]->region_type
+            << (regions[i]->region_detail.c_str()[0] == '/' ? "  " : "") << (regions[i]->region_detail.c_str()[0] == '/' ? regions[i]->region_detail.c_str() : "")
+            << std::endl;
+    }
+    printf("%zu of %zu pages (%s of %s) are all zeros%s, scanned in %.1f ms (%.2f GB/s, %zu threads)\n", total_zero, total_pages,
+        size_str(total_zero * page_size).c_str(), size_str(total_pages * page_size).c_str(), unreadable_str(unreadable).c_str(), elapsed / 1e6,
+        elapsed > 0 ? total_pages * page_size / (double)elapsed : 0.0, threads);
+}
+
+/// @brief `memlens scan`: search the regions of process `pid` named `name` (a region
+/// type, or "all" for every readable region) or the `size` bytes at address `name`.
+void scan_memory(int pid, const std::string &name, size_t size, const std::string &pattern, bool zero_pages, size_t threads) {
+    process_reader_t reader;
+    if (!reader.attach(pid)) {
+        return;
+    }
+    const std::vector<memory_region_t> &layout = reader.layout();
+    std::vector<scan_range_t> ranges;
+    std::vector<const memory_region_t*> regions;
+    const size_t page_size = system_page_size();
+    for (std::vector<memory_region_t>::const_iterator it = layout.begin(); it != layout.end(); ++it) {
+        // [vvar] & co can't be read even when they say they can
+        if ((it->permissions & PERM_READ) && (name == "all" ? strncmp(it->region_type.c_str(), "vvar", 4) != 0 && it->region_type != "vsyscall" : it->region_type == name)) {
+            const scan_range_t range = {reinterpret_cast<uintptr_t>(it->start_address), it->size};
+            ranges.push_back(range);
+            regions.push_back(&*it);
+        }
+    }
+    if (ranges.empty() && name != "all") {
+        // an address (and size), rounded out to pages for --zero-pages
+        char *end = nullptr;
+        uintptr_t address = strtoull(name.c_str(), &end, 0);
+        if (name.empty() || *end != '\0') {
+            show_usage(("no readable region named " + name + " to scan, and it isn't an address").c_str());
+        }
+        size = size > 0 ? size : page_size;
+        if (zero_pages) {
+            size = (address % page_size + size + page_size - 1) / page_size * page_size;
+            address -= address % page_size;
+        }
+        const scan_range_t range = {address, size};
+        ranges.push_back(range);
+        const memory_region_t *region = reader.layout_index().find(reinterpret_cast<void*>(address));
+        if (region == nullptr) {
+            std::cerr << "no region at " << name << std::endl;
+            return;
+        }
+        regions.push_back(region);
+    }
+    if (zero_pages) {
+        scan_for_zero_pages(reader, ranges, regions, threads);
+    }
+    if (!pattern.empty()) {
+        scan_for_pattern(reader, pid, ranges, regions, pattern, threads, 100);
+    }
+}
+
+#endif // MEMLENS_SCAN_HPP
@@ -0,0 +1,610 @@
+/// @file
+/// @brief Binary snapshots of a process' memory layout (and optionally its pages).
+/// @details Going through this file is not necessary for understanding the lecture.
+/// `memlens snapshot` writes the region table, the strings it refers to, and
+/// optionally per-page residency bitmaps and page contents into a single file, with
+/// `writev()` as it goes. The file is laid out so that it can be `mmap()`ed and
+/// used in place: every section is at a fixed offset given in the header, records
+/// have a fixed size, and pointers are stored as offsets into their section.
+///
+///     [header][region records][strings][residency bitmaps][pad to page][contents][unreadable bitmaps]
+///
+/// Contents are streamed after everything before them is written; pages that turn
+/// out not to be readable are left as zeros and recorded in the unreadable bitmaps,
+/// after which the header & region records are written again.
+///
+/// Numbers are stored in native byte order (checked via `byte_order`). Versions
+/// only ever append fields to the header & region records, and readers step
+/// through records by the sizes recorded in the header, so that older readers can
+/// open newer files.
+
+#ifndef MEMLENS_SNAPSHOT_HPP
+#define MEMLENS_SNAPSHOT_HPP
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "memlens.hpp"
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define MEMLENS_SNAPSHOT_SUPPORTED 1
+#endif
+
+const char SNAPSHOT_MAGIC[8] = {'M', 'E', 'M', 'L', 'E', 'N', 'S', '\0'};
+const uint32_t SNAPSHOT_VERSION = 2;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+const uint64_t SNAPSHOT_NONE = ~0ull;
+
+// snapshot_header_t::flags
+const uint32_t SNAPSHOT_RESIDENCY = 1;  // regions have residency bitmaps
+const uint32_t SNAPSHOT_PAGES = 2;      // readable regions have their contents
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // SNAPSHOT_BYTE_ORDER, as written by the writer
+    uint32_t header_size;       // sizeof(snapshot_header_t) of the writer
+    uint32_t region_size;       // sizeof(snapshot_region_t) of the writer
+    uint32_t flags;
+    int32_t pid;                // 0 if memlens snapshotted itself
+    uint32_t page_size;
+    uint32_t reserved;
+    uint64_t time_ns;           // wall clock time of the snapshot, since the epoch
+    uint64_t region_count;
+    uint64_t regions_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t residency_offset;
+    uint64_t residency_size;
+    uint64_t pages_offset;      // page aligned
+    uint64_t pages_size;
+    // version 2
+    uint64_t unreadable_offset;
+    uint64_t unreadable_size;
+} snapshot_header_t;
+
+typedef struct {
+    uint64_t start_address;
+    uint64_t size;
+    uint64_t resident_size;
+    uint64_t pss_size;
+    uint64_t shared_clean_size;
+    uint64_t shared_dirty_size;
+    uint64_t private_clean_size;
+    uint64_t private_dirty_size;
+    uint64_t swap_size;
+    uint64_t anon_huge_size;
+    uint64_t residency_offset;  // into the residency section (1 bit per page), or SNAPSHOT_NONE
+    uint64_t contents_offset;   // into the pages section (`size` bytes), or SNAPSHOT_NONE
+    uint32_t type_offset;       // into the strings section (NUL terminated)
+    uint32_t detail_offset;
+    uint8_t permissions;
+    uint8_t reserved[7];
+    // version 2
+    uint64_t unreadable_offset; // into the unreadable section (1 bit per page of contents), or SNAPSHOT_NONE
+} snapshot_region_t;
+
+// what version 1 wrote, which is still read
+const uint32_t SNAPSHOT_V1_HEADER_SIZE = offsetof(snapshot_header_t, unreadable_offset);
+const uint32_t SNAPSHOT_V1_REGION_SIZE = offsetof(snapshot_region_t, unreadable_offset);
+
+#ifdef MEMLENS_SNAPSHOT_SUPPORTED
+/// @brief Streams buffers to a file with `writev()`, many at a time.
+/// @details Queued buffers must stay valid until the next `flush()`.
+class snapshot_writer_t {
+public:
+    explicit snapshot_writer_t(int fd) :fd(fd), count(0), written(0), failed(false) {}
+
+    void queue(const void *data, size_t len) {
+        if (len == 0) {
+            return;
+        }
+        if (count == MAX_IOV) {
+            flush();
+        }
+        iov[count].iov_base = const_cast<void*>(data);
+        iov[count].iov_len = len;
+        count++;
+    }
+
+    /// @brief Queue zero bytes up to `offset` (e.g. the next page boundary, however
+    /// large pages are).
+    void pad_to(uint64_t offset) {
+        static const char ZEROES[4096] = {0};
+        for (uint64_t pos = written + queued(); pos < offset; ) {
+            const size_t len = offset - pos < sizeof(ZEROES) ? offset - pos : sizeof(ZEROES);
+            queue(ZEROES, len);
+            pos += len;
+        }
+    }
+
+    /// @brief Write out everything queued so far.
+    /// @return false if writing failed (now, or earlier)
+    bool flush() {
+        struct iovec *next = iov;
+        size_t left = count;
+        while (left > 0 && !failed) {
+            const ssize_t n = writev(fd, next, left < IOV_MAX ? left : IOV_MAX);
+            if (n <= 0) {
+                failed = true;
+                break;
+            }
+            written += n;
+            // skip over what was written, which may end in the middle of a buffer
+            size_t done = n;
+            while (left > 0 && done >= next->iov_len) {
+                done -= next->iov_len;
+                next++;
+                left--;
+            }
+            if (left > 0) {
+                next->iov_base = (uint8_t*)next->iov_base + done;
+                next->iov_len -= done;
+            }
+        }
+        count = 0;
+        return !failed;
+    }
+
+private:
+    static const size_t MAX_IOV = 1024;
+
+    int fd;
+    struct iovec iov[MAX_IOV];
+    size_t count;
+    uint64_t written;
+    bool failed;
+
+    uint64_t queued() const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+};
+
+inline uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/// @brief Write a snapshot of the memory layout of process `pid` to `path`.
+/// @param pid the process to snapshot, or 0 for the current one
+/// @param flags SNAPSHOT_RESIDENCY and/or SNAPSHOT_PAGES, to include those
+/// @return false if the process could not be inspected or the file not written
+bool write_memory_snapshot(int pid, const char *path, uint32_t flags) {
+    std::vector<memory_region_t> regions;
+    if (!load_process_memory_layout(pid, regions, true)) {
+        return false;
+    }
+#ifndef __linux__
+    flags &= ~SNAPSHOT_RESIDENCY;
+#endif
+    const uint64_t page_size = system_page_size();
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.header_size = sizeof(snapshot_header_t);
+    header.region_size = sizeof(snapshot_region_t);
+    header.flags = flags;
+    header.pid = pid;
+    header.page_size = page_size;
+    header.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    header.region_count = regions.size();
+    header.regions_offset = align_up(sizeof(header), 8);
+
+    // strings: each distinct interned string once
+    std::string strings;
+    std::map<const char*, uint32_t> string_offsets;
+    std::vector<snapshot_region_t> records(regions.size());
+    for (size_t i = 0; i < regions.size(); i++) {
+        const char *names[2] = {regions[i].region_type.c_str(), regions[i].region_detail.c_str()};
+        uint32_t offsets[2];
+        for (int n = 0; n < 2; n++) {
+            std::map<const char*, uint32_t>::const_iterator found = string_offsets.find(names[n]);
+            if (found == string_offsets.end()) {
+                found = string_offsets.insert(std::make_pair(names[n], (uint32_t)strings.size())).first;
+                strings.append(names[n], strlen(names[n]) + 1);
+            }
+            offsets[n] = found->second;
+        }
+        snapshot_region_t &record = records[i];
+        memset(&record, 0, sizeof(record));
+        record.start_address = reinterpret_cast<uintptr_t>(regions[i].start_address);
+        record.size = regions[i].size;
+        record.resident_size = regions[i].resident_size;
+        record.pss_size = regions[i].pss_size;
+        record.shared_clean_size = regions[i].shared_clean_size;
+        record.shared_dirty_size = regions[i].shared_dirty_size;
+        record.private_clean_size = regions[i].private_clean_size;
+        record.private_dirty_size = regions[i].private_dirty_size;
+        record.swap_size = regions[i].swap_size;
+        record.anon_huge_size = regions[i].anon_huge_size;
+        record.type_offset = offsets[0];
+        record.detail_offset = offsets[1];
+        record.permissions = regions[i].permissions;
+        record.residency_offset = SNAPSHOT_NONE;
+        record.contents_offset = SNAPSHOT_NONE;
+        record.unreadable_offset = SNAPSHOT_NONE;
+    }
+    header.strings_offset = header.regions_offset + records.size() * sizeof(snapshot_region_t);
+    header.strings_size = strings.size();
+    header.residency_offset = align_up(header.strings_offset + header.strings_size, 8);
+
+    // residency bitmaps
+    std::vector<std::vector<uint64_t> > bitmaps;
+#ifdef __linux__
+    if (flags & SNAPSHOT_RESIDENCY) {
+        residency_scanner_t scanner;
+        if (!scanner.open(pid)) {
+            return false;
+        }
+        region_residency_t residency;
+        bitmaps.resize(regions.size());
+        for (size_t i = 0; i < regions.size(); i++) {
+            scanner.scan(regions[i], residency);
+            records[i].residency_offset = header.residency_size;
+            header.residency_size += residency.present.size() * sizeof(uint64_t);
+            bitmaps[i].swap(residency.present);
+        }
+    }
+#endif
+
+    // page contents, of readable regions only
+    header.pages_offset = align_up(header.residency_offset + header.residency_size, page_size);
+    if (flags & SNAPSHOT_PAGES) {
+        for (size_t i = 0; i < regions.size(); i++) {
+            if (regions[i].permissions & PERM_READ) {
+                records[i].contents_offset = header.pages_size;
+                header.pages_size += regions[i].size;
+            }
+        }
+    }
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "failed to open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    snapshot_writer_t writer(fd);
+    writer.queue(&header, sizeof(header));
+    writer.pad_to(header.regions_offset);
+    writer.queue(records.data(), records.size() * sizeof(snapshot_region_t));
+    writer.queue(strings.data(), strings.size());
+    writer.pad_to(header.residency_offset);
+    for (size_t i = 0; i < bitmaps.size(); i++) {
+        writer.queue(bitmaps[i].data(), bitmaps[i].size() * sizeof(uint64_t));
+    }
+    writer.pad_to(header.pages_offset);
+    bool ok = writer.flush();
+
+    if (flags & SNAPSHOT_PAGES) {
+        // stream the contents through a fixed size buffer
+        process_reader_t reader;
+        ok = ok && reader.attach(pid);
+        const size_t CHUNK_SIZE = 16 * 1024 * 1024;
+        std::vector<uint8_t> chunk(CHUNK_SIZE);
+        std::vector<uint64_t> unreadable;
+        header.unreadable_offset = header.pages_offset + header.pages_size;
+        for (size_t i = 0; ok && i < regions.size(); i++) {
+            if (records[i].contents_offset == SNAPSHOT_NONE) {
+                continue;
+            }
+            const uint8_t *start = (const uint8_t*)regions[i].start_address;
+            const uint8_t *cursor = start;
+            const uint8_t *end = cursor + regions[i].size;
+            std::vector<uint64_t> bitmap;
+            while (ok && cursor < end) {
+                const size_t len = end - cursor < (ptrdiff_t)CHUNK_SIZE ? end - cursor : CHUNK_SIZE;
+                if (reader.read(cursor, &chunk[0], len) != len) {
+                    // find the pages that couldn't be read (and came back as zeros)
+                    bitmap.resize((regions[i].size / page_size + 63) / 64, 0);
+                    for (size_t offset = 0; offset < len; offset += page_size) {
+                        if (reader.read(cursor + offset, &chunk[offset], page_size) != page_size) {
+                            const size_t page = (cursor + offset - start) / page_size;
+                            bitmap[page / 64] |= 1ull << (page % 64);
+                        }
+                    }
+                }
+                writer.queue(&chunk[0], len);
+                ok = writer.flush();
+                cursor += len;
+            }
+            if (!bitmap.empty()) {
+                records[i].unreadable_offset = unreadable.size() * sizeof(uint64_t);
+                unreadable.insert(unreadable.end(), bitmap.begin(), bitmap.end());
+            }
+        }
+        // the unreadable bitmaps go last, now that they are known, along with the
+        // header & region records that point to them
+        header.unreadable_size = unreadable.size() * sizeof(uint64_t);
+        writer.queue(unreadable.data(), header.unreadable_size);
+        ok = ok && writer.flush()
+            && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+            && pwrite(fd, records.data(), records.size() * sizeof(snapshot_region_t), header.regions_offset)
+                == (ssize_t)(records.size() * sizeof(snapshot_region_t));
+    }
+    if (!ok) {
+        std::cerr << "failed to write " << path << ": " << strerror(errno) << std::endl;
+    }
+    close(fd);
+    return ok;
+}
+
+/// @brief A snapshot file, mapped into memory and used in place.
+class snapshot_view_t {
+public:
+    snapshot_view_t() :base(nullptr), len(0) {}
+
+    ~snapshot_view_t() {
+        if (base != nullptr) {
+            munmap((void*)base, len);
+        }
+    }
+
+    /// @return false (after printing why) if `path` isn't a readable snapshot
+    bool open(const char *path) {
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "failed to open " << path << ": " << strerror(errno) << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        len = st.st_size;
+        void *mapped = len >= sizeof(snapshot_header_t) ? mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cerr << path << ": not a memlens snapshot" << std::endl;
+            return false;
+        }
+        base = (const uint8_t*)mapped;
+        const char *problem = validate();
+        if (problem != nullptr) {
+            std::cerr << path << ": " << problem << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    const snapshot_header_t& header() const {
+        return *(const snapshot_header_t*)base;
+    }
+
+    size_t size() const {
+        return header().region_count;
+    }
+
+    const snapshot_region_t& region(size_t i) const {
+        return *(const snapshot_region_t*)(base + header().regions_offset + i * header().region_size);
+    }
+
+    const char* string(uint32_t offset) const {
+        return (const char*)base + header().strings_offset + offset;
+    }
+
+    /// @return the residency bitmap of region `i` (bit n set if page n was present),
+    /// or nullptr if the snapshot doesn't have one
+    const uint64_t* residency(size_t i) const {
+        const uint64_t offset = region(i).residency_offset;
+        return offset == SNAPSHOT_NONE ? nullptr : (const uint64_t*)(base + header().residency_offset + offset);
+    }
+
+    /// @return the bitmap of pages of region `i` that couldn't be read (bit n set if
+    /// page n was left as zeros), or nullptr if they all could
+    const uint64_t* unreadable(size_t i) const {
+        if (header().header_size < sizeof(snapshot_header_t) || header().region_size < sizeof(snapshot_region_t)) {
+            return nullptr; // version 1 didn't tell
+        }
+        const uint64_t offset = region(i).unreadable_offset;
+        return offset == SNAPSHOT_NONE ? nullptr : (const uint64_t*)(base + header().unreadable_offset + offset);
+    }
+
+    /// @return the contents of region `i`, or nullptr if the snapshot doesn't have them
+    const uint8_t* contents(size_t i) const {
+        const uint64_t offset = region(i).contents_offset;
+        return offset == SNAPSHOT_NONE ? nullptr : base + header().pages_offset + offset;
+    }
+
+    /// @return index of the region containing `addr`, or `size()` if there is none
+    size_t find(uint64_t addr) const {
+        size_t lo = 0;
+        size_t hi = size();
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (region(mid).start_address + region(mid).size <= addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo < size() && region(lo).start_address <= addr ? lo : size();
+    }
+
+    /// @return index of the first region of type `name`, or `size()` if there is none
+    size_t find_by_type(const std::string &name) const {
+        for (size_t i = 0; i < size(); i++) {
+            if (name == string(region(i).type_offset)) {
+                return i;
+            }
+        }
+        return size();
+    }
+
+private:
+    const uint8_t *base;
+    size_t len;
+
+    /// @return true if `count` items of `size` bytes, starting at `offset`, end at or
+    /// before `limit`; offsets & sizes come from the file, so they may be anything,
+    /// and must not wrap around on the way
+    static bool fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t limit) {
+        uint64_t bytes, end;
+        return !__builtin_mul_overflow(count, size, &bytes) && !__builtin_add_overflow(offset, bytes, &end) && end <= limit;
+    }
+
+    /// @return what is wrong with the mapped file, or nullptr if it can be used
+    const char* validate() const {
+        const snapshot_header_t &h = header();
+        if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+            return "not a memlens snapshot";
+        }
+        if (h.byte_order != SNAPSHOT_BYTE_ORDER) {
+            return "snapshot was written on a machine with a different byte order";
+        }
+        if (h.header_size < SNAPSHOT_V1_HEADER_SIZE || h.region_size < SNAPSHOT_V1_REGION_SIZE) {
+            return "snapshot was written by an incompatible version of memlens";
+        }
+        const bool v2 = h.header_size >= sizeof(snapshot_header_t) && h.region_size >= sizeof(snapshot_region_t);
+        if (!fits(h.regions_offset, h.region_count, h.region_size, len)
+            || !fits(h.strings_offset, 1, h.strings_size, len)
+            || !fits(h.residency_offset, 1, h.residency_size, len)
+            || !fits(h.pages_offset, 1, h.pages_size, len)
+            || (v2 && !fits(h.unreadable_offset, 1, h.unreadable_size, len))) {
+            return "snapshot is truncated";
+        }
+        if (h.page_size == 0) {
+            return "snapshot is corrupt";
+        }
+        for (size_t i = 0; i < size(); i++) {
+            const snapshot_region_t &r = region(i);
+            if (r.type_offset >= h.strings_size || r.detail_offset >= h.strings_size
+                || (r.residency_offset != SNAPSHOT_NONE && !fits(r.residency_offset, (r.size / h.page_size + 63) / 64, 8, h.residency_size))
+                || (r.contents_offset != SNAPSHOT_NONE && !fits(r.contents_offset, 1, r.size, h.pages_size))
+                || (v2 && r.unreadable_offset != SNAPSHOT_NONE && !fits(r.unreadable_offset, (r.size / h.page_size + 63) / 64, 8, h.unreadable_size))) {
+                return "snapshot is corrupt";
+            }
+        }
+        if (h.strings_size > 0 && string(h.strings_size - 1)[0] != '\0') {
+            return "snapshot is corrupt";
+        }
+        return nullptr;
+    }
+};
+#else
+bool write_memory_snapshot(int pid, const char *path, uint32_t flags) {
+    (void)pid;
+    (void)path;
+    (void)flags;
+    std::cerr << "snapshots are not supported on this platform" << std::endl;
+    return false;
+}
+#endif // MEMLENS_SNAPSHOT_SUPPORTED
+
+/// @brief Print a snapshot: its layout, or (given `name`, a region type or an
+/// address) the residency & contents of that region.
+/// @param size number of bytes to dump from `name`
+void print_memory_snapshot(const char *path, const std::string &name, size_t size) {
+#ifdef MEMLENS_SNAPSHOT_SUPPORTED
+    snapshot_view_t view;
+    if (!view.open(path)) {
+        return;
+    }
+    const snapshot_header_t &header = view.header();
+    std::cout << "snapshot of " << (header.pid == 0 ? std::string("memlens") : "pid " + std::to_string(header.pid))
+        << ", " << view.size() << " regions"
+        << (header.flags & SNAPSHOT_RESIDENCY ? ", with residency" : "")
+        << (header.flags & SNAPSHOT_PAGES ? ", with pages" : "")
+        << std::endl;
+
+    if (name.empty()) {
+        std::vector<memory_region_t> regions(view.size());
+        for (size_t i = 0; i < view.size(); i++) {
+            const snapshot_region_t &r = view.region(i);
+            memory_region_t &region = regions[i];
+            region.start_address = reinterpret_cast<void*>(r.start_address);
+            region.size = r.size;
+            region.resident_size = r.resident_size;
+            region.pss_size = r.pss_size;
+            region.shared_clean_size = r.shared_clean_size;
+            region.shared_dirty_size = r.shared_dirty_size;
+            region.private_clean_size = r.private_clean_size;
+            region.private_dirty_size = r.private_dirty_size;
+            region.swap_size = r.swap_size;
+            region.anon_huge_size = r.anon_huge_size;
+            region.region_type = interned_str_t(view.string(r.type_offset));
+            region.region_detail = interned_str_t(view.string(r.detail_offset));
+            region.permissions = r.permissions;
+        }
+        print_memory_layout(true, regions);
+        return;
+    }
+
+    size_t i = view.find_by_type(name);
+    char *end = nullptr;
+    const uint64_t address = i < view.size() ? view.region(i).start_address : strtoull(name.c_str(), &end, 0);
+    i = i < view.size() ? i : *end == '\0' ? view.find(address) : view.size();
+    if (i == view.size()) {
+        std::cerr << "no such region in the snapshot: " << name << std::endl;
+        return;
+    }
+    const snapshot_region_t &r = view.region(i);
+    std::cout << view.string(r.type_offset) << " " << std::hex << r.start_address << "-" << r.start_address + r.size
+        << std::dec << " (" << size_str(r.size) << ") " << view.string(r.detail_offset) << std::endl;
+    const uint64_t *bitmap = view.residency(i);
+    if (bitmap != nullptr) {
+        size_t present = 0;
+        for (size_t page = 0; page < r.size / header.page_size; page++) {
+            present += (bitmap[page / 64] >> (page % 64)) & 1;
+        }
+        std::cout << "present: " << present << " of " << r.size / header.page_size << " pages" << std::endl;
+    }
+    const uint8_t *contents = view.contents(i);
+    if (contents == nullptr) {
+        std::cout << "(no contents in this snapshot)" << std::endl;
+        return;
+    }
+    const uint64_t *unreadable = view.unreadable(i);
+    if (unreadable != nullptr) {
+        size_t count = 0;
+        for (size_t page = 0; page < r.size / header.page_size; page++) {
+            count += (unreadable[page / 64] >> (page % 64)) & 1;
+        }
+        std::cout << "unreadable: " << count << " of " << r.size / header.page_size << " pages" << std::endl;
+    }
+    const uint64_t offset = address - r.start_address;
+    size = size < r.size - offset ? size : r.size - offset;
+    output_buffer_t out(1, 4 * 1024 * 1024);
+    std::cout << std::flush;
+    // runs of pages that were read are dumped, the others are marked
+    const auto was_read = [&](uint64_t at) {
+        const uint64_t page = at / header.page_size;
+        return unreadable == nullptr || !((unreadable[page / 64] >> (page % 64)) & 1);
+    };
+    for (uint64_t from = offset; from < offset + size; ) {
+        const bool readable = was_read(from);
+        uint64_t to = from;
+        while (to < offset + size && was_read(to) == readable) {
+            to = (to / header.page_size + 1) * header.page_size;
+        }
+        to = to < offset + size ? to : offset + size;
+        if (readable) {
+            hexdump_rows(contents + from, reinterpret_cast<void*>(r.start_address + from), to - from, out);
+        } else {
+            hexdump_unreadable(reinterpret_cast<void*>(r.start_address + from), to - from, out);
+        }
+        from = to;
+    }
+    out.append_char('\n');
+    out.flush();
+#else
+    (void)path;
+    (void)name;
+    (void)size;
+    std::cerr << "snapshots are not supported on this platform" << std::endl;
+#endif
+}
+
+#endif // MEMLENS_SNAPSHOT_HPP
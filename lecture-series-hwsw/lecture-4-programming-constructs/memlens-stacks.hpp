@@ -0,0 +1,379 @@
+/// @file
+/// @brief Thread stacks: where they are, and how much of them is ever used.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// Only the main thread's stack is named (`[stack]`) in /proc/<pid>/maps; every
+/// other thread's stack is an anonymous mapping, allocated by the threading
+/// library with a fixed size (8 MiB by default with glibc). We find each thread's
+/// stack from its stack pointer (/proc/<pid>/task/<tid>/syscall, which has it for
+/// threads that aren't running right now), and label the region `stack:<tid>`.
+/// A thread's stack stays where it is for as long as the thread lives, so we only
+/// look for it once per thread (`layout` & `heap` label stacks on every call).
+///
+/// How deep has a thread ever gone? Stack pages the thread never touched were
+/// never faulted in, so they aren't resident: the lowest resident page of a stack
+/// is its high-water mark, at page granularity. (Filling stacks with a pattern up
+/// front and looking for where it got overwritten would also work, but it would
+/// make every page resident, which is exactly the cost we want to measure.)
+
+#ifndef MEMLENS_STACKS_HPP
+#define MEMLENS_STACKS_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memlens.hpp"
+#include "memlens-residency.hpp"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/// @brief A thread, and the stack it runs on.
+typedef struct {
+    int tid;
+    char state;                     // R(unning), S(leeping), D(isk wait), ... from stat
+    std::string name;
+    uintptr_t stack_pointer;        // 0 if unknown (e.g. the thread is running)
+    int stack_pointer_error;        // errno if it couldn't be read, 0 otherwise
+    const memory_region_t *stack;   // nullptr if unknown
+} thread_info_t;
+
+/// @return the stack pointer in /proc/<pid>/task/<tid>/stat (kstkesp), which the
+/// kernel only fills in for some threads (e.g. those dumping core), or 0
+uintptr_t stat_stack_pointer(int pid, int tid) {
+    char file[32];
+    char path[64];
+    snprintf(file, sizeof(file), "task/%d/stat", tid);
+    FILE *f = fopen(proc_path(path, pid, file), "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    char line[1024];
+    const bool read = fgets(line, sizeof(line), f) != nullptr;
+    fclose(f);
+    // "<tid> (<name>) <state> ...": kstkesp is field 29, the 27th after the name
+    char *close = read ? strrchr(line, ')') : nullptr;
+    if (close == nullptr) {
+        return 0;
+    }
+    int field = 3;
+    for (char *value = strtok(close + 1, " \n"); value != nullptr; value = strtok(nullptr, " \n"), field++) {
+        if (field == 29) {
+            return strtoull(value, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+/// @return the stack pointer of thread `tid` of process `pid` (0 for the current
+/// one), or 0 if it can't be known (e.g. the thread is running right now), with
+/// `error` set to the errno that kept us from reading it (or 0)
+uintptr_t thread_stack_pointer(int pid, int tid, int &error) {
+    error = 0;
+    if (pid == 0 && tid == (int)syscall(SYS_gettid)) {
+        int local;
+        return reinterpret_cast<uintptr_t>(&local);
+    }
+    // "<nr> <arg1> ... <arg6> <sp> <pc>", or "running", or "-1 <sp> <pc>" outside a syscall
+    char file[32];
+    char path[64];
+    snprintf(file, sizeof(file), "task/%d/syscall", tid);
+    for (int attempt = 0; attempt < 3; attempt++) {
+        errno = 0;
+        FILE *f = fopen(proc_path(path, pid, file), "r");
+        char line[256];
+        const bool read = f != nullptr && fgets(line, sizeof(line), f) != nullptr;
+        if (!read) {
+            // syscall needs ptrace access to the thread, stat doesn't (but rarely has it)
+            error = errno;
+        }
+        if (f != nullptr) {
+            fclose(f);
+        }
+        if (!read) {
+            return error == EACCES || error == EPERM ? stat_stack_pointer(pid, tid) : 0;
+        }
+        if (strncmp(line, "running", 7) == 0) {
+            std::this_thread::yield(); // it may be in a syscall in a moment
+            continue;
+        }
+        // the stack pointer is the second to last field
+        std::vector<char*> fields;
+        for (char *field = strtok(line, " \n"); field != nullptr; field = strtok(nullptr, " \n")) {
+            fields.push_back(field);
+        }
+        return fields.size() >= 3 ? strtoull(fields[fields.size() - 2], nullptr, 16) : 0;
+    }
+    return 0;
+}
+
+/// @return the region of `regions` (sorted by address) that `address` is in, or nullptr
+const memory_region_t* region_containing(const std::vector<memory_region_t> &regions, uintptr_t address) {
+    std::vector<memory_region_t>::const_iterator it = std::upper_bound(regions.begin(), regions.end(), address,
+        [](uintptr_t addr, const memory_region_t &region) {
+            return addr < reinterpret_cast<uintptr_t>(region.start_address);
+        });
+    if (it == regions.begin() || address >= reinterpret_cast<uintptr_t>((--it)->start_address) + it->size) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+/// @brief Load the threads of process `pid` (0 for the current one), with their
+/// stacks looked up in `regions` (its layout, sorted by address).
+void load_threads(int pid, const std::vector<memory_region_t> &regions, std::vector<thread_info_t> &threads) {
+    threads.clear();
+    char path[64];
+    DIR *dir = opendir(proc_path(path, pid, "task"));
+    if (dir == nullptr) {
+        return;
+    }
+    const int main_tid = pid == 0 ? getpid() : pid;
+    while (const dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        thread_info_t thread;
+        thread.tid = atoi(entry->d_name);
+        thread.state = '?';
+        thread.stack_pointer = 0;
+        thread.stack_pointer_error = 0;
+        thread.stack = nullptr;
+
+        char file[32];
+        snprintf(file, sizeof(file), "task/%d/stat", thread.tid);
+        FILE *f = fopen(proc_path(path, pid, file), "r");
+        if (f != nullptr) {
+            // "<tid> (<name>) <state> ...", where the name may itself contain ")"
+            char line[512];
+            if (fgets(line, sizeof(line), f) != nullptr) {
+                char *open = strchr(line, '(');
+                char *close = strrchr(line, ')');
+                if (open != nullptr && close != nullptr && close > open) {
+                    thread.name.assign(open + 1, close - open - 1);
+                    thread.state = close[1] == ' ' ? close[2] : '?';
+                }
+            }
+            fclose(f);
+        }
+
+        if (thread.tid == main_tid) {
+            for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+                if (it->region_type == "stack") {
+                    thread.stack = &*it;
+                }
+            }
+        }
+        thread.stack_pointer = thread_stack_pointer(pid, thread.tid, thread.stack_pointer_error);
+        if (thread.stack == nullptr && thread.stack_pointer != 0) {
+            thread.stack = region_containing(regions, thread.stack_pointer);
+        }
+        threads.push_back(thread);
+    }
+    closedir(dir);
+    std::sort(threads.begin(), threads.end(), [](const thread_info_t &a, const thread_info_t &b) {
+        return a.tid < b.tid;
+    });
+}
+
+void label_thread_stacks(int pid, std::vector<memory_region_t> &regions) {
+    // most processes have a single thread, whose stack is already [stack] (the
+    // task directory has a link per thread, plus "." & "..")
+    char path[64];
+    struct stat st;
+    if (stat(proc_path(path, pid, "task"), &st) == 0 && st.st_nlink <= 3) {
+        return;
+    }
+    // where each thread's stack starts, by (pid, tid)
+    static std::mutex mutex;
+    static std::map<std::pair<int, int>, uintptr_t> stack_starts;
+    std::lock_guard<std::mutex> lock(mutex);
+    DIR *dir = opendir(proc_path(path, pid, "task"));
+    if (dir == nullptr) {
+        return;
+    }
+    const int main_tid = pid == 0 ? getpid() : pid;
+    while (const dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        const int tid = atoi(entry->d_name);
+        if (tid == main_tid) {
+            continue;
+        }
+        const memory_region_t *stack = nullptr;
+        const std::pair<int, int> key(pid, tid);
+        std::map<std::pair<int, int>, uintptr_t>::const_iterator cached = stack_starts.find(key);
+        if (cached != stack_starts.end()) {
+            // the tid may have been reused by a thread with another stack
+            stack = region_containing(regions, cached->second);
+            if (stack != nullptr && reinterpret_cast<uintptr_t>(stack->start_address) != cached->second) {
+                stack = nullptr;
+            }
+        }
+        if (stack == nullptr) {
+            int error;
+            const uintptr_t stack_pointer = thread_stack_pointer(pid, tid, error);
+            stack = stack_pointer != 0 ? region_containing(regions, stack_pointer) : nullptr;
+            if (stack == nullptr) {
+                continue;
+            }
+            stack_starts[key] = reinterpret_cast<uintptr_t>(stack->start_address);
+        }
+        if (stack->region_type != "stack") {
+            regions[stack - &regions[0]].region_type = interned_str_t("stack:" + std::to_string(tid));
+        }
+    }
+    closedir(dir);
+}
+
+/// @brief Write `thread` as a record (for `--format`), with the size of its stack,
+/// how deep it is now and how deep it has ever been (all 0 if its stack is unknown).
+void write_thread_stack(record_writer_t &records, const thread_info_t &thread, size_t size, size_t depth, size_t high_water) {
+    records.begin();
+    records.field_int("tid", thread.tid);
+    records.field_str("name", thread.name.data(), thread.name.size());
+    records.field_str("state", &thread.state, 1);
+    records.field_hex("stack_pointer", thread.stack_pointer);
+    records.field_hex("stack_start", thread.stack != nullptr ? reinterpret_cast<uintptr_t>(thread.stack->start_address) : 0);
+    records.field_uint("stack_size", size);
+    records.field_uint("depth", depth);
+    records.field_uint("high_water", high_water);
+    records.field_uint("resident", thread.stack != nullptr ? thread.stack->resident_size : 0);
+    records.field_str("type", thread.stack != nullptr ? thread.stack->region_type.c_str() : "");
+    records.end();
+}
+
+/// @brief Print every thread of process `pid` (0 for the current one) with the size
+/// of its stack, how deep it is now, and how deep it has ever been.
+void print_thread_stacks(int pid) {
+    std::vector<memory_region_t> regions;
+    if (!load_process_memory_layout(pid, regions, true)) {
+        return;
+    }
+    label_thread_stacks(pid, regions);
+    std::vector<thread_info_t> threads;
+    load_threads(pid, regions, threads);
+    residency_scanner_t scanner;
+    const bool have_residency = scanner.open(pid);
+    const size_t page_size = getpagesize();
+
+    const bool text = OUTPUT_FORMAT == FORMAT_TEXT;
+    output_buffer_t out(1, 64 * 1024);
+    record_writer_t records(out, OUTPUT_FORMAT);
+    if (text) {
+        printf("%8s %-16s %5s %9s %9s %10s %5s %9s  %s\n", "tid", "name", "state", "stack", "depth", "high-water", "used", "resident", "type");
+    }
+    size_t total_size = 0;
+    size_t total_high_water = 0;
+    size_t total_resident = 0;
+    for (std::vector<thread_info_t>::const_iterator it = threads.begin(); it != threads.end(); ++it) {
+        if (it->stack == nullptr && !text) {
+            write_thread_stack(records, *it, 0, 0, 0);
+            continue;
+        } else if (it->stack == nullptr) {
+            const std::string why = it->stack_pointer != 0 ? "(stack pointer outside any region)"
+                : it->stack_pointer_error != 0 ? std::string("(stack pointer unknown: ") + strerror(it->stack_pointer_error) + ")"
+                : "(stack pointer unknown, is it running?)";
+            printf("%8d %-16s %5c %9s %9s %10s %5s %9s  %s\n", it->tid, it->name.c_str(), it->state, "?", "?", "?", "?", "?", why.c_str());
+            continue;
+        }
+        const memory_region_t &stack = *it->stack;
+        const uintptr_t top = reinterpret_cast<uintptr_t>(stack.start_address) + stack.size;
+        const size_t depth = it->stack_pointer != 0 && it->stack_pointer < top ? top - it->stack_pointer : 0;
+        // stacks grow down: everything from the lowest touched page up has been used
+        size_t high_water = 0;
+        if (have_residency) {
+            region_residency_t residency;
+            scanner.scan(stack, residency);
+            for (size_t page = 0; page < residency.pages; page++) {
+                if ((residency.present[page / 64] >> (page % 64)) & 1) {
+                    high_water = (residency.pages - page) * page_size;
+                    break;
+                }
+            }
+        }
+        if (high_water < depth) {
+            high_water = depth;
+        }
+        total_size += stack.size;
+        total_high_water += high_water;
+        total_resident += stack.resident_size;
+        if (!text) {
+            write_thread_stack(records, *it, stack.size, depth, high_water);
+            continue;
+        }
+        char used[16];
+        snprintf(used, sizeof(used), "%.0f%%", stack.size > 0 ? high_water * 100.0 / stack.size : 0.0);
+        printf("%8d %-16s %5c %9s %9s %10s %5s %9s  %s\n", it->tid, it->name.c_str(), it->state, size_str(stack.size).c_str(), size_str(depth).c_str(),
+            size_str(high_water).c_str(), used, size_str(stack.resident_size).c_str(), stack.region_type.c_str());
+    }
+    if (!text) {
+        return;
+    }
+    printf("%8s %-16s %5s %9s %9s %10s %5s %9s\n", "total", "", "", size_str(total_size).c_str(), "", size_str(total_high_water).c_str(), "",
+        size_str(total_resident).c_str());
+    if (total_size > 0) {
+        printf("%s of stack address space was never touched (%.0f%%)\n", size_str(total_size - total_high_water).c_str(),
+            (total_size - total_high_water) * 100.0 / total_size);
+    }
+}
+#else
+void label_thread_stacks(int pid, std::vector<memory_region_t> &regions) {
+    (void)pid;
+    (void)regions;
+}
+
+void print_thread_stacks(int pid) {
+    (void)pid;
+    std::cerr << "stacks is not supported on this platform" << std::endl;
+}
+#endif // __linux__
+
+/// @brief Use about `bytes` of stack, a frame at a time.
+MEMLENS_NOINLINE size_t use_stack(size_t bytes) {
+    volatile char frame[1024];
+    frame[0] = (char)bytes;
+    frame[sizeof(frame) - 1] = 1;
+    if (bytes <= sizeof(frame)) {
+        return frame[0];
+    }
+    // not a tail call, so every level keeps its frame
+    return use_stack(bytes - sizeof(frame)) + frame[sizeof(frame) - 1];
+}
+
+/// @brief Run `print_thread_stacks()` on ourselves while a few threads, each of
+/// which went to a different depth, are alive.
+void demo_thread_stacks() {
+    const size_t DEPTHS[] = {4 * 1024, 64 * 1024, 512 * 1024, 2 * 1024 * 1024};
+    const size_t COUNT = sizeof(DEPTHS) / sizeof(DEPTHS[0]);
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < COUNT; i++) {
+        threads.push_back(std::thread([&ready, &done, &DEPTHS, i]() {
+            use_stack(DEPTHS[i]);
+            ready++;
+            while (!done) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }));
+    }
+    while (ready < COUNT) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20)); // let them all go to sleep
+    print_thread_stacks(0);
+    done = true;
+    for (size_t i = 0; i < COUNT; i++) {
+        threads[i].join();
+    }
+}
+
+#endif // MEMLENS_STACKS_HPP
@@ -0,0 +1,414 @@
+/// @file
+/// @brief Resolving addresses to the functions & objects they belong to.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// The memory layout tells us an address is `code + 4660`; the symbol table of the
+/// ELF file mapped there tells us that's `prime_factors(unsigned int)+0x14`. Each
+/// ELF file is mmap'ed once, its `.symtab` (or, if stripped, `.dynsym`) is
+/// collected into an array sorted by address, and kept for the life of the process
+/// (so refreshing the layout doesn't reload it). Lookups are two binary searches:
+/// one for the mapping an address is in, one for the symbol within that file.
+
+#ifndef MEMLENS_SYMBOLS_HPP
+#define MEMLENS_SYMBOLS_HPP
+
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+#include "memlens.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+#include <cxxabi.h>
+#endif
+
+#ifdef __linux__
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <dlfcn.h>
+#endif
+
+/// @return the demangled version of `name` (or `name` itself, if it isn't mangled,
+/// or if the compiler has no demangler we know of, like MSVC)
+std::string demangle(const char *name) {
+#if defined(__GNUC__) || defined(__clang__)
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (demangled == nullptr) {
+        return name;
+    }
+    const std::string result = demangled;
+    free(demangled);
+    return result;
+#else
+    return name;
+#endif
+}
+
+/// @return true if `symbol` (mangled) names the function or object `name`, either
+/// exactly, or by its demangled name with or without its parameter list
+bool symbol_matches(const char *symbol, const std::string &name) {
+    if (name == symbol) {
+        return true;
+    }
+    if (symbol[0] != '_' || symbol[1] != 'Z') {
+        return false;
+    }
+    const std::string demangled = demangle(symbol);
+    if (demangled == name) {
+        return true;
+    }
+    // e.g. "label" for "label[abi:cxx11]() const", but not for its "[clone .cold]" part
+    if (demangled.size() <= name.size() || demangled.compare(0, name.size(), name) != 0 || demangled.find(" [clone ") != std::string::npos) {
+        return false;
+    }
+    return demangled[name.size()] == '(' || demangled.compare(name.size(), 5, "[abi:") == 0;
+}
+
+/// @brief A function or object in an ELF file.
+typedef struct {
+    uintptr_t value;        // address, as linked (i.e. before relocation)
+    size_t size;
+    const char *name;       // mangled, points into the mmap'ed file
+} elf_symbol_t;
+
+#ifdef __linux__
+/// @brief The symbols of one ELF file, sorted by address.
+class elf_symbols_t {
+public:
+    elf_symbols_t() :map(nullptr), map_size(0), file_type(ET_NONE), base_vaddr(0) {}
+
+    ~elf_symbols_t() {
+        if (map != nullptr) {
+            munmap(map, map_size);
+        }
+    }
+
+    /// @brief Map `path` and collect its symbols.
+    /// @return false if it isn't an ELF file for this architecture
+    bool load(const char *path) {
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+            close(fd);
+            return false;
+        }
+        map_size = st.st_size;
+        map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            return false;
+        }
+
+        const uint8_t *file = (const uint8_t*)map;
+        const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr)*)file;
+        if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)
+                || !in_file(ehdr->e_phoff, ehdr->e_phnum, sizeof(ElfW(Phdr))) || !in_file(ehdr->e_shoff, ehdr->e_shnum, sizeof(ElfW(Shdr)))) {
+            return false;
+        }
+        file_type = ehdr->e_type;
+
+        // the lowest loaded address is what ends up at the start of the first mapping
+        const ElfW(Phdr) *phdrs = (const ElfW(Phdr)*)(file + ehdr->e_phoff);
+        base_vaddr = UINTPTR_MAX;
+        for (size_t i = 0; i < ehdr->e_phnum; i++) {
+            if (phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr - phdrs[i].p_offset < base_vaddr) {
+                base_vaddr = phdrs[i].p_vaddr - phdrs[i].p_offset;
+            }
+        }
+        if (base_vaddr == UINTPTR_MAX) {
+            base_vaddr = 0;
+        }
+
+        // both tables, as .symtab has local symbols & .dynsym may have a few more
+        const ElfW(Shdr) *shdrs = (const ElfW(Shdr)*)(file + ehdr->e_shoff);
+        for (size_t i = 0; i < ehdr->e_shnum; i++) {
+            if ((shdrs[i].sh_type != SHT_SYMTAB && shdrs[i].sh_type != SHT_DYNSYM) || shdrs[i].sh_link >= ehdr->e_shnum) {
+                continue;
+            }
+            const ElfW(Shdr) &strtab = shdrs[shdrs[i].sh_link];
+            if (!in_file(shdrs[i].sh_offset, shdrs[i].sh_size, 1) || !in_file(strtab.sh_offset, strtab.sh_size, 1) || strtab.sh_size == 0
+                    || file[strtab.sh_offset + strtab.sh_size - 1] != '\0') {
+                continue;
+            }
+            const ElfW(Sym) *syms = (const ElfW(Sym)*)(file + shdrs[i].sh_offset);
+            const size_t count = shdrs[i].sh_size / sizeof(ElfW(Sym));
+            for (size_t s = 0; s < count; s++) {
+                const int type = ELF64_ST_TYPE(syms[s].st_info);
+                if ((type != STT_FUNC && type != STT_OBJECT && type != STT_GNU_IFUNC) || syms[s].st_shndx == SHN_UNDEF
+                        || syms[s].st_value == 0 || syms[s].st_name >= strtab.sh_size) {
+                    continue;
+                }
+                elf_symbol_t symbol;
+                symbol.value = syms[s].st_value;
+                symbol.size = syms[s].st_size;
+                symbol.name = (const char*)file + strtab.sh_offset + syms[s].st_name;
+                symbols.push_back(symbol);
+            }
+        }
+
+        // aliases (e.g. __libc_malloc & malloc) are kept so they can be found by
+        // name, ordered so that `find()` picks the one with the fewest leading
+        // underscores, which is usually the public name
+        std::sort(symbols.begin(), symbols.end(), [](const elf_symbol_t &a, const elf_symbol_t &b) {
+            return a.value != b.value ? a.value < b.value : strspn(a.name, "_") > strspn(b.name, "_");
+        });
+        return true;
+    }
+
+    /// @return what to add to the symbols' addresses, given where the first
+    /// mapping of this file starts
+    uintptr_t load_bias(uintptr_t first_mapping_start) const {
+        return file_type == ET_DYN ? first_mapping_start - base_vaddr : 0;
+    }
+
+    /// @return the symbol containing `vaddr` (as linked), or nullptr if none does
+    const elf_symbol_t* find(uintptr_t vaddr) const {
+        const elf_symbol_t key = {vaddr, 0, nullptr};
+        std::vector<elf_symbol_t>::const_iterator it = std::upper_bound(symbols.begin(), symbols.end(), key, [](const elf_symbol_t &a, const elf_symbol_t &b) {
+            return a.value < b.value;
+        });
+        if (it == symbols.begin()) {
+            return nullptr;
+        }
+        --it;
+        // symbols without a size (e.g. _init) only get their first address, rather
+        // than every address up to the next symbol
+        return vaddr - it->value < (it->size > 0 ? it->size : 1) ? &*it : nullptr;
+    }
+
+    /// @return the symbol named `name` (see `symbol_matches()`), or nullptr
+    const elf_symbol_t* find_by_name(const std::string &name) const {
+        for (std::vector<elf_symbol_t>::const_iterator it = symbols.begin(); it != symbols.end(); ++it) {
+            if (symbol_matches(it->name, name)) {
+                return &*it;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t size() const {
+        return symbols.size();
+    }
+
+private:
+    elf_symbols_t(const elf_symbols_t&);
+    elf_symbols_t& operator=(const elf_symbols_t&);
+
+    /// @return true if `count` entries of `entry_size` at `offset` lie within the file
+    bool in_file(uint64_t offset, uint64_t count, uint64_t entry_size) const {
+        return offset <= map_size && count <= (map_size - offset) / entry_size;
+    }
+
+    void *map;
+    size_t map_size;
+    int file_type;          // ET_EXEC (loaded where linked) or ET_DYN (relocated)
+    uintptr_t base_vaddr;   // the address the file's offset 0 is linked at
+    std::vector<elf_symbol_t> symbols;
+};
+
+/// @brief ELF files loaded so far, by path (nullptr for files that aren't ELF).
+/// Never freed, so lookups can hand out pointers into them.
+std::map<std::string, const elf_symbols_t*> ELF_FILES;
+
+/// @return the (cached) symbols of the ELF file at `path`, or nullptr
+const elf_symbols_t* elf_symbols_of(const std::string &path) {
+    std::map<std::string, const elf_symbols_t*>::const_iterator it = ELF_FILES.find(path);
+    if (it != ELF_FILES.end()) {
+        return it->second;
+    }
+    elf_symbols_t *symbols = new elf_symbols_t();
+    if (!symbols->load(path.c_str())) {
+        delete symbols;
+        symbols = nullptr;
+    }
+    ELF_FILES[path] = symbols;
+    return symbols;
+}
+
+/// @return the file mapped into `region`, or an empty string if it isn't backed by one
+std::string region_file(const memory_region_t &region) {
+    const char *detail = region.region_detail.c_str();
+    if (detail[0] != '/') {
+        return "";
+    }
+    // libraries carry their kind of mapping as a suffix, e.g. "/usr/lib/libc.so.6 (code)"
+    const char *suffix = strrchr(detail, ' ');
+    const size_t len = strlen(detail);
+    if (suffix != nullptr && suffix[1] == '(' && detail[len - 1] == ')') {
+        return std::string(detail, suffix - detail);
+    }
+    return std::string(detail, len);
+}
+#endif // __linux__
+
+/// @brief Symbols of all the files mapped into a process, by address.
+class symbol_table_t {
+public:
+    /// @brief (Re)build the table over the file-backed regions of `regions`.
+    void build(const std::vector<memory_region_t> &regions) {
+        modules.clear();
+#ifdef __linux__
+        std::vector<const memory_region_t*> sorted;
+        for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+            sorted.push_back(&*it);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const memory_region_t *a, const memory_region_t *b) {
+            return a->start_address < b->start_address;
+        });
+        std::map<std::string, uintptr_t> first_mapping;
+        for (std::vector<const memory_region_t*>::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+            const std::string path = region_file(**it);
+            if (path.empty()) {
+                continue;
+            }
+            const elf_symbols_t *symbols = elf_symbols_of(path);
+            if (symbols == nullptr) {
+                continue;
+            }
+            const uintptr_t start = reinterpret_cast<uintptr_t>((*it)->start_address);
+            // the first mapping of a file is the one at its offset 0
+            std::map<std::string, uintptr_t>::iterator first = first_mapping.insert(std::make_pair(path, start)).first;
+            // only the executable's mappings get a type (code/data/...) of their own
+            module_t module = {start, start + (*it)->size, symbols->load_bias(first->second), (*it)->region_type != "-", symbols};
+            modules.push_back(module);
+        }
+#else
+        (void)regions;
+#endif
+    }
+
+    /// @return the symbol containing `address`, or nullptr if none does
+    /// @param offset set to the offset of `address` within the symbol
+    const elf_symbol_t* find(const void *address, size_t &offset) const {
+#ifdef __linux__
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(address);
+        const module_t key = {addr, 0, 0, false, nullptr};
+        std::vector<module_t>::const_iterator it = std::upper_bound(modules.begin(), modules.end(), key, [](const module_t &a, const module_t &b) {
+            return a.start < b.start;
+        });
+        if (it == modules.begin() || addr >= (--it)->end) {
+            return nullptr;
+        }
+        const elf_symbol_t *symbol = it->symbols->find(addr - it->bias);
+        if (symbol != nullptr) {
+            offset = addr - it->bias - symbol->value;
+        }
+        return symbol;
+#else
+        (void)address;
+        (void)offset;
+        return nullptr;
+#endif
+    }
+
+    /// @return the address of the function or object `name`, or nullptr if there
+    /// is none (the executable is searched first, then libraries in address order)
+    /// @param size set to the size of the symbol
+    void* find_by_name(const std::string &name, size_t &size) const {
+#ifdef __linux__
+        for (int pass = 0; pass < 2; pass++) {
+            const elf_symbols_t *searched = nullptr;
+            for (std::vector<module_t>::const_iterator it = modules.begin(); it != modules.end(); ++it) {
+                if (it->symbols == searched || it->executable != (pass == 0)) {
+                    continue;
+                }
+                searched = it->symbols;
+                const elf_symbol_t *symbol = it->symbols->find_by_name(name);
+                if (symbol != nullptr) {
+                    size = symbol->size;
+                    return reinterpret_cast<void*>(symbol->value + it->bias);
+                }
+            }
+        }
+#else
+        (void)name;
+        (void)size;
+#endif
+        return nullptr;
+    }
+
+private:
+    typedef struct {
+        uintptr_t start;
+        uintptr_t end;
+        uintptr_t bias;         // added to a symbol's value to get its address
+        bool executable;
+#ifdef __linux__
+        const elf_symbols_t *symbols;
+#else
+        const void *symbols;
+#endif
+    } module_t;
+
+    std::vector<module_t> modules;  // one per mapping, sorted by start
+};
+
+/// @brief symbols of the current process, and the layout generation they match
+symbol_table_t SYMBOLS;
+uint64_t SYMBOLS_GENERATION = UINT64_MAX;
+
+/// @return the symbols of the current process, rebuilt if its layout moved
+const symbol_table_t& self_symbols() {
+    if (MEMORY_REGIONS.empty()) {
+        update_memory_layout();
+    }
+    if (SYMBOLS_GENERATION != MEMORY_LAYOUT_GENERATION) {
+        SYMBOLS.build(MEMORY_REGIONS);
+        SYMBOLS_GENERATION = MEMORY_LAYOUT_GENERATION;
+    }
+    return SYMBOLS;
+}
+
+/// @return `symbol+offset` (e.g. `prime_factors(unsigned int)+0x14`) for `address`
+/// in `symbols`, or an empty string if it isn't within a known symbol
+std::string symbol_name(const symbol_table_t &symbols, const void *address) {
+    size_t offset = 0;
+    const elf_symbol_t *symbol = symbols.find(address, offset);
+    if (symbol == nullptr) {
+        return "";
+    }
+    std::string name = demangle(symbol->name);
+    if (offset > 0) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "+0x%zx", offset);
+        name += buf;
+    }
+    return name;
+}
+
+std::string symbol_name(const void *address) {
+#ifdef __APPLE__
+    // no ELF here, but the dynamic loader knows the exported symbols
+    Dl_info info;
+    if (dladdr(address, &info) == 0 || info.dli_sname == nullptr) {
+        return "";
+    }
+    const size_t offset = (const uint8_t*)address - (const uint8_t*)info.dli_saddr;
+    return demangle(info.dli_sname) + (offset > 0 ? "+" + std::to_string(offset) : "");
+#else
+    return symbol_name(self_symbols(), address);
+#endif
+}
+
+/// @return the address of the function or object `name` in the current process,
+/// or nullptr if there is none
+/// @param size set to the size of the symbol, if known (left as is otherwise)
+void* symbol_address(const std::string &name, size_t &size) {
+#ifdef __APPLE__
+    (void)size;
+    return dlsym(RTLD_DEFAULT, name.c_str());
+#else
+    return self_symbols().find_by_name(name, size);
+#endif
+}
+
+#endif // MEMLENS_SYMBOLS_HPP
@@ -0,0 +1,375 @@
+/// @file
+/// @brief Continuous sampling of memory usage over time.
+/// @details Going through this file is not necessary for understanding the lecture.
+/// A one-off `memlens layout` shows where memory is at an instant. To see RSS grow
+/// and shrink (e.g. a leak, or the heap breathing with the load) we sample it at a
+/// fixed interval: the process' totals, and optionally every mapping, to see which
+/// one grows. Sampling must not disturb what it measures, so the sampler
+/// thread only reads /proc into fixed size records and pushes them into a
+/// preallocated lock-free ring: no allocation, no locks, no iostream formatting.
+/// A separate thread drains the ring, formats the records by hand into a large
+/// buffer, and writes it out with a single `write()` per batch.
+
+#ifndef MEMLENS_WATCH_HPP
+#define MEMLENS_WATCH_HPP
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memlens.hpp"
+#include "memlens-output.hpp"
+
+/// @brief A bounded, lock-free queue for exactly one producer thread and one
+/// consumer thread, with all its slots allocated up front.
+/// @details `head` and `tail` only ever increase, and are on separate cache lines
+/// so that the producer and consumer don't keep stealing the line from each other.
+template <typename T>
+class spsc_ring_t {
+public:
+    /// @param capacity number of slots, rounded up to a power of 2
+    explicit spsc_ring_t(size_t capacity) :head(0), tail(0) {
+        size_t slots_count = 1;
+        while (slots_count < capacity) {
+            slots_count <<= 1;
+        }
+        slots.resize(slots_count);
+        mask = slots_count - 1;
+    }
+
+    /// @brief Called by the producer only.
+    /// @return false (dropping `item`) if the ring is full
+    bool push(const T &item) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) {
+            return false;
+        }
+        slots[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Called by the consumer only.
+    /// @return false if the ring is empty
+    bool pop(T &item) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;   // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail;   // next slot to push, written by the producer
+};
+
+/// @brief One sample of a process' memory usage, or of one of its mappings.
+typedef struct {
+    uint64_t time_ns;       // since the watch started
+    uint64_t cost_ns;       // how long taking this sample took (0 for a mapping)
+    uint64_t start_address; // of the mapping, or 0 for the process' totals
+    uint64_t mappings;      // 1 for a mapping
+    uint64_t size;
+    uint64_t resident_size;
+    uint64_t pss_size;
+    uint64_t dirty_size;    // shared + private dirty
+    uint64_t swap_size;
+    uint64_t anon_huge_size;
+    char name[64];          // of the mapping (its path, truncated, or e.g. "[heap]")
+} layout_sample_t;
+
+/// @brief set from the SIGINT handler to stop watching
+volatile std::sig_atomic_t WATCH_INTERRUPTED = 0;
+
+/// @return `text` (e.g. "10ms", "500us", "2s", or plain milliseconds) in nanoseconds
+uint64_t parse_duration_ns(const std::string &text) {
+    size_t unit_at = 0;
+    const double value = std::stod(text, &unit_at);
+    const std::string unit = text.substr(unit_at);
+    double scale = 1e6;
+    if (unit == "ns") {
+        scale = 1;
+    } else if (unit == "us") {
+        scale = 1e3;
+    } else if (unit == "s") {
+        scale = 1e9;
+    } else if (unit != "ms" && !unit.empty()) {
+        show_usage(("invalid duration: " + text).c_str());
+    }
+    return (uint64_t)(value * scale);
+}
+
+/// @brief Sleep until `deadline`, or until `stop()` returns true, checking it often
+/// enough for Ctrl-C to be handled promptly, however long the wait.
+template <typename F>
+void sleep_until_or(std::chrono::steady_clock::time_point deadline, F stop) {
+    const std::chrono::steady_clock::duration SLICE = std::chrono::milliseconds(20);
+    while (!stop()) {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            return;
+        }
+        std::this_thread::sleep_for(deadline - now < SLICE ? deadline - now : SLICE);
+    }
+}
+
+/// @brief Samples memory usage of a process into `layout_sample_t` records.
+class layout_sampler_t {
+public:
+    explicit layout_sampler_t(int pid) :pid(pid) {}
+
+    /// @brief Sample the totals of the process into `out`.
+    /// @return false if the process could not be read
+    bool sample(layout_sample_t &out) {
+        memory_region_t total;
+#ifdef __linux__
+        out.mappings = load_memory_totals(total, reader, pid);
+        if (out.mappings == 0) {
+            return false;
+        }
+#else
+        // without a way to sum up usage in place, reload the whole layout (this
+        // allocates & interns, which is fine as only this thread interns meanwhile)
+        if (!load_process_memory_layout(pid, regions, true)) {
+            return false;
+        }
+        total = memory_region_t();
+        for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+            total.size += it->size;
+            total.resident_size += it->resident_size;
+            total.pss_size += it->pss_size;
+            total.shared_dirty_size += it->shared_dirty_size;
+            total.private_dirty_size += it->private_dirty_size;
+            total.swap_size += it->swap_size;
+            total.anon_huge_size += it->anon_huge_size;
+        }
+        out.mappings = regions.size();
+#endif
+        set_sizes(out, total);
+        out.start_address = 0;
+        out.name[0] = '\0';
+        return true;
+    }
+
+    /// @brief Sample each mapping, handing it to `region()` as it's read (with the
+    /// `time_ns` of `out`), and their totals into `out`.
+    /// @return false if the process could not be read
+    template <typename F>
+    bool sample_regions(layout_sample_t &out, F region) {
+        memory_region_t total = memory_region_t();
+        layout_sample_t mapping = layout_sample_t();
+        mapping.time_ns = out.time_ns;
+        mapping.mappings = 1;
+        const auto add = [&](const memory_region_t &usage, const char *name) {
+            set_sizes(mapping, usage);
+            mapping.start_address = reinterpret_cast<uintptr_t>(usage.start_address);
+            snprintf(mapping.name, sizeof(mapping.name), "%s", name);
+            region(mapping);
+            total.size += usage.size;
+            total.resident_size += usage.resident_size;
+            total.pss_size += usage.pss_size;
+            total.shared_dirty_size += usage.shared_dirty_size;
+            total.private_dirty_size += usage.private_dirty_size;
+            total.swap_size += usage.swap_size;
+            total.anon_huge_size += usage.anon_huge_size;
+        };
+#ifdef __linux__
+        out.mappings = for_each_mapping_usage(reader, pid, add);
+        if (out.mappings == 0) {
+            return false;
+        }
+#else
+        if (!load_process_memory_layout(pid, regions, true)) {
+            return false;
+        }
+        for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+            add(*it, it->region_detail.empty() ? it->region_type.c_str() : it->region_detail.c_str());
+        }
+        out.mappings = regions.size();
+#endif
+        set_sizes(out, total);
+        out.start_address = 0;
+        out.name[0] = '\0';
+        return true;
+    }
+
+private:
+    int pid;
+#ifdef __linux__
+    proc_reader_t reader;
+#else
+    std::vector<memory_region_t> regions;
+#endif
+
+    static void set_sizes(layout_sample_t &out, const memory_region_t &usage) {
+        out.size = usage.size;
+        out.resident_size = usage.resident_size;
+        out.pss_size = usage.pss_size;
+        out.dirty_size = usage.shared_dirty_size + usage.private_dirty_size;
+        out.swap_size = usage.swap_size;
+        out.anon_huge_size = usage.anon_huge_size;
+    }
+};
+
+/// @brief Format `sample` as one line of text into `out`, sizes in KiB. A mapping
+/// has its start address in place of the number of mappings, and its name last.
+void format_sample(const layout_sample_t &sample, output_buffer_t &out) {
+    out.append_dec(sample.time_ns / 1000000, 10);
+    out.append_char('.');
+    out.append_dec(sample.time_ns / 1000 % 1000, 3, '0');
+    if (sample.start_address != 0) {
+        out.append("  ");
+        out.append_hex(sample.start_address, 12);
+        out.append_dec(sample.size / 1024, 10);
+        out.append_dec(sample.resident_size / 1024, 10);
+        out.append_dec(sample.pss_size / 1024, 10);
+        out.append_dec(sample.dirty_size / 1024, 10);
+        out.append_dec(sample.swap_size / 1024, 10);
+        out.append_dec(sample.anon_huge_size / 1024, 10);
+        if (sample.name[0] != '\0') {
+            out.append("            ");
+            out.append(sample.name);
+        }
+        out.append_char('\n');
+        return;
+    }
+    out.append_dec(sample.mappings, 9);
+    out.append_dec(sample.size / 1024, 12);
+    out.append_dec(sample.resident_size / 1024, 10);
+    out.append_dec(sample.pss_size / 1024, 10);
+    out.append_dec(sample.dirty_size / 1024, 10);
+    out.append_dec(sample.swap_size / 1024, 10);
+    out.append_dec(sample.anon_huge_size / 1024, 10);
+    out.append_dec(sample.cost_ns / 1000, 10);
+    out.append_char('\n');
+}
+
+/// @brief Write `sample` as a record (for `--format`), sizes in bytes.
+/// @param with_regions whether mappings are sampled too, when every record says
+///   which mapping it's for (0x0 & no name for the totals)
+void write_sample(const layout_sample_t &sample, record_writer_t &records, bool with_regions) {
+    records.begin();
+    records.field_uint("time_ns", sample.time_ns);
+    if (with_regions) {
+        records.field_hex("region", sample.start_address);
+        records.field_str("name", sample.name);
+    }
+    records.field_uint("mappings", sample.mappings);
+    records.field_uint("size", sample.size);
+    records.field_uint("rss", sample.resident_size);
+    records.field_uint("pss", sample.pss_size);
+    records.field_uint("dirty", sample.dirty_size);
+    records.field_uint("swap", sample.swap_size);
+    records.field_uint("thp", sample.anon_huge_size);
+    records.field_uint("cost_ns", sample.cost_ns);
+    records.end();
+}
+
+extern "C" void watch_interrupt(int) {
+    WATCH_INTERRUPTED = 1;
+}
+
+/// @brief Sample the memory usage of process `pid` every `interval_ns`, writing
+/// one line per sample to `fd`, until `count` samples are taken (0 for no limit),
+/// the process goes away, or Ctrl-C is pressed.
+/// @param with_regions also sample every mapping, a line each before the totals
+/// @details Samples are taken on a deadline schedule (each one `interval_ns` after
+/// the previous deadline, not after the previous sample finished), so the sampling
+/// cost doesn't make the series drift. If the writer falls behind, samples are
+/// dropped rather than making the sampler wait, and counted on stderr at the end.
+/// @return false if the process could not be read at all
+bool watch_memory_usage(int pid, uint64_t interval_ns, uint64_t count, bool with_regions, int fd) {
+    layout_sampler_t sampler(pid);
+    layout_sample_t sample = layout_sample_t();
+    if (!sampler.sample(sample)) {
+        std::cerr << "failed to read memory usage of " << (pid == 0 ? "self" : std::to_string(pid)) << std::endl;
+        return false;
+    }
+
+    // room for a few seconds' worth at 100 Hz, even with a few hundred mappings
+    spsc_ring_t<layout_sample_t> ring(with_regions ? 65536 : 4096);
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> dropped(0);
+    WATCH_INTERRUPTED = 0;
+    void (*previous_handler)(int) = std::signal(SIGINT, watch_interrupt);
+
+    std::thread sampler_thread([&]() {
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point started = clock::now();
+        clock::time_point deadline = started;
+        for (uint64_t i = 0; (count == 0 || i < count) && !WATCH_INTERRUPTED; i++) {
+            sleep_until_or(deadline, []() { return WATCH_INTERRUPTED != 0; });
+            if (WATCH_INTERRUPTED) {
+                break;
+            }
+            const clock::time_point now = clock::now();
+            layout_sample_t s;
+            s.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - started).count();
+            const bool sampled = with_regions ? sampler.sample_regions(s, [&](const layout_sample_t &region) {
+                if (!ring.push(region)) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }) : sampler.sample(s);
+            if (!sampled) {
+                break; // the process exited
+            }
+            s.cost_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - now).count();
+            if (!ring.push(s)) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            deadline += std::chrono::nanoseconds(interval_ns);
+            if (deadline < now) {
+                deadline = now; // we overslept (or a sample was slow), don't try to catch up
+            }
+        }
+        done.store(true, std::memory_order_release);
+    });
+
+    // drain in batches (at most 10 per second), so that each write() carries
+    // many lines when sampling fast
+    const std::chrono::nanoseconds drain_interval(interval_ns > 100000000 ? interval_ns : 100000000);
+    output_buffer_t out(fd);
+    record_writer_t records(out, OUTPUT_FORMAT);
+    if (OUTPUT_FORMAT == FORMAT_TEXT) {
+        out.append("#  time(ms) mappings   size(KiB)  rss(KiB)  pss(KiB) dirty(KiB) swap(KiB)  thp(KiB) cost(us)\n");
+        if (with_regions) {
+            out.append("#  time(ms)         start  size(KiB)  rss(KiB)  pss(KiB) dirty(KiB) swap(KiB)  thp(KiB)           mapping\n");
+        }
+    }
+    out.flush();
+    while (true) {
+        const bool finished = done.load(std::memory_order_acquire);
+        while (ring.pop(sample)) {
+            if (OUTPUT_FORMAT == FORMAT_TEXT) {
+                format_sample(sample, out);
+            } else {
+                write_sample(sample, records, with_regions);
+            }
+        }
+        if (finished) {
+            records.finish();
+        }
+        out.flush();
+        if (finished) {
+            break;
+        }
+        sleep_until_or(std::chrono::steady_clock::now() + drain_interval, [&]() {
+            return WATCH_INTERRUPTED || done.load(std::memory_order_acquire);
+        });
+    }
+    sampler_thread.join();
+    std::signal(SIGINT, previous_handler);
+    if (dropped.load() > 0) {
+        std::cerr << dropped.load() << " samples dropped (output could not keep up)" << std::endl;
+    }
+    return true;
+}
+
+#endif // MEMLENS_WATCH_HPP
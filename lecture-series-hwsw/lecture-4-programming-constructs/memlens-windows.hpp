@@ -21,7 +21,13 @@ typedef struct {
     std::string filename;
 } MODFILEINFO;
 
-void load_memory_layout(std::vector<memory_region_t> &regions) {
+size_t system_page_size() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+void load_memory_layout(std::vector<memory_region_t> &regions, bool /* with_usage: always available */) {
     HANDLE process = GetCurrentProcess();
     HMODULE modules[1024];
     DWORD cbNeeded;
@@ -47,7 +53,7 @@ void load_memory_layout(std::vector<memory_region_t> &regions) {
     uint8_t *malloc_ptr = new uint8_t[1024*4];
     char* addr = 0;
     while (VirtualQueryEx(process, addr, &mbi, sizeof(mbi))) {
-        memory_region_t region;
+        memory_region_t region = memory_region_t();
         region.start_address = mbi.BaseAddress;
         region.size = mbi.RegionSize;
 
@@ -123,5 +129,53 @@ void load_memory_layout(std::vector<memory_region_t> &regions) {
     CloseHandle(process);
 }
 
+bool load_process_memory_layout(int pid, std::vector<memory_region_t> &regions, bool with_usage) {
+    if (pid != 0) {
+        std::cerr << "inspecting other processes is not supported on Windows" << std::endl;
+        return false;
+    }
+    load_memory_layout(regions, with_usage);
+    return true;
+}
+
+/// @brief Reads the memory of a process. Only the current process (pid 0) is
+/// supported on Windows, see `load_process_memory_layout()`.
+class process_reader_t {
+public:
+    process_reader_t() :owner(this) {}
+
+    bool attach(int target) {
+        owner = this;
+        regions.clear();
+        if (!load_process_memory_layout(target, regions, false)) {
+            return false;
+        }
+        index.build(regions);
+        return true;
+    }
+
+    void share(const process_reader_t &attached) {
+        owner = &attached;
+    }
+
+    const std::vector<memory_region_t>& layout() const {
+        return owner->regions;
+    }
+
+    const region_index_t& layout_index() const {
+        return owner->index;
+    }
+
+    size_t read(const void *address, void *buf, size_t size) {
+        memcpy(buf, address, size);
+        return size;
+    }
+
+private:
+    std::vector<memory_region_t> regions;
+    region_index_t index;
+    const process_reader_t *owner;
+};
+
 #endif // is windows
 #endif // MEMLENS_WINDOWS_HPP
\ No newline at end of file
@@ -28,8 +28,14 @@ int main(int argc, const char *argv[]) {
     std::vector<std::string> args;
     for (int i = 1; i < argc; i++) {
         const std::string arg = std::string(argv[i]);
-        if (arg == "-h" || arg == "--help") {
+        const bool before_separator = std::find(args.begin(), args.end(), "--") == args.end();
+        if ((arg == "-h" || arg == "--help") && before_separator) {
             show_usage(nullptr);
+        } else if (arg == "--format" && before_separator) {
+            if (i + 1 == argc || !parse_output_format(argv[i + 1], OUTPUT_FORMAT)) {
+                show_usage("--format takes one of text, json, ndjson or csv");
+            }
+            i++;
         } else if (arg.length() > 0) {
             if (command.length() > 0) {
                 args.push_back(arg);
@@ -39,6 +45,27 @@ int main(int argc, const char *argv[]) {
         }
     }
 
+    // "allocs <command> ..." runs <command> with allocations traced
+    const bool trace_allocs = command == "allocs";
+    if (trace_allocs) {
+        if (!ALLOC_TRACER_BUILT) {
+            show_usage("allocs needs memlens built with -DMEMLENS_TRACE_MALLOC");
+        }
+        if (args.empty()) {
+            show_usage("missing command to trace");
+        }
+        command = args[0];
+        args.erase(args.begin());
+    }
+    alloc_tracing_scope_t alloc_tracing(trace_allocs);
+
+    // the commands that have records to print; the rest only print for humans
+    const char *STRUCTURED_COMMANDS[] = {"layout", "dump", "residency", "scan", "dedup", "stacks", "watch"};
+    const char **structured_end = STRUCTURED_COMMANDS + sizeof(STRUCTURED_COMMANDS) / sizeof(STRUCTURED_COMMANDS[0]);
+    if (OUTPUT_FORMAT != FORMAT_TEXT && std::find(STRUCTURED_COMMANDS, structured_end, command) == structured_end) {
+        show_usage(("--format is not supported by " + command).c_str());
+    }
+
     update_memory_layout();
 
     // execute the command
@@ -49,7 +76,23 @@ int main(int argc, const char *argv[]) {
         print_address_of_localvar(true, argc, 0);
         print_prime_factors(12348);
     } else if (command == "layout") {
-        print_memory_layout();
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
+        const bool with_usage = take_flag(args, "-v");
+        if (pid == 0) {
+            // a labelled copy: MEMORY_REGIONS keeps the names that maps gives
+            std::vector<memory_region_t> regions = MEMORY_REGIONS;
+            label_thread_stacks(0, regions);
+            label_heap_regions(regions);
+            print_memory_layout(with_usage, regions);
+        } else {
+            // smaps, for the resident column (and the rest of the usage, with -v)
+            std::vector<memory_region_t> regions;
+            if (!load_process_memory_layout(pid, regions, true)) {
+                return 1;
+            }
+            label_thread_stacks(pid, regions);
+            print_memory_layout(with_usage, regions);
+        }
     } else if (command == "demo-class") {
         uint32_t before_emp = 0;
         Employee emp(1, 2, 100);
@@ -59,6 +102,7 @@ int main(int argc, const char *argv[]) {
         print_address_of_localvar(true, salary_per_yr_of_exp, 0);
         salary_per_yr_of_exp = emp.salary_per_yr_of_exp();
         std::cout << "Salary per year of experience: " << salary_per_yr_of_exp << std::endl;
+        print_layout_of(Employee);
     } else if (command == "demo-poly") {
         uint32_t before_emp = 0;
         Employee emp(1, 2, 100);
@@ -79,6 +123,10 @@ int main(int argc, const char *argv[]) {
         salary_per_yr_of_exp = ceo.salary_per_yr_of_exp();
         label = ceo.label();
         std::cout << label << ": salary/yr: " << salary_per_yr_of_exp << std::endl;
+
+        std::cout << "---- layouts ----" << std::endl;
+        print_layout_of(Employee);
+        print_layout_of(CEO);
     } else if (command == "demo-late-poly") {
         uint32_t before_emp = 0;
         EmployeeDyn emp(1, 2, 100);
@@ -100,6 +148,10 @@ int main(int argc, const char *argv[]) {
         salary_per_yr_of_exp = emp_ptr->salary_per_yr_of_exp();
         label = emp_ptr->label();
         std::cout << label << ": salary/yr: " << salary_per_yr_of_exp << std::endl;
+
+        std::cout << "---- layouts ----" << std::endl;
+        print_layout_of(EmployeeDyn);
+        print_layout_of(CEODyn);
     } else if (command == "demo-try-catch") {
         try {
             test_throwing_func();
@@ -113,25 +165,189 @@ int main(int argc, const char *argv[]) {
             std::cerr << "Exception selector: " << exc_selector << std::endl;
         }
     } else if (command == "dump") {
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
         if (args.size() < 1) {
             show_usage("missing address");
         }
-        const void *addr;
-        if (args[0] == "prime_factors") {
-            print_address_of_func(true, prime_factors, 0);
-            addr = (void*)&prime_factors;
-        } else if (args[0] == "print_prime_factors") {
-            print_address_of_func(true, print_prime_factors, 0);
-            print_address_of_func(true, prime_factors, 1);
-            addr = (void*)&print_prime_factors;
+        // several names, comma separated, are dumped one after the other: e.g.
+        // print_prime_factors,prime_factors shows a function and the one it calls
+        std::vector<std::string> names;
+        for (size_t from = 0; from <= args[0].size(); ) {
+            const size_t comma = std::min(args[0].find(',', from), args[0].size());
+            names.push_back(args[0].substr(from, comma - from));
+            from = comma + 1;
+        }
+        if (names.size() > 1 && OUTPUT_FORMAT != FORMAT_TEXT) {
+            show_usage("dump with --format takes a single address");
+        }
+        if (pid != 0) {
+            process_reader_t reader;
+            if (!reader.attach(pid)) {
+                return 1;
+            }
+            symbol_table_t symbols;
+            bool symbols_built = false;
+            for (size_t i = 0; i < names.size(); i++) {
+                const memory_region_t *region = reader.layout_index().find_by_type(names[i].data(), names[i].size());
+                size_t size = 0;
+                const void *addr = region != nullptr ? region->start_address : nullptr;
+                if (addr == nullptr && (names[i][0] < '0' || names[i][0] > '9')) {
+                    if (!symbols_built) {
+                        symbols.build(reader.layout());
+                        symbols_built = true;
+                    }
+                    addr = symbols.find_by_name(names[i], size);
+                }
+                if (addr == nullptr) {
+                    addr = (void*)std::stoull(names[i], nullptr, 0);
+                }
+                size = args.size() > 1 ? std::stoul(args[1], nullptr, 0) : (size > 0 ? size : 64);
+                if (names.size() > 1) {
+                    std::cout << std::endl << "Memory dump of &[" << names[i] << "]: " << std::endl;
+                }
+                dump_process_memory(reader, addr, size);
+            }
+            return 0;
+        }
+        std::vector<const void*> addrs(names.size());
+        std::vector<size_t> sizes(names.size());
+        for (size_t i = 0; i < names.size(); i++) {
+            addrs[i] = region_name_to_address(names[i], sizes[i]);
+            if (sizes[i] == 0) {
+                sizes[i] = 64;
+            } else if (OUTPUT_FORMAT == FORMAT_TEXT) {
+                print_address_of(true, (void*)addrs[i], nullptr, ("@symbol{" + names[i] + "}").c_str(), i, 4 * i);
+            }
+            if (args.size() > 1) {
+                sizes[i] = std::stoul(args[1], nullptr, 0);
+            }
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names.size() > 1) {
+                std::cout << std::endl << "Memory dump of &[" << names[i] << "]: " << std::endl;
+            }
+            dump_memory(addrs[i], sizes[i]);
+        }
+    } else if (command == "residency") {
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
+        print_memory_residency(pid, args.size() > 0 ? args[0] : "");
+    } else if (command == "scan") {
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
+        const size_t threads = std::stoul(take_option(args, "--threads", std::to_string(default_scan_threads())));
+        const std::string pattern = take_option(args, "--pattern", "");
+        const bool zero_pages = take_flag(args, "--zero-pages");
+        if (pattern.empty() && !zero_pages) {
+            show_usage("scan needs --pattern and/or --zero-pages");
+        } else if (!pattern.empty() && zero_pages && OUTPUT_FORMAT != FORMAT_TEXT) {
+            show_usage("scan with --format takes one of --pattern or --zero-pages");
+        }
+        scan_memory(pid, args.size() > 0 ? args[0] : "all", args.size() > 1 ? std::stoul(args[1], nullptr, 0) : 0,
+            pattern.empty() ? "" : parse_hex_bytes(pattern), zero_pages, threads > 0 ? threads : 1);
+    } else if (command == "dedup") {
+        const size_t threads = std::stoul(take_option(args, "--threads", std::to_string(default_scan_threads())));
+        if (take_flag(args, "--demo")) {
+            demo_duplicate_pages(threads > 0 ? threads : 1);
+        } else {
+            print_duplicate_pages(std::stoi(take_option(args, "--pid", "0")), threads > 0 ? threads : 1);
+        }
+    } else if (command == "stacks") {
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
+        if (take_flag(args, "--demo")) {
+            demo_thread_stacks();
         } else {
-            addr = region_name_to_address(args[0]);
+            print_thread_stacks(pid);
+        }
+    } else if (command == "watch") {
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
+        const uint64_t interval_ns = parse_duration_ns(take_option(args, "--interval", "100ms"));
+        const uint64_t count = std::stoull(take_option(args, "--count", "0"));
+        const bool with_regions = take_flag(args, "--regions");
+        if (!watch_memory_usage(pid, interval_ns, count, with_regions, 1)) {
+            return 1;
         }
-        size_t size = 64;
-        if (args.size() > 1) {
-            size = std::stoul(args[1], nullptr, 0);
+    } else if (command == "snapshot") {
+        const int pid = std::stoi(take_option(args, "--pid", "0"));
+        uint32_t flags = take_flag(args, "--residency") ? SNAPSHOT_RESIDENCY : 0;
+        flags |= take_flag(args, "--pages") ? SNAPSHOT_PAGES : 0;
+        if (args.size() < 1) {
+            show_usage("missing snapshot file");
         }
-        dump_memory(addr, size);
+        if (!write_memory_snapshot(pid, args[0].c_str(), flags)) {
+            return 1;
+        }
+    } else if (command == "read") {
+        if (args.size() < 1) {
+            show_usage("missing snapshot file");
+        }
+        print_memory_snapshot(args[0].c_str(), args.size() > 1 ? args[1] : "", args.size() > 2 ? std::stoul(args[2], nullptr, 0) : 64);
+    } else if (command == "heap") {
+        std::vector<void*> kept;
+        if (take_flag(args, "--demo")) {
+            kept = heap_demo_workload(4);
+        }
+        print_heap_info();
+    } else if (command == "profile") {
+        // everything after "--" is the command to profile
+        std::vector<std::string>::iterator separator = std::find(args.begin(), args.end(), "--");
+        std::vector<std::string> target(separator == args.end() ? separator : separator + 1, args.end());
+        args.erase(separator, args.end());
+        const uint64_t frequency = std::stoull(take_option(args, "--frequency", "1000"));
+        const std::string folded = take_option(args, "--folded", "");
+        target.insert(target.begin(), args.begin(), args.end());
+        if (target.empty()) {
+            show_usage("missing command to profile");
+        }
+        std::vector<char*> target_argv;
+        for (std::vector<std::string>::iterator it = target.begin(); it != target.end(); ++it) {
+            target_argv.push_back(&(*it)[0]);
+        }
+        target_argv.push_back(nullptr);
+        const int status = profile_command(&target_argv[0], frequency, folded.empty() ? nullptr : folded.c_str());
+        return status < 0 ? 1 : status;
+    } else if (command == "demo-delta") {
+        layout_delta_t delta;
+        std::cout << "---- new uint8_t[64M] ----" << std::endl;
+        // through a volatile pointer, or the compiler drops an allocation nothing reads
+        uint8_t * volatile big = new uint8_t[64 * 1024 * 1024];
+        refresh_memory_layout(&delta);
+        print_layout_delta(delta);
+
+        std::cout << "---- 256 x new uint8_t[4K] ----" << std::endl;
+        std::vector<uint8_t*> smalls;
+        for (int i = 0; i < 256; i++) {
+            smalls.push_back(new uint8_t[4096]);
+        }
+        refresh_memory_layout(&delta);
+        print_layout_delta(delta);
+
+        std::cout << "---- delete[] all ----" << std::endl;
+        delete[] big;
+        for (std::vector<uint8_t*>::const_iterator it = smalls.begin(); it != smalls.end(); ++it) {
+            delete[] *it;
+        }
+        refresh_memory_layout(&delta);
+        print_layout_delta(delta);
+
+        const uint64_t generation = MEMORY_LAYOUT_GENERATION;
+        std::cout << "---- nothing ----" << std::endl;
+        refresh_memory_layout(&delta);
+        print_layout_delta(delta);
+        std::cout << "generation: " << generation << " -> " << MEMORY_LAYOUT_GENERATION << std::endl;
+    } else if (command == "bench-refresh") {
+        bench_refresh();
+    } else if (command == "bench-lookup") {
+        bench_lookup(args.size() > 0 ? std::stoul(args[0], nullptr, 0) : 1000000);
+    } else if (command == "bench-allocs") {
+        if (!ALLOC_TRACER_BUILT) {
+            show_usage("bench-allocs needs memlens built with -DMEMLENS_TRACE_MALLOC");
+        }
+        bench_allocs(args.size() > 0 ? std::stoul(args[0], nullptr, 0) : 100000);
+    } else if (command == "bench-dispatch") {
+        bench_dispatch(args.size() > 0 ? std::stoul(args[0], nullptr, 0) : 10000000);
+    } else if (command == "bench-exceptions") {
+        bench_exceptions(args.size() > 0 ? std::stoul(args[0], nullptr, 0) : 1000);
+    } else if (command == "bench-hexdump") {
+        bench_hexdump(args.size() > 0 ? std::stoul(args[0], nullptr, 0) : 256 * 1024 * 1024);
     } else {
         show_usage("invalid command");
     }
@@ -207,24 +423,85 @@ void show_usage(const char *error) {
     outs << "  repo: https://github.com/amodm/talks/tree/main/lecture-series-hwsw/lecture-4-programming-constructs" << endl;
     outs << endl;
 
-    outs << "usage: memlens <command> [options]" << endl;
+    outs << "usage: memlens <command> [options] [--format text|json|ndjson|csv]" << endl;
     outs << "where command is one of:" << endl;
     outs << "  help - show this help message" << endl;
     outs << "  prime [-p] - run prime factors function" << endl;
-    outs << "  layout - show memory layout info" << endl;
+    outs << "  layout [-v] [--pid <pid>] - show memory layout info, naming allocator arenas & mmapped chunks of this process (-v adds pss/dirty/swap/thp sizes)" << endl;
+    outs << "  residency [--pid <pid>] [<region>] - show which pages of each region are present/swapped/soft-dirty/thp" << endl;
+    outs << "  scan [--pid <pid>] [--threads <n>] [--pattern <hex>] [--zero-pages] [<region> [<size>]] - search a region (default all) in parallel for a byte pattern, or for all-zero pages" << endl;
+    outs << "  dedup [--pid <pid>] [--threads <n>] [--demo] - hash every resident page of the writable regions, and report zero & duplicate pages (what KSM could save)" << endl;
+    outs << "  stacks [--pid <pid>] [--demo] - show each thread's stack size, current depth & high-water mark (--demo starts a few threads first)" << endl;
+    outs << "  watch [--pid <pid>] [--interval <10ms>] [--count <n>] [--regions] - sample memory usage (of every mapping too, with --regions) every interval (default 100ms) until Ctrl-C" << endl;
     outs << "  demo-class - demo class data vs code layout" << endl;
     outs << "  demo-poly - demo polymorphism layout" << endl;
     outs << "  demo-late-poly - demo late-binding polymorphism layout" << endl;
     outs << "  demo-try-catch - demo try-catch flow" << endl;
-    outs << "  dump <addr> [<size>] - dump memory starting at <addr>" << endl;
+    outs << "  demo-delta - demo how allocations change the memory layout" << endl;
+    outs << "  dump [--pid <pid>] <addr>[,<addr>...] [<size>] - dump memory starting at <addr> (a region, symbol, or address), e.g. print_prime_factors,prime_factors" << endl;
+    outs << "  snapshot [--pid <pid>] [--residency] [--pages] <file> - save the memory layout (with page residency/contents) to a binary file" << endl;
+    outs << "  read <file> [<region> [<size>]] - show a snapshot's layout, or dump a region (or address) from it" << endl;
+    outs << "  profile [--frequency <hz>] [--folded <file>] -- <command> [args] - sample where <command> spends CPU time, by region & symbol (default 1000 Hz; --folded writes stacks for flamegraphs)" << endl;
+    outs << "  heap [--demo] - show the allocator's arenas (in use/free/fragmented) and the regions they own (--demo allocates on a few threads first)" << endl;
+    outs << "  allocs <command> [options] - run <command>, then report live heap bytes by the call site that allocated them" << endl;
+    outs << "  bench-refresh - time memory layout refreshes at 100, 10k & 100k mappings" << endl;
+    outs << "  bench-lookup [<count>] - time address to region (and symbol) lookups" << endl;
+    outs << "  bench-allocs [<count>] - time new/delete with and without allocation tracing" << endl;
+    outs << "  bench-dispatch [<calls>] - time calls dispatched virtually, by switch, std::variant & CRTP, over mono/bi/random type mixes (default 10M)" << endl;
+    outs << "  bench-exceptions [<samples>] - time throw/catch against expected-style & error code returns, by call depth, with & without destructors (median of batches & p99 of single calls)" << endl;
+    outs << "  bench-hexdump [<size>] - check & time hexdump formatting (default 256MB)" << endl;
+    outs << "--format prints records instead of tables, for layout, dump, residency, scan, dedup, stacks & watch" << endl;
     outs << endl;
 
     exit (is_err ? 1 : 0);
 }
 
+/// @brief Remove the flag `name` (e.g. "-v") from `args`.
+/// @return true if it was present
+bool take_flag(std::vector<std::string> &args, const char *name) {
+    for (std::vector<std::string>::iterator it = args.begin(); it != args.end(); ++it) {
+        if (*it == name) {
+            args.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief Remove the option `name` (e.g. "--pid") and its value from `args`.
+/// @return the value of the option, or `default_value` if it wasn't present
+std::string take_option(std::vector<std::string> &args, const char *name, const std::string &default_value) {
+    for (std::vector<std::string>::iterator it = args.begin(); it != args.end(); ++it) {
+        if (*it == name) {
+            if (it + 1 == args.end()) {
+                show_usage((std::string("missing value for ") + name).c_str());
+            }
+            const std::string value = *(it + 1);
+            args.erase(it, it + 2);
+            return value;
+        }
+    }
+    return default_value;
+}
+
 /**************** Global Variables ****************/
 // this is not a great way to do things, but we'll use it for
 // simplicity in this example.
 
+/// @brief the interned region types & details of memory regions
+string_table_t STRINGS;
+
 /// @brief the memory regions of the current process
 std::vector<memory_region_t> MEMORY_REGIONS;
+
+/// @brief the address index over MEMORY_REGIONS
+region_index_t MEMORY_INDEX;
+
+/// @brief bumped every time MEMORY_REGIONS changes shape
+uint64_t MEMORY_LAYOUT_GENERATION = 0;
+
+/// @brief whether the Employee classes print their addresses when called
+bool TRACE_CALLS = true;
+
+/// @brief how commands print their results, set by `--format`
+output_format_t OUTPUT_FORMAT = FORMAT_TEXT;
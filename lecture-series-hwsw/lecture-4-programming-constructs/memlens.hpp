@@ -1,9 +1,12 @@
 #ifndef MEMLENS_HPP
 #define MEMLENS_HPP
 
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <stdint.h>
 #include <string>
@@ -13,17 +16,350 @@ const uint8_t PERM_READ = 0x01;
 const uint8_t PERM_WRIT = 0x02;
 const uint8_t PERM_EXEC = 0x04;
 
+/// @brief A table of interned strings.
+/// @details Every distinct string is stored exactly once, in large blocks that are
+/// never freed, so a pointer handed out by `intern()` stays valid for the life of
+/// the process and two interned strings are equal iff their pointers are. Looking
+/// up a string that is already present does not allocate. The table is shared by
+/// every thread that parses a layout (`scan --threads`, `watch`), so it is guarded
+/// by a mutex; interned strings themselves are immutable and need no locking.
+class string_table_t {
+public:
+    string_table_t() :slots(1024), count(0), block_used(0), block_size(0) {}
+
+    ~string_table_t() {
+        for (std::vector<char*>::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+            delete[] *it;
+        }
+    }
+
+    /// @return the interned copy of `str[0..len)`, adding it to the table if needed
+    const char* intern(const char *str, size_t len) {
+        if (len == 0) {
+            return empty();
+        }
+        const uint64_t hash = hash_of(str, len);
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t idx = hash & (slots.size() - 1);
+        while (slots[idx].str != nullptr) {
+            if (slots[idx].hash == hash && length(slots[idx].str) == len && memcmp(slots[idx].str, str, len) == 0) {
+                return slots[idx].str;
+            }
+            idx = (idx + 1) & (slots.size() - 1);
+        }
+        const char *copy = store(str, len);
+        slots[idx].hash = hash;
+        slots[idx].str = copy;
+        if (++count * 2 > slots.size()) {
+            grow();
+        }
+        return copy;
+    }
+
+    /// @return the interned copy of `str[0..len)`, or nullptr if it was never interned
+    const char* find(const char *str, size_t len) const {
+        if (len == 0) {
+            return empty();
+        }
+        const uint64_t hash = hash_of(str, len);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t idx = hash & (slots.size() - 1); slots[idx].str != nullptr; idx = (idx + 1) & (slots.size() - 1)) {
+            if (slots[idx].hash == hash && length(slots[idx].str) == len && memcmp(slots[idx].str, str, len) == 0) {
+                return slots[idx].str;
+            }
+        }
+        return nullptr;
+    }
+
+    /// @return the length of a string previously returned by `intern()`
+    static size_t length(const char *interned) {
+        uint32_t len;
+        memcpy(&len, interned - sizeof(len), sizeof(len));
+        return len;
+    }
+
+    static const char* empty() {
+        // a zero length prefix followed by the terminating NUL
+        static const char EMPTY[sizeof(uint32_t) + 1] = {0};
+        return EMPTY + sizeof(uint32_t);
+    }
+
+    /// @return number of distinct strings in the table
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    }
+
+private:
+    struct slot_t {
+        uint64_t hash;
+        const char *str;
+    };
+
+    std::vector<slot_t> slots; // open addressing, power-of-2 sized
+    size_t count;
+    std::vector<char*> blocks;
+    size_t block_used;
+    size_t block_size;
+    mutable std::mutex mutex;
+
+    static uint64_t hash_of(const char *str, size_t len) {
+        // FNV-1a
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < len; i++) {
+            hash = (hash ^ (uint8_t)str[i]) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    /// @brief Copy `str` into the current block as [u32 length][chars][NUL].
+    const char* store(const char *str, size_t len) {
+        const uint32_t len32 = (uint32_t)len;
+        const size_t needed = (sizeof(len32) + len + 1 + 3) & ~(size_t)3;
+        if (blocks.empty() || block_used + needed > block_size) {
+            block_size = needed > 64 * 1024 ? needed : 64 * 1024;
+            blocks.push_back(new char[block_size]);
+            block_used = 0;
+        }
+        char *entry = blocks.back() + block_used;
+        block_used += needed;
+        memcpy(entry, &len32, sizeof(len32));
+        memcpy(entry + sizeof(len32), str, len);
+        entry[sizeof(len32) + len] = '\0';
+        return entry + sizeof(len32);
+    }
+
+    void grow() {
+        std::vector<slot_t> old(slots.size() * 2);
+        old.swap(slots);
+        for (std::vector<slot_t>::const_iterator it = old.begin(); it != old.end(); ++it) {
+            if (it->str != nullptr) {
+                size_t idx = it->hash & (slots.size() - 1);
+                while (slots[idx].str != nullptr) {
+                    idx = (idx + 1) & (slots.size() - 1);
+                }
+                slots[idx] = *it;
+            }
+        }
+    }
+};
+
+/// @brief the strings used by memory regions, see `interned_str_t`
+extern string_table_t STRINGS;
+
+/// @brief An immutable string stored in `STRINGS`.
+/// @details It's just a pointer, so copying one never allocates, and comparing two
+/// of them is a pointer comparison.
+class interned_str_t {
+public:
+    interned_str_t() :ptr(string_table_t::empty()) {}
+    interned_str_t(const char *s) :ptr(STRINGS.intern(s, strlen(s))) {}
+    interned_str_t(const char *s, size_t len) :ptr(STRINGS.intern(s, len)) {}
+    interned_str_t(const std::string &s) :ptr(STRINGS.intern(s.data(), s.size())) {}
+
+    const char* c_str() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return string_table_t::length(ptr);
+    }
+
+    bool empty() const {
+        return *ptr == '\0';
+    }
+
+    /// @return the position of `needle`, or `std::string::npos` if absent
+    size_t find(const char *needle) const {
+        const char *pos = strstr(ptr, needle);
+        return pos == nullptr ? std::string::npos : pos - ptr;
+    }
+
+    std::string str() const {
+        return std::string(ptr, size());
+    }
+
+    bool operator==(const interned_str_t &other) const {
+        return ptr == other.ptr;
+    }
+
+    bool operator!=(const interned_str_t &other) const {
+        return ptr != other.ptr;
+    }
+
+    bool operator==(const char *other) const {
+        return strcmp(ptr, other) == 0;
+    }
+
+    bool operator!=(const char *other) const {
+        return strcmp(ptr, other) != 0;
+    }
+
+    bool operator==(const std::string &other) const {
+        return other.size() == size() && memcmp(ptr, other.data(), other.size()) == 0;
+    }
+
+private:
+    const char *ptr;
+};
+
+inline std::ostream& operator<<(std::ostream &os, const interned_str_t &s) {
+    return os << s.c_str();
+}
+
 typedef struct {
     void *start_address;
     size_t size;
     size_t resident_size;
-    std::string region_type;
-    std::string region_detail;
+    size_t pss_size;            // proportional set size (shared pages split across sharers)
+    size_t shared_clean_size;
+    size_t shared_dirty_size;
+    size_t private_clean_size;
+    size_t private_dirty_size;
+    size_t swap_size;
+    size_t anon_huge_size;      // resident bytes backed by transparent huge pages
+    interned_str_t region_type;
+    interned_str_t region_detail;
     uint8_t permissions;
 } memory_region_t;
 
 /// @brief Load the memory layout of the current process into `regions`
-void load_memory_layout(std::vector<memory_region_t> &regions);
+/// @param with_usage also load resident/PSS/dirty/swap sizes, where these are costly to get
+void load_memory_layout(std::vector<memory_region_t> &regions, bool with_usage = true);
+
+/// @brief An immutable index over a set of memory regions, for O(log n) address lookups.
+/// @details Region bounds are kept in their own sorted arrays (rather than being
+/// read out of `memory_region_t`) so that a lookup only touches a few cache lines.
+/// The index refers to the regions by position, so it must be rebuilt whenever the
+/// vector it was built from changes.
+/// Regions may overlap (e.g. a thread's stack labelled inside a larger mapping):
+/// an address then resolves to the region it is the smallest offset into, i.e. the
+/// one starting closest below it.
+class region_index_t {
+public:
+    region_index_t() :regions(nullptr) {}
+
+    /// @brief (Re)build the index over `source`.
+    void build(const std::vector<memory_region_t> &source) {
+        regions = &source;
+        order.resize(source.size());
+        for (size_t i = 0; i < source.size(); i++) {
+            order[i] = (uint32_t)i;
+        }
+        std::sort(order.begin(), order.end(), [&source](uint32_t a, uint32_t b) {
+            return source[a].start_address < source[b].start_address;
+        });
+        starts.resize(source.size());
+        ends.resize(source.size());
+        max_ends.resize(source.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            const memory_region_t &region = source[order[i]];
+            starts[i] = reinterpret_cast<uintptr_t>(region.start_address);
+            ends[i] = starts[i] + region.size;
+            max_ends[i] = i > 0 && max_ends[i - 1] > ends[i] ? max_ends[i - 1] : ends[i];
+        }
+        first_of_type.clear();
+        for (size_t i = 0; i < source.size(); i++) {
+            first_of_type.push_back(std::make_pair(source[i].region_type.c_str(), (uint32_t)i));
+        }
+        // stable, so that the first region of each type (in `source` order) comes first
+        std::stable_sort(first_of_type.begin(), first_of_type.end(), [](const std::pair<const char*, uint32_t> &a, const std::pair<const char*, uint32_t> &b) {
+            return a.first < b.first;
+        });
+    }
+
+    /// @return the region containing `address`, or nullptr if none does
+    const memory_region_t* find(const void *address) const {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(address);
+        if (starts.empty() || addr < starts[0]) {
+            return nullptr;
+        }
+        // branchless binary search for the last region starting at or before `addr`
+        const uintptr_t *base = &starts[0];
+        size_t n = starts.size();
+        while (n > 1) {
+            const size_t half = n / 2;
+            base = base[half] <= addr ? base + half : base;
+            n -= half;
+        }
+        return containing(base - &starts[0], addr);
+    }
+
+    /// @return the region containing `address`, or failing that, the first region
+    /// after it (nullptr if there is none)
+    const memory_region_t* find_at_or_after(const void *address) const {
+        const memory_region_t *region = find(address);
+        if (region != nullptr) {
+            return region;
+        }
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(address);
+        const size_t idx = std::upper_bound(starts.begin(), starts.end(), addr) - starts.begin();
+        return idx < starts.size() ? &(*regions)[order[idx]] : nullptr;
+    }
+
+    /// @brief Resolve `count` addresses, sorted in ascending order, in a single
+    /// merge-style sweep over the index.
+    /// @param out receives the region containing each address (or nullptr)
+    void find_sorted(const void *const *addresses, size_t count, const memory_region_t **out) const {
+        size_t idx = 0; // number of regions starting at or before the current address
+        for (size_t i = 0; i < count; i++) {
+            const uintptr_t addr = reinterpret_cast<uintptr_t>(addresses[i]);
+            while (idx < starts.size() && starts[idx] <= addr) {
+                idx++;
+            }
+            out[i] = idx > 0 ? containing(idx - 1, addr) : nullptr;
+        }
+    }
+
+    /// @return the first region whose type is `type`, or nullptr if there is none
+    const memory_region_t* find_by_type(const char *type, size_t len) const {
+        const char *interned = STRINGS.find(type, len);
+        if (interned == nullptr) {
+            return nullptr;
+        }
+        std::vector<std::pair<const char*, uint32_t> >::const_iterator it = std::lower_bound(
+            first_of_type.begin(), first_of_type.end(), std::make_pair(interned, (uint32_t)0));
+        return it != first_of_type.end() && it->first == interned ? &(*regions)[it->second] : nullptr;
+    }
+
+    size_t size() const {
+        return starts.size();
+    }
+
+private:
+    const std::vector<memory_region_t> *regions;
+    std::vector<uint32_t> order;    // position in `regions` of the i-th region by address
+    std::vector<uintptr_t> starts;  // sorted
+    std::vector<uintptr_t> ends;
+    std::vector<uintptr_t> max_ends; // max_ends[i] is the largest of ends[0..i]
+    std::vector<std::pair<const char*, uint32_t> > first_of_type; // sorted by interned type
+
+    /// @return the last of the first `idx + 1` regions (by start address) that contains
+    /// `addr`, or nullptr if none does
+    /// @details Without overlaps this looks at region `idx` alone; `max_ends` tells
+    /// when no earlier region can reach `addr`.
+    const memory_region_t* containing(size_t idx, uintptr_t addr) const {
+        while (addr >= ends[idx]) {
+            if (idx == 0 || max_ends[idx - 1] <= addr) {
+                return nullptr;
+            }
+            idx--;
+        }
+        return &(*regions)[order[idx]];
+    }
+};
+
+/// @return the size of a page of memory
+size_t system_page_size();
+
+/// @brief Load the memory layout of process `pid` into `regions`.
+/// @param pid the process to look at, or 0 for the current one
+/// @return false if the process can't be inspected
+bool load_process_memory_layout(int pid, std::vector<memory_region_t> &regions, bool with_usage = true);
+
+/// @brief Name the stacks of threads (other than the main one) in `regions`, the
+/// layout of process `pid` sorted by address, as `stack:<tid>`.
+void label_thread_stacks(int pid, std::vector<memory_region_t> &regions);
 
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) && !defined(__CYGWIN__)
 #include "memlens-windows.hpp"
@@ -32,6 +368,8 @@ void load_memory_layout(std::vector<memory_region_t> &regions);
 #elif defined(__APPLE__)
 #include "memlens-macos.hpp"
 #endif
+#include "memlens-hexdump.hpp"
+#include "memlens-objects.hpp"
 
 uint32_t* prime_factors(uint32_t num);
 
@@ -39,50 +377,183 @@ void print_prime_factors(uint32_t num);
 
 void show_usage(const char *error);
 
+bool take_flag(std::vector<std::string> &args, const char *name);
+
+std::string take_option(std::vector<std::string> &args, const char *name, const std::string &default_value);
+
 void test_throwing_func();
 
+/// @return `symbol+offset` for an address of the current process, or an empty
+/// string if it isn't within a known function or object
+std::string symbol_name(const void *address);
+
+/// @return the address of the function or object `name` in the current process,
+/// or nullptr if there is none
+/// @param size set to the size of the symbol, if known (left as is otherwise)
+void* symbol_address(const std::string &name, size_t &size);
+
 extern std::vector<memory_region_t> MEMORY_REGIONS;
 
-/// @brief Update the memory layout of the current process.
-void update_memory_layout() {
-    MEMORY_REGIONS.clear();
-    load_memory_layout(MEMORY_REGIONS);
+/// @brief index over `MEMORY_REGIONS`, rebuilt on every update
+extern region_index_t MEMORY_INDEX;
+
+/// @brief What changed in the memory layout between two refreshes.
+/// @details Regions are matched by their start address, or by their end address
+/// for regions that grow downwards (like the stack).
+typedef struct {
+    std::vector<memory_region_t> added;
+    std::vector<memory_region_t> removed;
+    std::vector<memory_region_t> grown;     // the new version of each region that got bigger
+    std::vector<memory_region_t> shrunk;    // the new version of each region that got smaller
+
+    void clear() {
+        added.clear();
+        removed.clear();
+        grown.clear();
+        shrunk.clear();
+    }
+
+    bool empty() const {
+        return added.empty() && removed.empty() && grown.empty() && shrunk.empty();
+    }
+} layout_delta_t;
+
+/// @brief bumped whenever a refresh finds that `MEMORY_REGIONS` was added to,
+/// removed from or resized, so that callers can skip work when nothing moved
+extern uint64_t MEMORY_LAYOUT_GENERATION;
+
+/// @brief how commands print their results (`--format`)
+extern output_format_t OUTPUT_FORMAT;
+
+/// @return true if `a` and `b` are the same mapping, possibly resized
+bool same_region(const memory_region_t &a, const memory_region_t &b) {
+    if (a.region_type != b.region_type || a.region_detail != b.region_detail || a.permissions != b.permissions) {
+        return false;
+    }
+    return a.start_address == b.start_address
+        || (uint8_t*)a.start_address + a.size == (uint8_t*)b.start_address + b.size;
 }
 
-/// @return a human readable version of `address`, e.g. stack - 10, or heap + 20
-std::string named_address(const void *address) {
-    size_t offset = 1<<30;
-    std::string result;
-    for (std::vector<memory_region_t>::const_iterator it = MEMORY_REGIONS.begin(); it != MEMORY_REGIONS.end(); ++it) {
-        if (address >= it->start_address && address < (void*)((uint8_t*)it->start_address + it->size)) {
-            if (it->region_type == "stack") {
-                const size_t new_offset = (uint8_t*)it->start_address + it->size - (uint8_t*)address;
-                if (new_offset < offset) {
-                    offset = new_offset;
-                    result = "[stack - " + std::to_string(offset) + "]";
-                }
+/// @brief Refresh `MEMORY_REGIONS` incrementally.
+/// @details The layout is re-read from the plain maps, and merged with the previous
+/// one in a single pass: entries that are still there keep their names & sizes,
+/// resized ones get their new range, removed ones are dropped and new ones come in
+/// where they belong. Usage sizes are then re-read (from smaps, on Linux) for every
+/// entry, as pages come & go without a mapping changing its range (e.g. a heap that
+/// faults pages in). If nothing was added, removed or resized, `MEMORY_INDEX` is kept
+/// and the generation stays put.
+/// @param delta if not null, receives what changed
+/// @param with_usage also load resident/PSS/dirty/swap sizes
+/// @return true if the layout changed
+bool refresh_memory_layout(layout_delta_t *delta, bool with_usage = true) {
+    static thread_local std::vector<memory_region_t> fresh;
+    static thread_local std::vector<memory_region_t> merged;
+    // position (in `merged`) & previous size of each added (size 0) or resized entry
+    static thread_local std::vector<std::pair<size_t, size_t> > changed;
+    fresh.clear();
+    merged.clear();
+    changed.clear();
+    load_memory_layout(fresh, false);
+    if (delta != nullptr) {
+        delta->clear();
+    }
+
+    bool removed = false;
+    size_t i = 0, j = 0;
+    while (i < MEMORY_REGIONS.size() || j < fresh.size()) {
+        const memory_region_t *before = i < MEMORY_REGIONS.size() ? &MEMORY_REGIONS[i] : nullptr;
+        const memory_region_t *after = j < fresh.size() ? &fresh[j] : nullptr;
+        if (before != nullptr && after != nullptr && same_region(*before, *after)) {
+            if (before->start_address != after->start_address || before->size != after->size) {
+                changed.push_back(std::make_pair(merged.size(), before->size));
+                merged.push_back(*after);
             } else {
-                const size_t new_offset = (uint8_t*)address - (uint8_t*)it->start_address;
-                if (new_offset < offset) {
-                    offset = new_offset;
-                    result = "[" + it->region_type + " + " + std::to_string(offset) + "]";
-                }
+                merged.push_back(*before);
             }
+            i++;
+            j++;
+        } else if (after == nullptr || (before != nullptr && before->start_address <= after->start_address)) {
+            removed = true;
+            if (delta != nullptr) {
+                delta->removed.push_back(*before);
+            }
+            i++;
+        } else {
+            changed.push_back(std::make_pair(merged.size(), (size_t)0));
+            merged.push_back(*after);
+            j++;
         }
     }
+    const bool moved = removed || !changed.empty();
+    if (moved) {
+        // MEMORY_INDEX points into MEMORY_REGIONS, so it's rebuilt below
+        MEMORY_REGIONS.swap(merged);
+    }
+
+#ifdef __linux__
+    if (with_usage) {
+        load_memory_usage(MEMORY_REGIONS);
+    }
+#else
+    (void)with_usage; // usage sizes come with the layout here
+#endif
+    if (!moved) {
+        return false;
+    }
+    if (delta != nullptr) {
+        for (size_t k = 0; k < changed.size(); k++) {
+            const memory_region_t &region = MEMORY_REGIONS[changed[k].first];
+            const size_t previous = changed[k].second;
+            (previous == 0 ? delta->added : region.size > previous ? delta->grown : delta->shrunk).push_back(region);
+        }
+    }
+    MEMORY_INDEX.build(MEMORY_REGIONS);
+    MEMORY_LAYOUT_GENERATION++;
+    return true;
+}
+
+/// @brief Update the memory layout of the current process.
+void update_memory_layout() {
+    refresh_memory_layout(nullptr);
+}
+
+/// @return a human readable version of `address` within `region`, e.g. stack - 10,
+/// heap + 20, or code + 4660 = prime_factors(unsigned int)
+std::string named_address(const void *address, const memory_region_t *region) {
     std::stringstream ss;
     ss << std::hex << (void*)address << std::dec;
-    if (!result.empty()) {
-        ss << " @" << result;
+    if (region != nullptr) {
+        if (strncmp(region->region_type.c_str(), "stack", 5) == 0) {
+            ss << " @[" << region->region_type << " - " << (uint8_t*)region->start_address + region->size - (uint8_t*)address << "]";
+        } else {
+            ss << " @[" << region->region_type << " + " << (uint8_t*)address - (uint8_t*)region->start_address;
+            const std::string symbol = region->region_detail.c_str()[0] == '/' ? symbol_name(address) : "";
+            if (!symbol.empty()) {
+                ss << " = " << symbol;
+            }
+            ss << "]";
+        }
     }
     return ss.str();
 }
 
-/// @return the address of the memory region with the given `name`
-void* region_name_to_address(const std::string &name) {
-    for (std::vector<memory_region_t>::const_iterator it = MEMORY_REGIONS.begin(); it != MEMORY_REGIONS.end(); ++it) {
-        if (name == it->region_type) {
-            return it->start_address;
+/// @return a human readable version of `address`, e.g. stack - 10, or heap + 20
+std::string named_address(const void *address) {
+    return named_address(address, MEMORY_INDEX.find(address));
+}
+
+/// @return the address of the memory region, or failing that the function or
+/// object, with the given `name`
+/// @param size set to the size of the function or object, if `name` is one
+void* region_name_to_address(const std::string &name, size_t &size) {
+    const memory_region_t *region = MEMORY_INDEX.find_by_type(name.data(), name.size());
+    if (region != nullptr) {
+        return region->start_address;
+    }
+    if (!name.empty() && (name[0] < '0' || name[0] > '9')) {
+        void *address = symbol_address(name, size);
+        if (address != nullptr) {
+            return address;
         }
     }
     // treat name as an address
@@ -104,8 +575,78 @@ std::string size_str(size_t size) {
     return size_s;
 }
 
-/// @brief Print the memory layout of the current process.
-void print_memory_layout() {
+/// @brief Print a single row of `print_memory_layout()`.
+void print_region(const memory_region_t &region, bool with_usage) {
+    std::string size_s = size_str(region.size);
+    std::string res_s = size_str(region.resident_size);
+
+    std::cout
+        << std::hex
+        << std::setfill(' ')
+        << std::setw(16) << std::right << std::noshowbase << reinterpret_cast<uintptr_t>(region.start_address)
+        << "-"
+        << std::setw(16) << std::left << std::noshowbase << reinterpret_cast<uintptr_t>((uint8_t*)region.start_address + region.size)
+        << " "
+        << std::dec
+        << std::setw(5) << std::right << size_s
+        << " "
+        << std::setw(8) << std::right << res_s;
+    if (with_usage) {
+        std::cout
+            << " " << std::setw(8) << std::right << size_str(region.pss_size)
+            << " " << std::setw(8) << std::right << size_str(region.shared_dirty_size + region.private_dirty_size)
+            << " " << std::setw(8) << std::right << size_str(region.swap_size)
+            << " " << std::setw(8) << std::right << size_str(region.anon_huge_size);
+    }
+    std::cout
+        << "  "
+        << (region.permissions & PERM_READ ? "r" : "-")
+        << (region.permissions & PERM_WRIT ? "w" : "-")
+        << (region.permissions & PERM_EXEC ? "x" : "-")
+        << " "
+        << std::setw(8) << std::right << region.region_type
+        << "  "
+        << (region.region_detail.find("memlens") != std::string::npos ? "/*/memlens" : region.region_detail.c_str())
+        << std::endl;
+}
+
+/// @brief Write `region` as a record (for `--format`).
+void write_region(record_writer_t &records, const memory_region_t &region, bool with_usage) {
+    const char perms[] = {
+        region.permissions & PERM_READ ? 'r' : '-',
+        region.permissions & PERM_WRIT ? 'w' : '-',
+        region.permissions & PERM_EXEC ? 'x' : '-',
+    };
+    records.begin();
+    records.field_hex("start", reinterpret_cast<uintptr_t>(region.start_address));
+    records.field_hex("end", reinterpret_cast<uintptr_t>(region.start_address) + region.size);
+    records.field_uint("size", region.size);
+    records.field_uint("resident", region.resident_size);
+    if (with_usage) {
+        records.field_uint("pss", region.pss_size);
+        records.field_uint("dirty", region.shared_dirty_size + region.private_dirty_size);
+        records.field_uint("swap", region.swap_size);
+        records.field_uint("thp", region.anon_huge_size);
+    }
+    records.field_str("perm", perms, sizeof(perms));
+    records.field_str("type", region.region_type.c_str());
+    records.field_str("detail", region.region_detail.c_str());
+    records.end();
+}
+
+/// @brief Print the memory layout of the current process (or of `regions`, if given).
+/// @param with_usage also print PSS, dirty, swap and THP sizes of each region
+void print_memory_layout(bool with_usage = false, const std::vector<memory_region_t> &regions = MEMORY_REGIONS) {
+    if (OUTPUT_FORMAT != FORMAT_TEXT) {
+        std::cout << std::flush;
+        output_buffer_t out(1);
+        record_writer_t records(out, OUTPUT_FORMAT);
+        for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+            write_region(records, *it, with_usage);
+        }
+        records.finish();
+        return;
+    }
     std::cout
             << std::setfill(' ')
             << std::setw(16) << std::right << "start_addr "
@@ -114,7 +655,15 @@ void print_memory_layout() {
             << " "
             << std::setw(5) << std::right << "range"
             << " "
-            << std::setw(8) << std::right << "resident"
+            << std::setw(8) << std::right << "resident";
+    if (with_usage) {
+        std::cout
+            << " " << std::setw(8) << std::right << "pss"
+            << " " << std::setw(8) << std::right << "dirty"
+            << " " << std::setw(8) << std::right << "swap"
+            << " " << std::setw(8) << std::right << "thp";
+    }
+    std::cout
             << " " << "perm"
             << " "
             << std::setw(8) << std::right << "type"
@@ -124,68 +673,150 @@ void print_memory_layout() {
             << "------------------------------------------------------------"
             << std::endl;
 
-    for (std::vector<memory_region_t>::const_iterator it = MEMORY_REGIONS.begin(); it != MEMORY_REGIONS.end(); ++it) {
-        std::string size_s = size_str(it->size);
-        std::string res_s = size_str(it->resident_size);
+    for (std::vector<memory_region_t>::const_iterator it = regions.begin(); it != regions.end(); ++it) {
+        print_region(*it, with_usage);
+    }
+}
+
+/// @brief Print what changed in the memory layout, as reported by `refresh_memory_layout()`.
+void print_layout_delta(const layout_delta_t &delta) {
+    const struct {
+        const char *label;
+        const std::vector<memory_region_t> *regions;
+    } SECTIONS[] = {
+        {"added", &delta.added},
+        {"removed", &delta.removed},
+        {"grown", &delta.grown},
+        {"shrunk", &delta.shrunk},
+    };
+    if (delta.empty()) {
+        std::cout << "(no change)" << std::endl;
+    }
+    for (size_t i = 0; i < sizeof(SECTIONS) / sizeof(SECTIONS[0]); i++) {
+        if (SECTIONS[i].regions->empty()) {
+            continue;
+        }
+        std::cout << SECTIONS[i].label << ":" << std::endl;
+        for (std::vector<memory_region_t>::const_iterator it = SECTIONS[i].regions->begin(); it != SECTIONS[i].regions->end(); ++it) {
+            print_region(*it, false);
+        }
+    }
+}
 
-        std::cout
-            << std::hex
-            << std::setfill(' ')
-            << std::setw(16) << std::right << std::noshowbase << reinterpret_cast<uintptr_t>(it->start_address)
-            << "-"
-            << std::setw(16) << std::left << std::noshowbase << reinterpret_cast<uintptr_t>((uint8_t*)it->start_address + it->size)
-            << " "
-            << std::dec
-            << std::setw(5) << std::right << size_s
-            << " "
-            << std::setw(8) << std::right << res_s
-            << "  "
-            << (it->permissions & PERM_READ ? "r" : "-")
-            << (it->permissions & PERM_WRIT ? "w" : "-")
-            << (it->permissions & PERM_EXEC ? "x" : "-")
-            << " "
-            << std::setw(8) << std::right << it->region_type
-            << "  "
-            << (it->region_detail.find("memlens") != std::string::npos ? "/*/memlens" : it->region_detail)
-            << std::endl;
+/// @brief Write `size` bytes, read from `address`, as a record per 16 byte row (for
+/// `--format`), with the bytes in hex.
+void write_dump_rows(const uint8_t *bytes, const void *address, size_t size, record_writer_t &records) {
+    static const char HEX[] = "0123456789abcdef";
+    char hex[32];
+    for (size_t offset = 0; offset < size; offset += 16) {
+        const size_t len = size - offset < 16 ? size - offset : 16;
+        for (size_t i = 0; i < len; i++) {
+            hex[2 * i] = HEX[bytes[offset + i] >> 4];
+            hex[2 * i + 1] = HEX[bytes[offset + i] & 0xf];
+        }
+        records.begin();
+        records.field_hex("address", reinterpret_cast<uintptr_t>(address) + offset);
+        records.field_str("bytes", hex, 2 * len);
+        records.end();
     }
 }
 
+/// @brief Mark the `size` bytes at `address`, which couldn't be read, in a hexdump.
+void hexdump_unreadable(const void *address, size_t size, output_buffer_t &out) {
+    out.append_hex(reinterpret_cast<uintptr_t>(address));
+    out.append("-");
+    out.append_hex(reinterpret_cast<uintptr_t>(address) + size);
+    out.append("  (");
+    out.append_dec(size);
+    out.append(" bytes couldn't be read)\n");
+}
+
 /// @brief Dump memory in hexdump format, starting at `address`.
+/// @details Rows are formatted into one large buffer (see memlens-hexdump.hpp),
+/// which is handed to the OS with a single `write()`, instead of going through
+/// `std::cout` a byte at a time.
 /// @param address memory address to dump from
 /// @param size number of bytes to dump
 void dump_memory(const void *address, size_t size) {
-    const uint8_t *end_address = (uint8_t*)address + size;
-    const uint8_t *address_base = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(address) & ~0xf);
-    const size_t offset = (uint8_t*)address - address_base;
-    const size_t rows = (size + offset + 15) / 16;
-    for (size_t row = 0; row < rows; row++) {
-        const uint8_t *row_address = address_base + row * 16;
-        // print row address
-        std::cout << std::hex << std::noshowbase << reinterpret_cast<uintptr_t>(row_address) << "  ";
-        // print hex bytes
-        for (size_t i = 0; i < 16; i++) {
-            const uint8_t *u8_addr = row_address + i;
-            if (u8_addr >= address && u8_addr < end_address) {
-                std::cout << std::hex << std::setfill('0') << std::setw(2) << (int)*u8_addr << " ";
-            } else {
-                std::cout << "   ";
-            }
+    const size_t MAX_BUFFER = 4 * 1024 * 1024;
+    const size_t needed = (size / 16 + 2) * (16 + HEXDUMP_ROW_TAIL) + 1;
+    output_buffer_t out(1, needed < MAX_BUFFER ? needed : MAX_BUFFER);
+    std::cout << std::flush;
+    if (OUTPUT_FORMAT != FORMAT_TEXT) {
+        record_writer_t records(out, OUTPUT_FORMAT);
+        write_dump_rows((const uint8_t*)address, address, size, records);
+        records.finish();
+        return;
+    }
+    hexdump_rows((const uint8_t*)address, address, size, out);
+    out.append_char('\n');
+    out.flush();
+}
+
+/// @brief Dump memory of the process attached to `reader`, in hexdump format.
+/// @details Memory is read (and printed) in large chunks, so that dumping hundreds
+/// of MB costs a handful of syscalls. Pages that can't be read are not dumped, but
+/// marked as such (with `--format`, by a record with no bytes).
+/// @param address memory address (in the attached process) to dump from
+/// @param size number of bytes to dump
+void dump_process_memory(process_reader_t &reader, const void *address, size_t size) {
+    const size_t CHUNK_SIZE = 16 * 1024 * 1024;
+    std::vector<uint8_t> chunk(size < CHUNK_SIZE ? size : CHUNK_SIZE);
+    output_buffer_t out(1, 4 * 1024 * 1024);
+    std::cout << std::flush;
+    record_writer_t records(out, OUTPUT_FORMAT);
+    const size_t page_size = system_page_size();
+    // `len` bytes at `at`, which could be read (into `bytes`) or not
+    const auto write_run = [&](const uint8_t *bytes, const uint8_t *at, size_t len, bool readable) {
+        if (readable && OUTPUT_FORMAT != FORMAT_TEXT) {
+            write_dump_rows(bytes, at, len, records);
+        } else if (readable) {
+            hexdump_rows(bytes, at, len, out);
+        } else if (OUTPUT_FORMAT != FORMAT_TEXT) {
+            records.begin();
+            // the same fields as the rows: no bytes, up to the next record (or the end)
+            records.field_hex("address", reinterpret_cast<uintptr_t>(at));
+            records.field_str("bytes", "", 0);
+            records.end();
+        } else {
+            hexdump_unreadable(at, len, out);
         }
-        // print ascii
-        std::cout << "  |";
-        for (size_t i = 0; i < 16; i++) {
-            const uint8_t *u8_addr = row_address + i;
-            if (u8_addr >= address && u8_addr < end_address) {
-                const uint8_t c = *u8_addr;
-                std::cout << (c >= 32 && c < 127 ? (char)c : '.');
-            } else {
-                std::cout << " ";
+    };
+    const uint8_t *cursor = (const uint8_t*)address;
+    const uint8_t *end = cursor + size;
+    while (cursor < end) {
+        // chunks end on 16 byte boundaries, so that rows don't get split
+        const uint8_t *chunk_end = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(cursor) & ~(uintptr_t)0xf) + CHUNK_SIZE);
+        const size_t len = (chunk_end < end ? chunk_end : end) - cursor;
+        if (reader.read(cursor, &chunk[0], len) == len) {
+            write_run(&chunk[0], cursor, len, true);
+            cursor += len;
+            continue;
+        }
+        // some of it couldn't be read (and came back as zeros): read it again a page
+        // at a time, dumping the runs of pages that could be read, and marking the others
+        const uint8_t *run = cursor;
+        bool run_readable = true;
+        for (const uint8_t *page = cursor; page < cursor + len; ) {
+            const size_t to_boundary = page_size - reinterpret_cast<uintptr_t>(page) % page_size;
+            const size_t piece = to_boundary < (size_t)(cursor + len - page) ? to_boundary : cursor + len - page;
+            const bool readable = reader.read(page, &chunk[page - cursor], piece) == piece;
+            if (readable != run_readable && page > run) {
+                write_run(&chunk[run - cursor], run, page - run, run_readable);
+                run = page;
             }
+            run_readable = readable;
+            page += piece;
         }
-        std::cout << "|" << std::endl;
+        write_run(&chunk[run - cursor], run, cursor + len - run, run_readable);
+        cursor += len;
+    }
+    if (OUTPUT_FORMAT != FORMAT_TEXT) {
+        records.finish();
+    } else {
+        out.append_char('\n');
     }
-    std::cout << std::dec << std::endl;
+    out.flush();
 }
 
 const char* BOLD_MODE = "\033[1m";
@@ -204,44 +835,50 @@ const char* ZONE_COLORS[] = {COLOR_MAGENTA, COLOR_YELLOW, COLOR_BLUE};
 const char* COLOR_RESET = "\033[0m";
 
 void print_address_of(bool cond, void *address, const char *func, const char *name, size_t depth, size_t padlen) {
+    if (!cond) {
+        return;
+    }
     const char *func_color = colors[depth % (sizeof(colors)/sizeof(colors[0]))];
     const char *zone_color;
-    const std::string named_addr = named_address(address);
-    if (named_addr.find("code") != std::string::npos) {
+    const memory_region_t *region = MEMORY_INDEX.find(address);
+    const std::string named_addr = named_address(address, region);
+    if (region != nullptr && region->region_type == "code") {
         zone_color = COLOR_YELLOW;
-    } else if (named_addr.find("stack") != std::string::npos) {
+    } else if (region != nullptr && strncmp(region->region_type.c_str(), "stack", 5) == 0) {
         zone_color = COLOR_BLUE;
-    } else if (named_addr.find("heap") != std::string::npos) {
+    } else if (region != nullptr && region->region_type == "heap") {
         zone_color = COLOR_MAGENTA;
     } else {
         zone_color = func_color;
     }
-    if (cond) {
-        const bool tty = is_term();
-        std::cout
-            << std::setfill(' ')
-            << std::setw(padlen)
-            << "";
-        std::cout
-            << (tty ? func_color : "")
-            << "&[";
-        std::cout
-            << (func == nullptr ? "" : func)
-            << (tty ? BOLD_MODE : "")
-            << name
-            << (tty ? NO_BOLD_MODE : "")
-            << "] = "
-            << (tty ? zone_color : "")
-            << named_addr
-            << (tty ? COLOR_RESET : "")
-            << std::endl;
-    }
+    const bool tty = is_term();
+    std::cout
+        << std::setfill(' ')
+        << std::setw(padlen)
+        << "";
+    std::cout
+        << (tty ? func_color : "")
+        << "&[";
+    std::cout
+        << (func == nullptr ? "" : func)
+        << (tty ? BOLD_MODE : "")
+        << name
+        << (tty ? NO_BOLD_MODE : "")
+        << "] = "
+        << (tty ? zone_color : "")
+        << named_addr
+        << (tty ? COLOR_RESET : "")
+        << std::endl;
 }
 
 #define print_address_of_func(cond, x, depth) print_address_of(cond, (void*)&x, nullptr, "@func{" #x "}", depth, 4*depth)
 #define print_address_of_param(cond, x, depth) print_address_of(cond, (void*)&x, __FUNCTION__, "@param{" #x "}", depth, 4*depth+2)
 #define print_address_of_localvar(cond, x, depth) print_address_of(cond, (void*)&x, __FUNCTION__, "@localvar{" #x "}", depth, 4*depth+2)
 
+/// @brief whether the methods of the Employee classes print where they (and their
+/// objects) are; turned off to time them
+extern bool TRACE_CALLS;
+
 class Employee {
 private:
     int id;
@@ -257,8 +894,8 @@ public:
         typedef int (Employee::* pfunc)() const;
         pfunc fptr = &Employee::salary_per_yr_of_exp;
         uint8_t *f_salary_per_yr_of_exp = *(uint8_t**)&fptr;
-        print_address_of_func(true, *f_salary_per_yr_of_exp, 1);
-        print_address_of_localvar(true, *this, 1);
+        print_address_of_func(TRACE_CALLS, *f_salary_per_yr_of_exp, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
 
         // the only logic of the function is this one-liner here
         return salary / exp_yrs;
@@ -269,12 +906,19 @@ public:
         typedef std::string (Employee::* pfunc)() const;
         pfunc fptr = &Employee::label;
         uint8_t *f_label = *(uint8_t**)&fptr;
-        print_address_of_func(true, *f_label, 1);
-        print_address_of_localvar(true, *this, 1);
+        print_address_of_func(TRACE_CALLS, *f_label, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
 
         // the only logic of the function is this one-liner here
         return "Employee";
     }
+
+    /// no tracing: `bench-dispatch` times calls to this
+    int bonus() const {
+        return salary / 10;
+    }
+
+    MEMLENS_FIELDS(Employee, id, exp_yrs, salary)
 };
 
 class CEO : public Employee {
@@ -287,12 +931,16 @@ public:
         typedef std::string (CEO::* pfunc)() const;
         pfunc fptr = &CEO::label;
         uint8_t *f_label = *(uint8_t**)&fptr;
-        print_address_of_func(true, *f_label, 1);
-        print_address_of_localvar(true, *this, 1);
+        print_address_of_func(TRACE_CALLS, *f_label, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
 
         // the only logic of the function is this one-liner here
         return "CEO";
     }
+
+    int bonus() const {
+        return Employee::bonus() * 5;
+    }
 };
 
 class EmployeeDyn {
@@ -310,8 +958,8 @@ public:
         typedef int (EmployeeDyn::* pfunc)() const;
         pfunc fptr = &EmployeeDyn::salary_per_yr_of_exp;
         uint8_t *f_salary_per_yr_of_exp = *(uint8_t**)&fptr;
-        print_address_of_func(true, *f_salary_per_yr_of_exp, 1);
-        print_address_of_localvar(true, *this, 1);
+        print_address_of_func(TRACE_CALLS, *f_salary_per_yr_of_exp, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
 
         // the only logic of the function is this one-liner here
         return salary / exp_yrs;
@@ -322,12 +970,19 @@ public:
         typedef std::string (EmployeeDyn::* pfunc)() const;
         pfunc fptr = &EmployeeDyn::label;
         uint8_t *f_label = *(uint8_t**)&fptr;
-        print_address_of_func(true, *f_label, 1);
-        print_address_of_localvar(true, *this, 1);
+        print_address_of_func(TRACE_CALLS, *f_label, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
 
         // the only logic of the function is this one-liner here
         return "EmployeeDyn";
     }
+
+    /// no tracing: `bench-dispatch` times calls to this
+    virtual int bonus() const {
+        return salary / 10;
+    }
+
+    MEMLENS_FIELDS(EmployeeDyn, id, exp_yrs, salary)
 };
 
 class CEODyn : public EmployeeDyn {
@@ -340,12 +995,34 @@ public:
         typedef std::string (CEODyn::* pfunc)() const;
         pfunc fptr = &CEODyn::label;
         uint8_t *f_label = *(uint8_t**)&fptr;
-        print_address_of_func(true, *f_label, 1);
-        print_address_of_localvar(true, *this, 1);
+        print_address_of_func(TRACE_CALLS, *f_label, 1);
+        print_address_of_localvar(TRACE_CALLS, *this, 1);
 
         // the only logic of the function is this one-liner here
         return "CEODyn";
     }
+
+    int bonus() const override {
+        return EmployeeDyn::bonus() * 5;
+    }
 };
 
+// layouts are known at compile time, so they can be checked there too
+static_assert(memlens::layout_of<Employee>().padding == 0, "Employee should have no padding");
+static_assert(memlens::layout_of<CEODyn>().size == memlens::layout_of<EmployeeDyn>().size, "CEODyn adds no fields to EmployeeDyn");
+
+#include "memlens-residency.hpp"
+#include "memlens-symbols.hpp"
+#include "memlens-bench.hpp"
+#include "memlens-dispatch.hpp"
+#include "memlens-exceptions.hpp"
+#include "memlens-allocs.hpp"
+#include "memlens-stacks.hpp"
+#include "memlens-scan.hpp"
+#include "memlens-dedup.hpp"
+#include "memlens-watch.hpp"
+#include "memlens-snapshot.hpp"
+#include "memlens-heap.hpp"
+#include "memlens-profile.hpp"
+
 #endif // MEMLENS_HPP